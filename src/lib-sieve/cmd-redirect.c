@@ -85,6 +85,8 @@ static int act_redirect_check_duplicate
 	(const struct sieve_runtime_env *renv,
 		const struct sieve_action *act,
 		const struct sieve_action *act_other);
+static const char *act_redirect_get_target
+	(const struct sieve_script_env *senv, const struct sieve_action *act);
 static void act_redirect_print
 	(const struct sieve_action *action, const struct sieve_result_print_env *rpenv,
 		bool *keep);
@@ -97,6 +99,7 @@ const struct sieve_action_def act_redirect = {
 	.flags = SIEVE_ACTFLAG_TRIES_DELIVER,
 	.equals = act_redirect_equals,
 	.check_duplicate = act_redirect_check_duplicate,
+	.get_target = act_redirect_get_target,
 	.print = act_redirect_print,
 	.commit = act_redirect_commit
 };
@@ -292,6 +295,17 @@ static int act_redirect_check_duplicate
 	return ( act_redirect_equals(renv->scriptenv, act, act_other) ? 1 : 0 );
 }
 
+static const char *act_redirect_get_target
+(const struct sieve_script_env *senv ATTR_UNUSED,
+	const struct sieve_action *act)
+{
+	struct act_redirect_context *rd_ctx =
+		(struct act_redirect_context *) act->context;
+
+	/* Must match sieve_address_compare() */
+	return t_str_lcase(rd_ctx->to_address);
+}
+
 static void act_redirect_print
 (const struct sieve_action *action,
 	const struct sieve_result_print_env *rpenv, bool *keep)
@@ -39,7 +39,8 @@ const struct sieve_comparator_def i_ascii_casemap_comparator = {
 		SIEVE_COMPARATOR_FLAG_PREFIX_MATCH,
 	.compare = cmp_i_ascii_casemap_compare,
 	.char_match = cmp_i_ascii_casemap_char_match,
-	.char_skip = sieve_comparator_octet_skip
+	.char_skip = sieve_comparator_octet_skip,
+	.substring_match = sieve_comparator_ascii_casemap_substring_match
 };
 
 /*
@@ -53,18 +54,18 @@ static int cmp_i_ascii_casemap_compare(
 	int result;
 
 	if ( val1_size == val2_size ) {
-		return strncasecmp(val1, val2, val1_size);
+		return sieve_ascii_casemap_compare(val1, val2, val1_size);
 	}
 
 	if ( val1_size > val2_size ) {
-		result = strncasecmp(val1, val2, val2_size);
+		result = sieve_ascii_casemap_compare(val1, val2, val2_size);
 
 		if ( result == 0 ) return 1;
 
 		return result;
 	}
 
-	result = strncasecmp(val1, val2, val1_size);
+	result = sieve_ascii_casemap_compare(val1, val2, val1_size);
 
 	if ( result == 0 ) return -1;
 
@@ -76,24 +77,19 @@ static bool cmp_i_ascii_casemap_char_match
 		const char **val, const char *val_end,
 		const char **key, const char *key_end)
 {
-	const char *val_begin = *val;
-	const char *key_begin = *key;
+	size_t key_size;
 
-	while ( i_tolower(**val) == i_tolower(**key) &&
-		*val < val_end && *key < key_end ) {
-		(*val)++;
-		(*key)++;
-	}
-
-	if ( *key < key_end ) {
-		/* Reset */
-		*val = val_begin;
-		*key = key_begin;
+	if ( *key >= key_end )
+		return TRUE;
+	if ( *val >= val_end )
+		return FALSE;
 
+	key_size = key_end - *key;
+	if ( (size_t)(val_end - *val) < key_size ||
+		sieve_ascii_casemap_mismatch(*val, *key, key_size) < key_size )
 		return FALSE;
-	}
 
+	*val += key_size;
+	*key += key_size;
 	return TRUE;
 }
-
-
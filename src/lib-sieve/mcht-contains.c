@@ -36,9 +36,6 @@ const struct sieve_match_type_def contains_match_type = {
  * Match-type implementation
  */
 
-/* FIXME: Naive substring match implementation. Should switch to more
- * efficient algorithm if large values need to be searched (e.g. message body).
- */
 static int mcht_contains_match_key
 (struct sieve_match_context *mctx, const char *val, size_t val_size,
 	const char *key, size_t key_size)
@@ -52,7 +49,17 @@ static int mcht_contains_match_key
 	if ( val_size == 0 )
 		return ( key_size == 0 );
 
-	if ( cmp->def == NULL || cmp->def->char_match == NULL )
+	if ( cmp->def == NULL )
+		return FALSE;
+
+	/* Use the comparator's substring search if it has one */
+	if ( cmp->def->substring_match != NULL ) {
+		return ( cmp->def->substring_match
+			(cmp, val, val_size, key, key_size) ? 1 : 0 );
+	}
+
+	/* Naive substring match */
+	if ( cmp->def->char_match == NULL )
 		return FALSE;
 
 	while ( (vp < vend) && (kp < kend) ) {
@@ -62,5 +69,3 @@ static int mcht_contains_match_key
 
 	return (kp == kend);
 }
-
-
@@ -6,7 +6,12 @@
 
 #include "lib.h"
 #include "str.h"
+#include "str-sanitize.h"
+#include "array.h"
 
+#include "sieve-common.h"
+#include "sieve-stringlist.h"
+#include "sieve-runtime-trace.h"
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
 #include "sieve-match.h"
@@ -18,9 +23,10 @@
  * Forward declarations
  */
 
-static int mcht_matches_match_key
+static void mcht_matches_match_init(struct sieve_match_context *mctx);
+static int mcht_matches_match_keys
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
-		const char *key, size_t key_size);
+		struct sieve_stringlist *key_list);
 
 /*
  * Match-type object
@@ -30,9 +36,121 @@ const struct sieve_match_type_def matches_match_type = {
 	SIEVE_OBJECT("matches",
 		&match_type_operand, SIEVE_MATCH_TYPE_MATCHES),
 	.validate_context = sieve_match_substring_validate_context,
-	.match_key = mcht_matches_match_key
+	.match_init = mcht_matches_match_init,
+	.match_keys = mcht_matches_match_keys
 };
 
+/*
+ * Match-type context
+ */
+
+/* Each key is split into the literal sections between its wildcards only once
+ * per match, rather than once for every value it is matched against. Escape
+ * sequences are resolved at that point and, for the core comparators, each
+ * section gets a precompiled substring search for finding it at an arbitrary
+ * offset in the value.
+ */
+
+struct mcht_matches_section {
+	const char *data;
+	size_t size;
+
+	/* Key offset of the wildcard that ends this section (or the key end) */
+	size_t end;
+	char wcard;
+
+	struct sieve_substring_search *search;
+};
+
+struct mcht_matches_key {
+	const char *key;
+	size_t key_size;
+
+	ARRAY(struct mcht_matches_section) sections;
+
+	/* Key offset -> index + 1 of the section starting there */
+	unsigned int *section_index;
+};
+
+struct mcht_matches_context {
+	ARRAY(struct mcht_matches_key) keys;
+
+	unsigned int all_compiled:1;
+};
+
+static void mcht_matches_match_init
+(struct sieve_match_context *mctx)
+{
+	struct mcht_matches_context *ctx;
+
+	ctx = p_new(mctx->pool, struct mcht_matches_context, 1);
+	p_array_init(&ctx->keys, mctx->pool, 4);
+
+	mctx->data = (void *) ctx;
+}
+
+static void mcht_matches_key_compile
+(struct sieve_match_context *mctx, struct mcht_matches_key *mkey,
+	const char *key, size_t key_size)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	pool_t pool = mctx->pool;
+	string_t *section;
+	bool search, casemap;
+	char *data;
+	size_t pos = 0;
+
+	/* Substring search is only available for the core comparators */
+	casemap = sieve_comparator_is(cmp, i_ascii_casemap_comparator);
+	search = ( casemap || sieve_comparator_is(cmp, i_octet_comparator) );
+
+	data = p_malloc(pool, key_size + 1);
+	memcpy(data, key, key_size);
+	mkey->key = data;
+	mkey->key_size = key_size;
+
+	mkey->section_index = p_new(pool, unsigned int, key_size + 1);
+	p_array_init(&mkey->sections, pool, 4);
+
+	section = t_str_new(32);
+	for (;;) {
+		struct mcht_matches_section *msection;
+		size_t start = pos;
+
+		/* Find next wildcard and resolve escape sequences */
+		str_truncate(section, 0);
+		while ( pos < key_size && key[pos] != '*' && key[pos] != '?' ) {
+			if ( key[pos] == '\\' ) {
+				if ( ++pos == key_size )
+					break;
+			}
+			str_append_c(section, key[pos]);
+			pos++;
+		}
+
+		data = p_malloc(pool, section->size + 1);
+		memcpy(data, str_data(section), section->size);
+
+		msection = array_append_space(&mkey->sections);
+		msection->data = data;
+		msection->size = section->size;
+		msection->end = pos;
+		msection->wcard = ( pos < key_size ? key[pos] : '\0' );
+		if ( search && msection->size > 0 ) {
+			msection->search = sieve_substring_search_create
+				(pool, data, msection->size, casemap);
+		}
+
+		mkey->section_index[start] = array_count(&mkey->sections);
+
+		if ( pos >= key_size )
+			break;
+
+		/* Skip wildcard */
+		pos++;
+	}
+}
+
 /*
  * Match-type implementation
  */
@@ -45,49 +163,61 @@ const struct sieve_match_type_def matches_match_type = {
 #define debug_printf(...)
 #endif
 
-/* FIXME: Naive implementation, substitute this with dovecot src/lib/str-find.c
- */
 static inline bool _string_find(const struct sieve_comparator *cmp,
-	const char **valp, const char *vend, const char **keyp, const char *kend)
+	const struct mcht_matches_section *section,
+	const char **valp, const char *vend)
 {
-	while ( (*valp < vend) && (*keyp < kend) ) {
-		if ( !cmp->def->char_match(cmp, valp, vend, keyp, kend) )
+	const char *kp, *kend;
+
+	if ( section->search != NULL ) {
+		const char *found = sieve_substring_search_find
+			(section->search, *valp, vend - *valp);
+
+		if ( found == NULL )
+			return FALSE;
+		*valp = found + section->size;
+		return TRUE;
+	}
+
+	/* Naive search using the comparator */
+	kp = section->data;
+	kend = section->data + section->size;
+	while ( (*valp < vend) && (kp < kend) ) {
+		if ( !cmp->def->char_match(cmp, valp, vend, &kp, kend) )
 			(*valp)++;
 	}
 
-	return (*keyp == kend);
+	return (kp == kend);
 }
 
 static char _scan_key_section
-	(string_t *section, const char **wcardp, const char *key_end)
+(const struct mcht_matches_key *mkey, const char **wcardp,
+	const struct mcht_matches_section **section_r)
 {
-	/* Find next wildcard and resolve escape sequences */
-	str_truncate(section, 0);
-	while ( *wcardp < key_end && **wcardp != '*' && **wcardp != '?') {
-		if ( **wcardp == '\\' ) {
-			(*wcardp)++;
-		}
-		str_append_c(section, **wcardp);
-		(*wcardp)++;
-	}
+	const struct mcht_matches_section *section;
+	unsigned int idx;
 
-	/* Record wildcard character or \0 */
-	if ( *wcardp < key_end ) {
-		return **wcardp;
-	}
+	/* Find the section starting here and skip to its wildcard */
+	idx = mkey->section_index[*wcardp - mkey->key];
+	i_assert( idx > 0 );
+
+	section = array_idx(&mkey->sections, idx - 1);
+	*wcardp = mkey->key + section->end;
+	*section_r = section;
 
-	i_assert( *wcardp == key_end );
-	return '\0';
+	/* Record wildcard character or \0 */
+	return section->wcard;
 }
 
 static int mcht_matches_match_key
 (struct sieve_match_context *mctx, const char *val, size_t val_size,
-	const char *key, size_t key_size)
+	const struct mcht_matches_key *mkey)
 {
 	const struct sieve_comparator *cmp = mctx->comparator;
 	struct sieve_match_values *mvalues;
 	string_t *mvalue = NULL, *mchars = NULL;
-	string_t *section, *subsection;
+	const struct mcht_matches_section *section, *subsection;
+	const char *key = mkey->key;
 	const char *vend, *kend, *vp, *kp, *wp, *pvp;
 	bool backtrack = FALSE; /* TRUE: match of '?'-connected sections failed */
 	char wcard = '\0';      /* Current wildcard */
@@ -98,12 +228,12 @@ static int mcht_matches_match_key
 		return FALSE;
 
 	/* Key sections */
-	section = t_str_new(32);    /* Section (after beginning or *) */
-	subsection = t_str_new(32); /* Sub-section (after ?) */
+	section = NULL;             /* Section (after beginning or *) */
+	subsection = NULL;          /* Sub-section (after ?) */
 
 	/* Mark end of value and key */
 	vend = (const char *) val + val_size;
-	kend = (const char *) key + key_size;
+	kend = (const char *) key + mkey->key_size;
 
 	/* Initialize pointers */
 	vp = val;                   /* Value pointer */
@@ -142,9 +272,9 @@ static int mcht_matches_match_key
 			/* Find the needle to look for in the string */
 			key_offset = 0;
 			for (;;) {
-				next_wcard = _scan_key_section(section, &wp, kend);
+				next_wcard = _scan_key_section(mkey, &wp, &section);
 
-				if ( wcard == '\0' || str_len(section) > 0 )
+				if ( wcard == '\0' || section->size > 0 )
 					break;
 
 				if ( next_wcard == '*' ) {
@@ -170,8 +300,8 @@ static int mcht_matches_match_key
 		}
 
 		/* Determine what we are looking for */
-		needle = str_c(section);
-		nend = PTR_OFFSET(needle, str_len(section));
+		needle = section->data;
+		nend = PTR_OFFSET(needle, section->size);
 
 		debug_printf("  section needle:  '%s'\n", t_strdup_until(needle, nend));
 		debug_printf("  section key:     '%s'\n", t_strdup_until(kp, kend));
@@ -198,13 +328,13 @@ static int mcht_matches_match_key
 				debug_printf("next_wcard = NUL; must find needle at end\n");
 
 				/* Check if the value is still large enough */
-				if ( vend - str_len(section) < vp ) {
+				if ( vend - section->size < vp ) {
 					debug_printf("  wont match: value is too short\n");
 					break;
 				}
 
 				/* Move value pointer to where the needle should be */
-				vp = PTR_OFFSET(vend, -str_len(section));
+				vp = PTR_OFFSET(vend, -section->size);
 
 				/* Record match values */
 				qend = vp;
@@ -266,18 +396,18 @@ static int mcht_matches_match_key
 
 				/* Match may happen at any offset (>= key offset): find substring */
 				vp += key_offset;
-				if ( (vp >= vend) || !_string_find(cmp, &vp, vend, &needle, nend) ) {
+				if ( (vp >= vend) || !_string_find(cmp, section, &vp, vend) ) {
 					debug_printf("  failed to find needle at an offset\n");
 					break;
 				}
 
-				prv = vp - str_len(section);
+				prv = vp - section->size;
 				prk = kp;
 				prw = wp;
 
 				/* Append match values */
 				if ( mvalues != NULL ) {
-					const char *qend = vp - str_len(section);
+					const char *qend = vp - section->size;
 					const char *qp = qend - key_offset;
 
 					/* Append '*' match value */
@@ -306,13 +436,13 @@ static int mcht_matches_match_key
 				vp++;
 
 				/* Scan for next '?' wildcard */
-				next_wcard = _scan_key_section(subsection, &wp, kend);
+				next_wcard = _scan_key_section(mkey, &wp, &subsection);
 				debug_printf("found next wildcard '%c' at pos [%d] (fixed match)\n",
 					next_wcard, (int) (wp-key));
 
 				/* Determine what we are looking for */
-				needle = str_c(subsection);
-				nend = PTR_OFFSET(needle, str_len(subsection));
+				needle = subsection->data;
+				nend = PTR_OFFSET(needle, subsection->size);
 
 				debug_printf("  sub key:       '%s'\n", t_strdup_until(needle, nend));
 				debug_printf("  value remnant: '%s'\n", vp <= vend ? t_strdup_until(vp, vend) : "");
@@ -436,3 +566,78 @@ static int mcht_matches_match_key
 	return FALSE;
 }
 
+
+static int mcht_matches_match_keys
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	struct sieve_stringlist *key_list)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	struct mcht_matches_context *ctx =
+		(struct mcht_matches_context *) mctx->data;
+	int match;
+
+	if ( !ctx->all_compiled ) {
+		string_t *key_item = NULL;
+		unsigned int i;
+		int ret;
+
+		/* Keys still need to be compiled */
+
+		i = 0;
+		match = 0;
+		while ( match == 0 &&
+			(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+
+			T_BEGIN {
+				const struct mcht_matches_key *mkey;
+
+				if ( i >= array_count(&ctx->keys) ) {
+					mcht_matches_key_compile(mctx,
+						array_append_space(&ctx->keys),
+						str_c(key_item), str_len(key_item));
+				}
+				mkey = array_idx(&ctx->keys, i);
+
+				match = mcht_matches_match_key(mctx, val, val_size, mkey);
+
+				if ( mctx->trace ) {
+					sieve_runtime_trace(renv, 0,
+						"with key `%s' => %d", str_sanitize(str_c(key_item), 80),
+						match);
+				}
+			} T_END;
+
+			i++;
+		}
+
+		if ( ret == 0 ) {
+			ctx->all_compiled = TRUE;
+		} else if ( ret < 0 ) {
+			mctx->exec_status = key_list->exec_status;
+			match = -1;
+		}
+
+	} else {
+		const struct mcht_matches_key *mkeys;
+		unsigned int i, count;
+
+		/* Keys are compiled */
+
+		mkeys = array_get(&ctx->keys, &count);
+
+		match = 0;
+		for ( i = 0; match == 0 && i < count; i++ ) {
+			T_BEGIN {
+				match = mcht_matches_match_key(mctx, val, val_size, &mkeys[i]);
+
+				if ( mctx->trace ) {
+					sieve_runtime_trace(renv, 0,
+						"with key `%s' => %d", str_sanitize(mkeys[i].key, 80),
+						match);
+				}
+			} T_END;
+		}
+	}
+
+	return match;
+}
@@ -14,6 +14,7 @@
 #include "sieve-code.h"
 #include "sieve-message.h"
 #include "sieve-interpreter.h"
+#include "sieve-match.h"
 
 #include "ext-body-common.h"
 
@@ -34,11 +35,12 @@ struct ext_body_stringlist {
 	struct sieve_message_part_data *body_parts_iter;
 };
 
+static const char * const _no_content_types[] = { "", NULL };
+
 int ext_body_get_part_list
 (const struct sieve_runtime_env *renv, enum tst_body_transform transform,
 	const char * const *content_types, struct sieve_stringlist **strlist_r)
 {
-	static const char * const _no_content_types[] = { "", NULL };
 	struct ext_body_stringlist *strlist;
 	struct sieve_message_part_data *body_parts = NULL;
 	int ret;
@@ -100,3 +102,74 @@ static void ext_body_stringlist_reset
 
 	strlist->body_parts_iter = strlist->body_parts;
 }
+
+/*
+ * Streamed body matching
+ */
+
+static bool ext_body_match_part_begin(void *context)
+{
+	return sieve_match_stream_value_begin
+		((struct sieve_match_stream *) context);
+}
+
+static bool ext_body_match_part_more
+(void *context, const void *data, size_t size)
+{
+	return sieve_match_stream_value_more
+		((struct sieve_match_stream *) context, data, size);
+}
+
+static bool ext_body_match_part_end(void *context)
+{
+	return sieve_match_stream_value_end
+		((struct sieve_match_stream *) context);
+}
+
+static const struct sieve_message_body_sink ext_body_match_sink = {
+	.part_begin = ext_body_match_part_begin,
+	.part_more = ext_body_match_part_more,
+	.part_end = ext_body_match_part_end
+};
+
+int ext_body_match_stream
+(const struct sieve_runtime_env *renv, enum tst_body_transform transform,
+	const char * const *content_types,
+	const struct sieve_match_type *mcht, const struct sieve_comparator *cmp,
+	struct sieve_stringlist *key_list, int *match_r)
+{
+	struct sieve_match_stream *mstream;
+	int match, ret;
+
+	*match_r = 0;
+
+	if ( content_types == NULL ) content_types = _no_content_types;
+
+	if ( (ret=sieve_match_stream_begin
+		(renv, mcht, cmp, key_list, &mstream)) <= 0 )
+		return ret;
+
+	switch ( transform ) {
+	case TST_BODY_TRANSFORM_RAW:
+		ret = sieve_message_body_stream_raw
+			(renv, &ext_body_match_sink, mstream);
+		break;
+	case TST_BODY_TRANSFORM_CONTENT:
+		ret = sieve_message_body_stream_content
+			(renv, content_types, &ext_body_match_sink, mstream);
+		break;
+	case TST_BODY_TRANSFORM_TEXT:
+		ret = sieve_message_body_stream_text
+			(renv, &ext_body_match_sink, mstream);
+		break;
+	default:
+		i_unreached();
+	}
+
+	match = sieve_match_stream_end(&mstream);
+	if ( ret <= 0 )
+		return ret;
+
+	*match_r = match;
+	return SIEVE_EXEC_OK;
+}
@@ -40,4 +40,13 @@ int ext_body_get_part_list
 	(const struct sieve_runtime_env *renv, enum tst_body_transform transform,
 		const char * const *content_types, struct sieve_stringlist **strlist_r);
 
+/* Matches the body parts block by block, without holding large parts in
+   memory; only for match types and comparators supported by
+   sieve_match_stream_supported(). */
+int ext_body_match_stream
+	(const struct sieve_runtime_env *renv, enum tst_body_transform transform,
+		const char * const *content_types,
+		const struct sieve_match_type *mcht, const struct sieve_comparator *cmp,
+		struct sieve_stringlist *key_list, int *match_r);
+
 #endif /* __EXT_BODY_COMMON_H */
@@ -362,6 +362,19 @@ static int ext_body_operation_execute
 
 	sieve_runtime_trace(renv, SIEVE_TRLVL_TESTS, "body test");
 
+	/* Match values are never produced for the body test (as required by RFC),
+	 * so the body can be matched as a stream if the match type allows it.
+	 */
+	if ( sieve_match_stream_supported(&mcht, &cmp) ) {
+		if ( (ret=ext_body_match_stream(renv,
+			(enum tst_body_transform) transform, content_types, &mcht, &cmp,
+			key_list, &match)) <= 0 )
+			return ret;
+
+		sieve_interpreter_set_test_result(renv->interp, match > 0);
+		return SIEVE_EXEC_OK;
+	}
+
 	/* Extract requested parts */
 	if ( (ret=ext_body_get_part_list(renv,
 		(enum tst_body_transform) transform, content_types,&value_list)) <= 0 )
@@ -78,6 +78,7 @@ bool ext_include_load
 	struct ext_include_context *ctx;
 	const char *location;
 	unsigned long long int uint_setting;
+	sieve_number_t duration;
 
 	if ( *context != NULL ) {
 		ext_include_unload(ext);
@@ -111,6 +112,11 @@ bool ext_include_load
 		ctx->max_includes = (unsigned int) uint_setting;
 	}
 
+	if ( sieve_setting_get_duration_value
+		(svinst, "sieve_include_validation_ttl", &duration) ) {
+		ctx->validation_ttl = (unsigned int) duration;
+	}
+
 	/* Extension dependencies */
 	ctx->var_ext = sieve_ext_variables_get_extension(ext->svinst);
 
@@ -152,6 +158,10 @@ struct sieve_storage *ext_include_get_script_storage
 		if ( ctx->personal_storage == NULL ) {
 			ctx->personal_storage = sieve_storage_create_main
 				(svinst, NULL, 0, error_r);
+			if ( ctx->personal_storage != NULL ) {
+				sieve_storage_set_status_cache_ttl
+					(ctx->personal_storage, ctx->validation_ttl);
+			}
 		}
 		return ctx->personal_storage;
 
@@ -166,6 +176,10 @@ struct sieve_storage *ext_include_get_script_storage
 		if ( ctx->global_storage == NULL ) {
 			ctx->global_storage = sieve_storage_create
 				(svinst, ctx->global_location, 0, error_r);
+			if ( ctx->global_storage != NULL ) {
+				sieve_storage_set_status_cache_ttl
+					(ctx->global_storage, ctx->validation_ttl);
+			}
 		}
 		return ctx->global_storage;
 	default:
@@ -115,6 +115,7 @@ struct ext_include_context {
 
 	unsigned int max_nesting_depth;
 	unsigned int max_includes;
+	unsigned int validation_ttl;
 };
 
 static inline struct ext_include_context *ext_include_get_context
@@ -0,0 +1,349 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "buffer.h"
+#include "str.h"
+#include "hash.h"
+
+#include "ext-regex-cache.h"
+
+#ifdef HAVE_PCRE2
+#  define PCRE2_CODE_UNIT_WIDTH 8
+#  include <pcre2.h>
+#endif
+
+/*
+ * Configuration
+ */
+
+#define EXT_REGEX_CACHE_MAX_ENTRIES 256
+
+/*
+ * Compiled regular expression
+ */
+
+struct ext_regex {
+	enum ext_regex_engine engine;
+
+	regex_t regexp;
+#ifdef HAVE_PCRE2
+	pcre2_code *code;
+	pcre2_match_data *match_data;
+#endif
+};
+
+/* Wrapper around the regerror function for easy access */
+const char *ext_regex_error(const regex_t *regexp, int errorcode)
+{
+	size_t errsize = regerror(errorcode, regexp, NULL, 0);
+
+	if ( errsize > 0 ) {
+		char *errbuf;
+
+		buffer_t *error_buf =
+			buffer_create_dynamic(pool_datastack_create(), errsize);
+		errbuf = buffer_get_space_unsafe(error_buf, 0, errsize);
+
+		errsize = regerror(errorcode, regexp, errbuf, errsize);
+
+		/* We don't want the error to start with a capital letter */
+		errbuf[0] = i_tolower(errbuf[0]);
+
+		buffer_append_space_unsafe(error_buf, errsize);
+
+		return str_c(error_buf);
+	}
+
+	return "";
+}
+
+#ifdef HAVE_PCRE2
+
+static uint32_t ext_regex_pcre2_options(int cflags)
+{
+	uint32_t options = 0;
+
+#ifdef PCRE2_MATCH_INVALID_UTF
+	/* Header values need not be valid UTF-8; older PCRE2 versions refuse to
+	   match those at all in UTF mode, so these match octets instead */
+	options |= PCRE2_UTF | PCRE2_MATCH_INVALID_UTF;
+#endif
+	if ( (cflags & REG_ICASE) != 0 )
+		options |= PCRE2_CASELESS;
+	if ( (cflags & REG_NOSUB) != 0 )
+		options |= PCRE2_NO_AUTO_CAPTURE;
+	return options;
+}
+
+static pcre2_code *ext_regex_pcre2_compile
+(const char *regex_str, int cflags, const char **error_r)
+{
+	pcre2_code *code;
+	PCRE2_SIZE erroffset;
+	int errcode;
+
+	code = pcre2_compile((PCRE2_SPTR) regex_str, PCRE2_ZERO_TERMINATED,
+		ext_regex_pcre2_options(cflags), &errcode, &erroffset, NULL);
+	if ( code == NULL ) {
+		unsigned char errbuf[256];
+
+		if ( pcre2_get_error_message(errcode, errbuf, sizeof(errbuf)) < 0 )
+			i_strocpy((char *) errbuf, "unknown error", sizeof(errbuf));
+		errbuf[0] = i_tolower(errbuf[0]);
+
+		*error_r = t_strdup_printf("%s at offset %llu",
+			(const char *) errbuf, (unsigned long long) erroffset);
+		return NULL;
+	}
+	return code;
+}
+
+#endif
+
+bool ext_regex_check
+(enum ext_regex_engine engine, const char *regex_str, int cflags,
+	const char **error_r)
+{
+	regex_t regexp;
+	int ret;
+
+#ifdef HAVE_PCRE2
+	if ( engine == EXT_REGEX_ENGINE_PCRE2 ) {
+		pcre2_code *code;
+
+		if ( (code=ext_regex_pcre2_compile(regex_str, cflags, error_r)) == NULL )
+			return FALSE;
+		pcre2_code_free(code);
+		return TRUE;
+	}
+#else
+	i_assert( engine == EXT_REGEX_ENGINE_POSIX );
+#endif
+
+	if ( (ret=regcomp(&regexp, regex_str, cflags)) != 0 ) {
+		*error_r = ext_regex_error(&regexp, ret);
+		regfree(&regexp);
+		return FALSE;
+	}
+
+	regfree(&regexp);
+	return TRUE;
+}
+
+static bool ext_regex_compile
+(struct ext_regex *regex, enum ext_regex_engine engine,
+	const char *regex_str, int cflags, const char **error_r)
+{
+	int ret;
+
+	regex->engine = engine;
+
+#ifdef HAVE_PCRE2
+	if ( engine == EXT_REGEX_ENGINE_PCRE2 ) {
+		regex->code = ext_regex_pcre2_compile(regex_str, cflags, error_r);
+		if ( regex->code == NULL )
+			return FALSE;
+
+		/* Falls back to the interpreter if JIT is not available */
+		(void)pcre2_jit_compile(regex->code, PCRE2_JIT_COMPLETE);
+
+		regex->match_data =
+			pcre2_match_data_create_from_pattern(regex->code, NULL);
+		return TRUE;
+	}
+#endif
+
+	if ( (ret=regcomp(&regex->regexp, regex_str, cflags)) != 0 ) {
+		*error_r = ext_regex_error(&regex->regexp, ret);
+		regfree(&regex->regexp);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void ext_regex_free(struct ext_regex *regex)
+{
+#ifdef HAVE_PCRE2
+	if ( regex->engine == EXT_REGEX_ENGINE_PCRE2 ) {
+		pcre2_match_data_free(regex->match_data);
+		pcre2_code_free(regex->code);
+		return;
+	}
+#endif
+	regfree(&regex->regexp);
+}
+
+int ext_regex_exec
+(const struct ext_regex *regex, const char *val, size_t val_size,
+	regmatch_t *pmatch, size_t nmatch)
+{
+#ifdef HAVE_PCRE2
+	if ( regex->engine == EXT_REGEX_ENGINE_PCRE2 ) {
+		PCRE2_SIZE *ovector;
+		uint32_t count;
+		size_t i;
+		int ret;
+
+		ret = pcre2_match(regex->code, (PCRE2_SPTR) val, val_size, 0, 0,
+			regex->match_data, NULL);
+		if ( ret < 0 ) {
+			/* No match, or matching failed (e.g. match limit exceeded) */
+			return 0;
+		}
+
+		/* Map sub-expression offsets onto the POSIX representation */
+		ovector = pcre2_get_ovector_pointer(regex->match_data);
+		count = ( ret == 0 ?
+			pcre2_get_ovector_count(regex->match_data) : (uint32_t) ret );
+		for ( i = 0; i < nmatch; i++ ) {
+			if ( i < count && ovector[2*i] != PCRE2_UNSET ) {
+				pmatch[i].rm_so = (regoff_t) ovector[2*i];
+				pmatch[i].rm_eo = (regoff_t) ovector[2*i+1];
+			} else {
+				pmatch[i].rm_so = -1;
+				pmatch[i].rm_eo = -1;
+			}
+		}
+		return 1;
+	}
+#endif
+
+	return ( regexec(&regex->regexp, val, nmatch, pmatch, 0) == 0 ? 1 : 0 );
+}
+
+/*
+ * Cache
+ */
+
+/* Compiled regular expressions are independent of the Sieve instance, so they
+   are shared by all scripts and messages handled by this process. Entries
+   that are still referenced by an active match are never evicted; the cache
+   may temporarily grow beyond its limit for that reason.
+ */
+
+struct ext_regex_cache_entry {
+	/* Must be first; the compiled expression handed out by the cache is
+	   mapped back to its entry when released */
+	struct ext_regex regex;
+	char *key;
+
+	unsigned int refcount;
+	unsigned int last_used;
+};
+
+static HASH_TABLE(char *, struct ext_regex_cache_entry *) ext_regex_cache;
+static struct ext_regex_cache_stats ext_regex_cache_stats;
+static unsigned int ext_regex_cache_use_counter;
+
+static void ext_regex_cache_deinit(void);
+
+static void ext_regex_cache_entry_free
+(struct ext_regex_cache_entry **_entry)
+{
+	struct ext_regex_cache_entry *entry = *_entry;
+
+	*_entry = NULL;
+
+	ext_regex_free(&entry->regex);
+	i_free(entry->key);
+	i_free(entry);
+}
+
+static void ext_regex_cache_evict(void)
+{
+	struct hash_iterate_context *hctx;
+	struct ext_regex_cache_entry *entry, *oldest = NULL;
+	char *key;
+
+	hctx = hash_table_iterate_init(ext_regex_cache);
+	while ( hash_table_iterate(hctx, ext_regex_cache, &key, &entry) ) {
+		if ( entry->refcount > 0 )
+			continue;
+		if ( oldest == NULL || entry->last_used < oldest->last_used )
+			oldest = entry;
+	}
+	hash_table_iterate_deinit(&hctx);
+
+	if ( oldest != NULL ) {
+		hash_table_remove(ext_regex_cache, oldest->key);
+		ext_regex_cache_entry_free(&oldest);
+		ext_regex_cache_stats.evictions++;
+	}
+}
+
+const struct ext_regex *ext_regex_cache_get
+(enum ext_regex_engine engine, const char *regex_str, int cflags,
+	const char **error_r)
+{
+	struct ext_regex_cache_entry *entry;
+	const char *key;
+
+	key = t_strdup_printf("%d:%x:%s", (int) engine, cflags, regex_str);
+
+	if ( !hash_table_is_created(ext_regex_cache) ) {
+		hash_table_create
+			(&ext_regex_cache, default_pool, 0, str_hash, strcmp);
+		lib_atexit(ext_regex_cache_deinit);
+	}
+
+	entry = hash_table_lookup(ext_regex_cache, key);
+	if ( entry != NULL ) {
+		ext_regex_cache_stats.hits++;
+	} else {
+		ext_regex_cache_stats.misses++;
+
+		entry = i_new(struct ext_regex_cache_entry, 1);
+		if ( !ext_regex_compile
+			(&entry->regex, engine, regex_str, cflags, error_r) ) {
+			i_free(entry);
+			return NULL;
+		}
+
+		if ( hash_table_count(ext_regex_cache) >= EXT_REGEX_CACHE_MAX_ENTRIES )
+			ext_regex_cache_evict();
+
+		entry->key = i_strdup(key);
+		hash_table_insert(ext_regex_cache, entry->key, entry);
+	}
+
+	entry->refcount++;
+	entry->last_used = ++ext_regex_cache_use_counter;
+	return &entry->regex;
+}
+
+void ext_regex_cache_release(const struct ext_regex **_regex)
+{
+	struct ext_regex_cache_entry *entry;
+
+	if ( *_regex == NULL )
+		return;
+
+	entry = (struct ext_regex_cache_entry *) *_regex;
+	*_regex = NULL;
+
+	i_assert( entry->refcount > 0 );
+	entry->refcount--;
+}
+
+void ext_regex_cache_get_stats(struct ext_regex_cache_stats *stats_r)
+{
+	*stats_r = ext_regex_cache_stats;
+}
+
+static void ext_regex_cache_deinit(void)
+{
+	struct hash_iterate_context *hctx;
+	struct ext_regex_cache_entry *entry;
+	char *key;
+
+	if ( !hash_table_is_created(ext_regex_cache) )
+		return;
+
+	hctx = hash_table_iterate_init(ext_regex_cache);
+	while ( hash_table_iterate(hctx, ext_regex_cache, &key, &entry) )
+		ext_regex_cache_entry_free(&entry);
+	hash_table_iterate_deinit(&hctx);
+
+	hash_table_destroy(&ext_regex_cache);
+}
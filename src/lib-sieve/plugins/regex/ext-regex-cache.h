@@ -0,0 +1,60 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __EXT_REGEX_CACHE_H
+#define __EXT_REGEX_CACHE_H
+
+#include <sys/types.h>
+#include <regex.h>
+
+/*
+ * Regular expression engines
+ */
+
+enum ext_regex_engine {
+	EXT_REGEX_ENGINE_POSIX = 0,
+	EXT_REGEX_ENGINE_PCRE2
+};
+
+const char *ext_regex_error(const regex_t *regexp, int errorcode);
+
+/* Compile flags are always given as POSIX REG_* flags, also for the other
+   engines. */
+bool ext_regex_check
+	(enum ext_regex_engine engine, const char *regex_str, int cflags,
+		const char **error_r);
+
+/*
+ * Compiled regular expression
+ */
+
+struct ext_regex;
+
+/* Match offsets are reported in POSIX form for all engines; unset
+   sub-expressions have rm_so == -1. Returns 1 on match and 0 otherwise. */
+int ext_regex_exec
+	(const struct ext_regex *regex, const char *val, size_t val_size,
+		regmatch_t *pmatch, size_t nmatch);
+
+/*
+ * Process-wide cache of compiled regular expressions
+ */
+
+struct ext_regex_cache_stats {
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int evictions;
+};
+
+/* Returns the compiled regular expression for the given pattern and flags,
+   compiling it if it is not cached yet. On failure, NULL is returned and
+   error_r is set. Each successful call must be balanced with a call to
+   ext_regex_cache_release(). */
+const struct ext_regex *ext_regex_cache_get
+	(enum ext_regex_engine engine, const char *regex_str, int cflags,
+		const char **error_r);
+void ext_regex_cache_release(const struct ext_regex **_regex);
+
+void ext_regex_cache_get_stats(struct ext_regex_cache_stats *stats_r);
+
+#endif /* __EXT_REGEX_CACHE_H */
@@ -1,11 +1,67 @@
 /* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
  */
 
+#include "lib.h"
+
 #include "sieve-common.h"
+#include "sieve-error.h"
+#include "sieve-settings.h"
+#include "sieve-extensions.h"
 #include "sieve-match-types.h"
 
 #include "ext-regex-common.h"
 
+/*
+ * Extension configuration
+ */
+
+bool ext_regex_load
+(const struct sieve_extension *ext, void **context)
+{
+	struct sieve_instance *svinst = ext->svinst;
+	struct ext_regex_config *config;
+	enum ext_regex_engine engine = EXT_REGEX_ENGINE_POSIX;
+	const char *engine_name;
+
+	if ( *context != NULL ) {
+		ext_regex_unload(ext);
+		*context = NULL;
+	}
+
+	engine_name = sieve_setting_get(svinst, "sieve_regex_engine");
+	if ( engine_name == NULL || *engine_name == '\0' ||
+		strcasecmp(engine_name, "posix") == 0 ) {
+		engine = EXT_REGEX_ENGINE_POSIX;
+	} else if ( strcasecmp(engine_name, "pcre2") == 0 ) {
+#ifdef HAVE_PCRE2
+		engine = EXT_REGEX_ENGINE_PCRE2;
+#else
+		sieve_sys_warning(svinst,
+			"regex extension: sieve_regex_engine = pcre2: "
+			"not supported by this build; using posix instead");
+#endif
+	} else {
+		sieve_sys_warning(svinst,
+			"regex extension: invalid value `%s' for sieve_regex_engine; "
+			"using posix instead", engine_name);
+	}
+
+	config = i_new(struct ext_regex_config, 1);
+	config->engine = engine;
+
+	*context = (void *) config;
+	return TRUE;
+}
+
+void ext_regex_unload
+(const struct sieve_extension *ext)
+{
+	struct ext_regex_config *config =
+		(struct ext_regex_config *) ext->context;
+
+	i_free(config);
+}
+
 /*
  * Regex match type operand
  */
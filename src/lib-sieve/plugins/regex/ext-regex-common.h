@@ -4,12 +4,32 @@
 #ifndef __EXT_REGEX_COMMON_H
 #define __EXT_REGEX_COMMON_H
 
+#include "sieve-extensions.h"
+
+#include "ext-regex-cache.h"
+
 /*
  * Extension
  */
 
+struct ext_regex_config {
+	enum ext_regex_engine engine;
+};
+
 extern const struct sieve_extension_def regex_extension;
 
+bool ext_regex_load(const struct sieve_extension *ext, void **context);
+void ext_regex_unload(const struct sieve_extension *ext);
+
+static inline enum ext_regex_engine ext_regex_get_engine
+(const struct sieve_extension *ext)
+{
+	const struct ext_regex_config *config =
+		(const struct ext_regex_config *) ext->context;
+
+	return ( config == NULL ? EXT_REGEX_ENGINE_POSIX : config->engine );
+}
+
 /*
  * Operand
  */
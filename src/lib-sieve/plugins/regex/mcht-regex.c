@@ -60,50 +60,23 @@ const struct sieve_match_type_def regex_match_type = {
  * Match type validation
  */
 
-/* Wrapper around the regerror function for easy access */
-static const char *_regexp_error(regex_t *regexp, int errorcode)
-{
-	size_t errsize = regerror(errorcode, regexp, NULL, 0);
-
-	if ( errsize > 0 ) {
-		char *errbuf;
-
-		buffer_t *error_buf =
-			buffer_create_dynamic(pool_datastack_create(), errsize);
-		errbuf = buffer_get_space_unsafe(error_buf, 0, errsize);
-
-		errsize = regerror(errorcode, regexp, errbuf, errsize);
-
-		/* We don't want the error to start with a capital letter */
-		errbuf[0] = i_tolower(errbuf[0]);
-
-		buffer_append_space_unsafe(error_buf, errsize);
-
-		return str_c(error_buf);
-	}
-
-	return "";
-}
-
 static int mcht_regex_validate_regexp
 (struct sieve_validator *valdtr,
-	struct sieve_match_type_context *mtctx ATTR_UNUSED,
+	struct sieve_match_type_context *mtctx,
 	struct sieve_ast_argument *key, int cflags)
 {
-	int ret;
-	regex_t regexp;
+	const struct sieve_extension *ext = mtctx->match_type->object.ext;
 	const char *regex_str = sieve_ast_argument_strc(key);
+	const char *error;
 
-	if ( (ret=regcomp(&regexp, regex_str, cflags)) != 0 ) {
+	if ( !ext_regex_check
+		(ext_regex_get_engine(ext), regex_str, cflags, &error) ) {
 		sieve_argument_validate_error(valdtr, key,
 			"invalid regular expression '%s' for regex match: %s",
-			str_sanitize(regex_str, 128), _regexp_error(&regexp, ret));
-
-		regfree(&regexp);
+			str_sanitize(regex_str, 128), error);
 		return FALSE;
 	}
 
-	regfree(&regexp);
 	return TRUE;
 }
 
@@ -170,7 +143,7 @@ static bool mcht_regex_validate_context
  */
 
 struct mcht_regex_key {
-	regex_t regexp;
+	const struct ext_regex *regex;
 	int status;
 };
 
@@ -204,19 +177,19 @@ static void mcht_regex_match_init
 }
 
 static int mcht_regex_match_key
-(struct sieve_match_context *mctx, const char *val,
-	const regex_t *regexp)
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	const struct ext_regex *regex)
 {
 	struct mcht_regex_context *ctx = (struct mcht_regex_context *) mctx->data;
 	int ret;
 
 	/* Execute regex */
 
-	ret = regexec(regexp, val, ctx->nmatch, ctx->pmatch, 0);
+	ret = ext_regex_exec(regex, val, val_size, ctx->pmatch, ctx->nmatch);
 
 	/* Handle match values if necessary */
 
-	if ( ret == 0 ) {
+	if ( ret > 0 ) {
 		if ( ctx->nmatch > 0 ) {
 			struct sieve_match_values *mvalues;
 			size_t i;
@@ -256,13 +229,15 @@ static int mcht_regex_match_key
 }
 
 static int mcht_regex_match_keys
-(struct sieve_match_context *mctx, const char *val, size_t val_size ATTR_UNUSED,
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
 	struct sieve_stringlist *key_list)
 {
 	const struct sieve_runtime_env *renv = mctx->runenv;
 	bool trace = sieve_runtime_trace_active(renv, SIEVE_TRLVL_MATCHING);
 	struct mcht_regex_context *ctx = (struct mcht_regex_context *) mctx->data;
 	const struct sieve_comparator *cmp = mctx->comparator;
+	enum ext_regex_engine engine =
+		ext_regex_get_engine(mctx->match_type->object.ext);
 	int match;
 
 	if ( !ctx->all_compiled ) {
@@ -298,28 +273,30 @@ static int mcht_regex_match_keys
 
 					if ( rkey->status >= 0 ) {
 						const char *regex_str = str_c(key_item);
-						int rxret;
+						const char *error;
 
 						/* Indicate whether match values need to be produced */
 						if ( ctx->nmatch == 0 ) cflags |= REG_NOSUB;
 
-						/* Compile regular expression */
-						if ( (rxret=regcomp(&rkey->regexp, regex_str, cflags)) != 0 ) {
+						/* Get compiled regular expression */
+						rkey->regex = ext_regex_cache_get
+							(engine, regex_str, cflags, &error);
+						if ( rkey->regex == NULL ) {
 							sieve_runtime_error(renv, NULL,
 								"invalid regular expression '%s' for regex match: %s",
-								str_sanitize(regex_str, 128),
-								_regexp_error(&rkey->regexp, rxret));
+								str_sanitize(regex_str, 128), error);
 							rkey->status = -1;
 						} else {
 							rkey->status = 1;
 						}
 					}
 				} else {
-					rkey = array_idx_modifiable(&ctx->reg_expressions, 1);
+					rkey = array_idx_modifiable(&ctx->reg_expressions, i);
 				}
 
 				if ( rkey->status > 0 ) {
-					match = mcht_regex_match_key(mctx, val, &rkey->regexp);
+					match = mcht_regex_match_key
+						(mctx, val, val_size, rkey->regex);
 
 					if ( trace ) {
 						sieve_runtime_trace(renv, 0,
@@ -352,7 +329,8 @@ static int mcht_regex_match_keys
 		match = 0;
 		while ( match == 0 && i < count ) {
 			if ( rkeys[i].status > 0 ) {
-				match = mcht_regex_match_key(mctx, val, &rkeys[i].regexp);
+				match = mcht_regex_match_key
+					(mctx, val, val_size, rkeys[i].regex);
 
 				if ( trace ) {
 					sieve_runtime_trace(renv, 0,
@@ -374,11 +352,11 @@ void mcht_regex_match_deinit
 	struct mcht_regex_key *rkeys;
 	unsigned int count, i;
 
-	/* Clean up compiled regular expressions */
+	/* Release compiled regular expressions */
 	if ( array_is_created(&ctx->reg_expressions) ) {
 		rkeys = array_get_modifiable(&ctx->reg_expressions, &count);
 		for ( i = 0; i < count; i++ ) {
-			regfree(&rkeys[i].regexp);
+			ext_regex_cache_release(&rkeys[i].regex);
 		}
 	}
 }
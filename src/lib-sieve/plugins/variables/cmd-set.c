@@ -179,6 +179,7 @@ static int cmd_set_operation_execute
 	ARRAY_TYPE(sieve_variables_modifier) modifiers;
 	unsigned int var_index;
 	string_t *value;
+	bool literal = FALSE;
 	int ret = SIEVE_EXEC_OK;
 
 	/*
@@ -189,7 +190,8 @@ static int cmd_set_operation_execute
 		(renv, address, "variable", &storage, &var_index)) <= 0 )
 		return ret;
 
-	if ( (ret=sieve_opr_string_read(renv, address, "string", &value)) <= 0 )
+	if ( (ret=sieve_opr_string_read_ex
+		(renv, address, "string", FALSE, &value, &literal)) <= 0 )
 		return ret;
 
 	if ( (ret=sieve_variables_modifiers_code_read
@@ -208,10 +210,15 @@ static int cmd_set_operation_execute
 		(renv, &modifiers, &value)) <= 0 )
 		return ret;
 
-	/* Actually assign the value if all is well */
+	/* Actually assign the value if all is well; an unmodified string literal
+	   stays in the binary, which outlives the variable storage */
 	i_assert ( value != NULL );
-	if ( !sieve_variable_assign(storage, var_index, value) )
+	if ( literal && array_count(&modifiers) == 0 ) {
+		if ( !sieve_variable_assign_borrowed(storage, var_index, value) )
+			return SIEVE_EXEC_BIN_CORRUPT;
+	} else if ( !sieve_variable_assign(storage, var_index, value) ) {
 		return SIEVE_EXEC_BIN_CORRUPT;
+	}
 
 	/* Trace */
 	if ( sieve_runtime_trace_active(renv, SIEVE_TRLVL_COMMANDS) ) {
@@ -393,12 +393,27 @@ unsigned int sieve_variable_scope_binary_get_size
  * Variable storage
  */
 
+/* A variable value is copied into a buffer of its own only when necessary.
+ * Values that are known to outlive the storage, such as string literals in
+ * the binary, are referenced directly until the variable is modified.
+ */
+
+struct sieve_variable_value {
+	/* Current value; either the own buffer or the borrowed one */
+	string_t *value;
+
+	/* Own buffer, allocated once the value is first copied */
+	string_t *buffer;
+	/* Read-only value referring to data owned by someone else */
+	buffer_t borrowed;
+};
+
 struct sieve_variable_storage {
 	pool_t pool;
 	struct sieve_variable_scope *scope;
 	struct sieve_variable_scope_binary *scope_bin;
 	unsigned int max_size;
-	ARRAY(string_t *) var_values;
+	ARRAY(struct sieve_variable_value *) var_values;
 };
 
 struct sieve_variable_storage *sieve_variable_storage_create
@@ -427,6 +442,45 @@ static inline bool sieve_variable_valid
 	return ( index < storage->max_size );
 }
 
+static struct sieve_variable_value *sieve_variable_value_get
+(struct sieve_variable_storage *storage, unsigned int index)
+{
+	struct sieve_variable_value *const *varent;
+
+	if ( index >= array_count(&storage->var_values) )
+		return NULL;
+
+	varent = array_idx(&storage->var_values, index);
+	return *varent;
+}
+
+static struct sieve_variable_value *sieve_variable_value_get_create
+(struct sieve_variable_storage *storage, unsigned int index)
+{
+	struct sieve_variable_value *varval;
+
+	varval = sieve_variable_value_get(storage, index);
+	if ( varval == NULL ) {
+		varval = p_new(storage->pool, struct sieve_variable_value, 1);
+		array_idx_set(&storage->var_values, index, &varval);
+	}
+	return varval;
+}
+
+static string_t *sieve_variable_value_get_buffer
+(struct sieve_variable_storage *storage, struct sieve_variable_value *varval,
+	size_t size)
+{
+	/* Reuse the own buffer; allocate it with the size of the first value */
+	if ( varval->buffer == NULL )
+		varval->buffer = str_new(storage->pool, I_MAX(size, 32));
+	else
+		str_truncate(varval->buffer, 0);
+
+	varval->value = varval->buffer;
+	return varval->buffer;
+}
+
 bool sieve_variable_get_identifier
 (struct sieve_variable_storage *storage, unsigned int index,
 	const char **identifier)
@@ -472,15 +526,13 @@ const char *sieve_variable_get_varid
 bool sieve_variable_get
 (struct sieve_variable_storage *storage, unsigned int index, string_t **value)
 {
-	*value = NULL;
+	struct sieve_variable_value *varval;
 
-	if  ( index < array_count(&storage->var_values) ) {
-		string_t * const *varent;
-
-		varent = array_idx(&storage->var_values, index);
+	*value = NULL;
 
-		*value = *varent;
-	} else if ( !sieve_variable_valid(storage, index) )
+	if ( (varval=sieve_variable_value_get(storage, index)) != NULL )
+		*value = varval->value;
+	else if ( !sieve_variable_valid(storage, index) )
 		return FALSE;
 
 	return TRUE;
@@ -489,6 +541,7 @@ bool sieve_variable_get
 bool sieve_variable_get_modifiable
 (struct sieve_variable_storage *storage, unsigned int index, string_t **value)
 {
+	struct sieve_variable_value *varval;
 	string_t *dummy;
 
 	if ( value == NULL ) value = &dummy;
@@ -496,9 +549,17 @@ bool sieve_variable_get_modifiable
 	if ( !sieve_variable_get(storage, index, value) )
 		return FALSE;
 
-	if ( *value == NULL ) {
-		*value = str_new(storage->pool, 256);
-		array_idx_set(&storage->var_values, index, value);
+	varval = sieve_variable_value_get_create(storage, index);
+	if ( varval->value == NULL ) {
+		/* Unassigned */
+		*value = sieve_variable_value_get_buffer(storage, varval, 0);
+	} else if ( varval->value != varval->buffer ) {
+		/* Borrowed; copy it before it is modified */
+		const string_t *borrowed = varval->value;
+
+		*value = sieve_variable_value_get_buffer
+			(storage, varval, str_len(borrowed));
+		str_append_str(*value, borrowed);
 	}
 
 	return TRUE;
@@ -508,17 +569,43 @@ bool sieve_variable_assign
 (struct sieve_variable_storage *storage, unsigned int index,
 	const string_t *value)
 {
-	string_t *varval;
+	struct sieve_variable_value *varval;
+	string_t *varbuf;
 
-	if ( !sieve_variable_get_modifiable(storage, index, &varval) )
+	if ( !sieve_variable_valid(storage, index) )
 		return FALSE;
 
-	str_truncate(varval, 0);
-	str_append_str(varval, value);
+	varval = sieve_variable_value_get_create(storage, index);
+	varbuf = sieve_variable_value_get_buffer(storage, varval, str_len(value));
+	str_append_str(varbuf, value);
 
 	/* Just a precaution, caller should prevent this in the first place */
-	if ( str_len(varval) > EXT_VARIABLES_MAX_VARIABLE_SIZE )
-		str_truncate(varval, EXT_VARIABLES_MAX_VARIABLE_SIZE);
+	if ( str_len(varbuf) > EXT_VARIABLES_MAX_VARIABLE_SIZE )
+		str_truncate(varbuf, EXT_VARIABLES_MAX_VARIABLE_SIZE);
+
+	return TRUE;
+}
+
+bool sieve_variable_assign_borrowed
+(struct sieve_variable_storage *storage, unsigned int index,
+	const string_t *value)
+{
+	struct sieve_variable_value *varval;
+	const unsigned char *data = str_data(value);
+	size_t size = str_len(value);
+
+	/* Readers may need str_c(), so the data must be NUL-terminated already */
+	if ( size > EXT_VARIABLES_MAX_VARIABLE_SIZE ||
+		buffer_get_size(value) <= size || data[size] != '\0' )
+		return sieve_variable_assign(storage, index, value);
+
+	if ( !sieve_variable_valid(storage, index) )
+		return FALSE;
+
+	varval = sieve_variable_value_get_create(storage, index);
+	buffer_create_from_const_data(&varval->borrowed, data, size + 1);
+	buffer_set_used_size(&varval->borrowed, size);
+	varval->value = &varval->borrowed;
 
 	return TRUE;
 }
@@ -527,17 +614,19 @@ bool sieve_variable_assign_cstr
 (struct sieve_variable_storage *storage, unsigned int index,
 	const char *value)
 {
-	string_t *varval;
+	struct sieve_variable_value *varval;
+	string_t *varbuf;
 
-	if ( !sieve_variable_get_modifiable(storage, index, &varval) )
+	if ( !sieve_variable_valid(storage, index) )
 		return FALSE;
 
-	str_truncate(varval, 0);
-	str_append(varval, value);
+	varval = sieve_variable_value_get_create(storage, index);
+	varbuf = sieve_variable_value_get_buffer(storage, varval, strlen(value));
+	str_append(varbuf, value);
 
 	/* Just a precaution, caller should prevent this in the first place */
-	if ( str_len(varval) > EXT_VARIABLES_MAX_VARIABLE_SIZE )
-		str_truncate(varval, EXT_VARIABLES_MAX_VARIABLE_SIZE);
+	if ( str_len(varbuf) > EXT_VARIABLES_MAX_VARIABLE_SIZE )
+		str_truncate(varbuf, EXT_VARIABLES_MAX_VARIABLE_SIZE);
 
 	return TRUE;
 }
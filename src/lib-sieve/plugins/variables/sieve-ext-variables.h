@@ -194,6 +194,13 @@ bool sieve_variable_get_modifiable
 bool sieve_variable_assign
 	(struct sieve_variable_storage *storage, unsigned int index,
 		const string_t *value);
+/* Assigns the value without copying it. The caller guarantees that the value
+   remains unchanged and available for as long as the storage exists, e.g. a
+   string literal read from the binary. The value is copied once the variable
+   is requested for modification. */
+bool sieve_variable_assign_borrowed
+	(struct sieve_variable_storage *storage, unsigned int index,
+		const string_t *value);
 bool sieve_variable_assign_cstr
 	(struct sieve_variable_storage *storage, unsigned int index,
 		const char *value);
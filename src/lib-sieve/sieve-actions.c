@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "array.h"
 #include "str.h"
 #include "strfuncs.h"
 #include "ioloop.h"
@@ -173,6 +174,127 @@ int sieve_action_opr_optional_read
 	return -1;
 }
 
+/*
+ * Mailbox cache
+ */
+
+#define SIEVE_MAILBOX_CACHE_MAX_SIZE 16
+
+struct sieve_mailbox_cache_entry {
+	char *name;
+	struct mailbox *box;
+
+	/* Number of active store transactions using this mailbox */
+	unsigned int refcount;
+	unsigned int last_used;
+};
+
+struct sieve_mailbox_cache {
+	ARRAY(struct sieve_mailbox_cache_entry) entries;
+	unsigned int use_counter;
+};
+
+struct sieve_mailbox_cache *sieve_mailbox_cache_create(void)
+{
+	struct sieve_mailbox_cache *cache;
+
+	cache = i_new(struct sieve_mailbox_cache, 1);
+	i_array_init(&cache->entries, SIEVE_MAILBOX_CACHE_MAX_SIZE);
+
+	return cache;
+}
+
+static void sieve_mailbox_cache_entry_free
+(struct sieve_mailbox_cache_entry *entry)
+{
+	mailbox_free(&entry->box);
+	i_free(entry->name);
+}
+
+void sieve_mailbox_cache_destroy(struct sieve_mailbox_cache **_cache)
+{
+	struct sieve_mailbox_cache *cache = *_cache;
+	struct sieve_mailbox_cache_entry *entry;
+
+	*_cache = NULL;
+
+	array_foreach_modifiable(&cache->entries, entry) {
+		i_assert( entry->refcount == 0 );
+		sieve_mailbox_cache_entry_free(entry);
+	}
+	array_free(&cache->entries);
+	i_free(cache);
+}
+
+static struct mailbox *sieve_mailbox_cache_get
+(struct sieve_mailbox_cache *cache, const char *name)
+{
+	struct sieve_mailbox_cache_entry *entry;
+
+	array_foreach_modifiable(&cache->entries, entry) {
+		if ( strcmp(entry->name, name) == 0 ) {
+			entry->refcount++;
+			entry->last_used = ++cache->use_counter;
+			return entry->box;
+		}
+	}
+	return NULL;
+}
+
+static bool sieve_mailbox_cache_add
+(struct sieve_mailbox_cache *cache, const char *name, struct mailbox *box)
+{
+	struct sieve_mailbox_cache_entry *entries, *entry;
+	unsigned int count, i, lru_idx;
+
+	entries = array_get_modifiable(&cache->entries, &count);
+	if ( count >= SIEVE_MAILBOX_CACHE_MAX_SIZE ) {
+		/* Make room by closing the least recently used mailbox that is not
+		   currently in use */
+		lru_idx = count;
+		for ( i = 0; i < count; i++ ) {
+			if ( entries[i].refcount == 0 && (lru_idx == count ||
+				entries[i].last_used < entries[lru_idx].last_used) )
+				lru_idx = i;
+		}
+		if ( lru_idx == count )
+			return FALSE;
+
+		sieve_mailbox_cache_entry_free(&entries[lru_idx]);
+		array_delete(&cache->entries, lru_idx, 1);
+	}
+
+	entry = array_append_space(&cache->entries);
+	entry->name = i_strdup(name);
+	entry->box = box;
+	entry->refcount = 1;
+	entry->last_used = ++cache->use_counter;
+	return TRUE;
+}
+
+static void sieve_mailbox_cache_release
+(struct sieve_mailbox_cache *cache, struct mailbox **_box, bool failed)
+{
+	struct sieve_mailbox_cache_entry *entries;
+	unsigned int count, i;
+
+	entries = array_get_modifiable(&cache->entries, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( entries[i].box == *_box )
+			break;
+	}
+	i_assert( i < count && entries[i].refcount > 0 );
+
+	*_box = NULL;
+	entries[i].refcount--;
+
+	/* Don't hold on to a mailbox that just failed us */
+	if ( failed && entries[i].refcount == 0 ) {
+		sieve_mailbox_cache_entry_free(&entries[i]);
+		array_delete(&cache->entries, i, 1);
+	}
+}
+
 /*
  * Store action
  */
@@ -187,6 +309,8 @@ static int act_store_check_duplicate
 	(const struct sieve_runtime_env *renv,
 		const struct sieve_action *act,
 		const struct sieve_action *act_other);
+static const char *act_store_get_target
+	(const struct sieve_script_env *senv, const struct sieve_action *act);
 static void act_store_print
 	(const struct sieve_action *action,
 		const struct sieve_result_print_env *rpenv, bool *keep);
@@ -213,6 +337,7 @@ const struct sieve_action_def act_store = {
 		SIEVE_ACTFLAG_MAIL_STORAGE,
 	.equals = act_store_equals,
 	.check_duplicate = act_store_check_duplicate,
+	.get_target = act_store_get_target,
 	.print = act_store_print,
 	.start = act_store_start,
 	.execute = act_store_execute,
@@ -325,6 +450,21 @@ static int act_store_check_duplicate
 	return ( act_store_equals(renv->scriptenv, act, act_other) ? 1 : 0 );
 }
 
+static const char *act_store_get_target
+(const struct sieve_script_env *senv, const struct sieve_action *act)
+{
+	struct act_store_context *st_ctx =
+		(struct act_store_context *) act->context;
+	const char *mailbox;
+
+	/* Must match act_store_equals() */
+	mailbox = ( st_ctx == NULL ?
+		SIEVE_SCRIPT_DEFAULT_MAILBOX(senv) : st_ctx->mailbox );
+	if ( strcasecmp(mailbox, "INBOX") == 0 )
+		return "INBOX";
+	return mailbox;
+}
+
 /* Result printing */
 
 static void act_store_print
@@ -358,12 +498,15 @@ void sieve_act_store_get_storage_error
 
 static bool act_store_mailbox_open
 (const struct sieve_action_exec_env *aenv, const char *mailbox,
-	struct mailbox **box_r, enum mail_error *error_code_r, const char **error_r)
+	struct mailbox **box_r, bool *cached_r, enum mail_error *error_code_r,
+	const char **error_r)
 {
 	struct mail_storage **storage = &(aenv->exec_status->last_storage);
+	struct sieve_mailbox_cache *cache = aenv->scriptenv->mailbox_cache;
 	struct mail_deliver_save_open_context save_ctx;
 
 	*box_r = NULL;
+	*cached_r = FALSE;
 
 	if ( !uni_utf8_str_is_valid(mailbox) ) {
 		/* Just a precaution; already (supposed to be) checked at
@@ -379,14 +522,41 @@ static bool act_store_mailbox_open
 	save_ctx.lda_mailbox_autocreate = aenv->scriptenv->mailbox_autocreate;
 	save_ctx.lda_mailbox_autosubscribe = aenv->scriptenv->mailbox_autosubscribe;
 
+	/* Reuse the mailbox if it was opened before */
+	if ( cache != NULL &&
+		(*box_r=sieve_mailbox_cache_get(cache, mailbox)) != NULL ) {
+		*cached_r = TRUE;
+		*storage = mailbox_get_storage(*box_r);
+		return TRUE;
+	}
+
 	if ( mail_deliver_save_open
 		(&save_ctx, mailbox, box_r, error_code_r, error_r) < 0 )
 		return FALSE;
 
+	if ( cache != NULL )
+		*cached_r = sieve_mailbox_cache_add(cache, mailbox, *box_r);
+
 	*storage = mailbox_get_storage(*box_r);
 	return TRUE;
 }
 
+static void act_store_mailbox_close
+(const struct sieve_action_exec_env *aenv,
+	struct act_store_transaction *trans, bool failed)
+{
+	if ( trans->box == NULL )
+		return;
+
+	if ( trans->box_cached ) {
+		sieve_mailbox_cache_release
+			(aenv->scriptenv->mailbox_cache, &trans->box, failed);
+		trans->box_cached = FALSE;
+	} else {
+		mailbox_free(&trans->box);
+	}
+}
+
 static int act_store_start
 (const struct sieve_action *action,
 	const struct sieve_action_exec_env *aenv, void **tr_context)
@@ -398,7 +568,7 @@ static int act_store_start
 	pool_t pool = sieve_result_pool(aenv->result);
 	const char *error = NULL;
 	enum mail_error error_code = MAIL_ERROR_NONE;
-	bool disabled = FALSE, open_failed = FALSE;
+	bool disabled = FALSE, open_failed = FALSE, box_cached = FALSE;
 
 	/* If context is NULL, the store action is the result of (implicit) keep */
 	if ( ctx == NULL ) {
@@ -413,7 +583,7 @@ static int act_store_start
 	 */
 	if ( senv->user != NULL ) {
 		if ( !act_store_mailbox_open
-			(aenv, ctx->mailbox, &box, &error_code, &error) ) {
+			(aenv, ctx->mailbox, &box, &box_cached, &error_code, &error) ) {
 			open_failed = TRUE;
 		}
 	} else {
@@ -425,6 +595,7 @@ static int act_store_start
 
 	trans->context = ctx;
 	trans->box = box;
+	trans->box_cached = box_cached;
 	trans->flags = 0;
 
 	trans->disabled = disabled;
@@ -680,15 +851,13 @@ static int act_store_commit
 	if ( trans->disabled ) {
 		act_store_log_status(trans, aenv, FALSE, status);
 		*keep = FALSE;
-		if ( trans->box != NULL )
-			mailbox_free(&trans->box);
+		act_store_mailbox_close(aenv, trans, FALSE);
 		return SIEVE_EXEC_OK;
 	} else if ( trans->redundant ) {
 		act_store_log_status(trans, aenv, FALSE, status);
 		aenv->exec_status->keep_original = TRUE;
 		aenv->exec_status->message_saved = TRUE;
-		if ( trans->box != NULL )
-			mailbox_free(&trans->box);
+		act_store_mailbox_close(aenv, trans, FALSE);
 		return SIEVE_EXEC_OK;
 	}
 
@@ -716,9 +885,8 @@ static int act_store_commit
 	/* Cancel implicit keep if all went well */
 	*keep = !status;
 
-	/* Close mailbox */
-	if ( trans->box != NULL )
-		mailbox_free(&trans->box);
+	/* Close mailbox (or return it to the cache) */
+	act_store_mailbox_close(aenv, trans, !status);
 
 	if (status)
 		return SIEVE_EXEC_OK;
@@ -752,8 +920,8 @@ static void act_store_rollback
 	if ( trans->mail_trans != NULL )
 		mailbox_transaction_rollback(&trans->mail_trans);
 
-	/* Close the mailbox */
-	mailbox_free(&trans->box);
+	/* Close the mailbox (or return it to the cache) */
+	act_store_mailbox_close(aenv, trans, !success);
 }
 
 /*
@@ -63,6 +63,13 @@ struct sieve_action_def {
 			const struct sieve_action *act,
 			const struct sieve_action *act_other);
 
+	/* Normalized target of the action (e.g. the mailbox). Two actions of this
+	   type must be duplicates exactly when their targets are equal; this
+	   allows finding duplicates without checking every action in the
+	   result. */
+	const char *(*get_target)
+		(const struct sieve_script_env *senv, const struct sieve_action *act);
+
 	/* Result printing */
 
 	void (*print)
@@ -238,6 +245,7 @@ struct act_store_transaction {
 	unsigned int flags_altered:1;
 	unsigned int disabled:1;
 	unsigned int redundant:1;
+	unsigned int box_cached:1;
 };
 
 int sieve_act_store_add_to_result
@@ -251,6 +259,20 @@ void sieve_act_store_add_flags
 void sieve_act_store_get_storage_error
 	(const struct sieve_action_exec_env *aenv, struct act_store_transaction *trans);
 
+/*
+ * Mailbox cache
+ */
+
+/* Keeps the mailboxes opened by the store action open after the transaction
+   is committed, so that executing a script for many messages (e.g. when
+   filtering a mailbox) does not reopen the same mailboxes each time. A cache
+   belongs to a single mail user and is assigned to senv->mailbox_cache. It
+   must be destroyed before that user is deinitialized.
+ */
+
+struct sieve_mailbox_cache *sieve_mailbox_cache_create(void);
+void sieve_mailbox_cache_destroy(struct sieve_mailbox_cache **_cache);
+
 /*
  * Action utility functions
  */
@@ -8,7 +8,9 @@
 #include "message-address.h"
 
 #include "sieve-common.h"
+#include "sieve-runtime.h"
 #include "sieve-runtime-trace.h"
+#include "sieve-message.h"
 
 #include "sieve-address.h"
 
@@ -64,7 +66,7 @@ static int sieve_header_address_list_next_item
 	struct sieve_header_address_list *addrlist =
 		(struct sieve_header_address_list *) _addrlist;
 	const struct message_address *aitem;
-	bool valid = TRUE;
+	bool valid;
 
 	if ( addr_r != NULL ) addr_r->local_part = NULL;
 	if ( unparsed_r != NULL ) *unparsed_r = NULL;
@@ -85,19 +87,14 @@ static int sieve_header_address_list_next_item
 				str_sanitize(str_c(value_item), 80));
 		}
 
-		addrlist->cur_address = message_address_parse
-			(pool_datastack_create(), (const unsigned char *) str_data(value_item),
-				str_len(value_item), 256, FALSE);
-
 		/* Check validity of all addresses simultaneously. Unfortunately,
 		 * errorneous addresses cannot be extracted from the address list.
+		 * The parsed list is cached in the message context, so repeated
+		 * tests on the same header do not parse it again.
 		 */
-		aitem = addrlist->cur_address;
-		while ( aitem != NULL) {
-			if ( aitem->invalid_syntax )
-				valid = FALSE;
-			aitem = aitem->next;
-		}
+		valid = sieve_message_address_list_parse
+			(_addrlist->strlist.runenv->msgctx, value_item,
+				&addrlist->cur_address);
 
 		if ( addrlist->cur_address == NULL || !valid ) {
 			addrlist->cur_address = NULL;
@@ -22,6 +22,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -259,6 +260,26 @@ static bool _sieve_binary_save
 	return TRUE;
 }
 
+static bool _sieve_binary_pre_save
+(struct sieve_binary *sbin, enum sieve_error *error_r)
+{
+	struct sieve_binary_extension_reg *const *regs;
+	unsigned int ext_count, i;
+
+	regs = array_get(&sbin->extensions, &ext_count);
+	for ( i = 0; i < ext_count; i++ ) {
+		const struct sieve_binary_extension *binext = regs[i]->binext;
+
+		if ( binext != NULL && binext->binary_pre_save != NULL &&
+			!binext->binary_pre_save
+				(regs[i]->extension, sbin, regs[i]->context, error_r)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 int sieve_binary_save
 (struct sieve_binary *sbin, const char *path, bool update, mode_t save_mode,
 	enum sieve_error *error_r)
@@ -304,16 +325,8 @@ int sieve_binary_save
 	}
 
 	/* Signal all extensions that we're about to save the binary */
-	regs = array_get(&sbin->extensions, &ext_count);
-	for ( i = 0; i < ext_count; i++ ) {
-		const struct sieve_binary_extension *binext = regs[i]->binext;
-
-		if ( binext != NULL && binext->binary_pre_save != NULL &&
-			!binext->binary_pre_save
-				(regs[i]->extension, sbin, regs[i]->context, error_r)) {
-			return -1;
-		}
-	}
+	if ( !_sieve_binary_pre_save(sbin, error_r) )
+		return -1;
 
 	/* Save binary */
 	result = 1;
@@ -383,6 +396,24 @@ int sieve_binary_save
 	return result;
 }
 
+int sieve_binary_save_image
+(struct sieve_binary *sbin, buffer_t *image)
+{
+	struct ostream *stream;
+	enum sieve_error error;
+	int result = 0;
+
+	if ( !_sieve_binary_pre_save(sbin, &error) )
+		return -1;
+
+	stream = o_stream_create_buffer(image);
+	if ( !_sieve_binary_save(sbin, stream) )
+		result = -1;
+	o_stream_destroy(&stream);
+
+	return result;
+}
+
 /*
  * Binary file management
  */
@@ -451,6 +482,9 @@ bool sieve_binary_file_open
 
 void sieve_binary_file_close(struct sieve_binary_file **file)
 {
+	if ( (*file)->destroy != NULL )
+		(*file)->destroy(*file);
+
 	if ( (*file)->fd != -1 ) {
 		if ( close((*file)->fd) < 0 ) {
 			sieve_sys_error((*file)->svinst,
@@ -464,120 +498,6 @@ void sieve_binary_file_close(struct sieve_binary_file **file)
 	*file = NULL;
 }
 
-#if 0 /* file_memory is currently unused */
-
-/* File loaded/mapped to memory */
-
-struct _file_memory {
-	struct sieve_binary_file binfile;
-
-	/* Pointer to the binary in memory */
-	const void *memory;
-	off_t memory_size;
-};
-
-static const void *_file_memory_load_data
-	(struct sieve_binary_file *file, off_t *offset, size_t size)
-{
-	struct _file_memory *fmem = (struct _file_memory *) file;
-
-	*offset = SIEVE_BINARY_ALIGN(*offset);
-
-	if ( (*offset) + size <= fmem->memory_size ) {
-		const void *data = PTR_OFFSET(fmem->memory, *offset);
-		*offset += size;
-		file->offset = *offset;
-
-		return data;
-	}
-
-	return NULL;
-}
-
-static buffer_t *_file_memory_load_buffer
-	(struct sieve_binary_file *file, off_t *offset, size_t size)
-{
-	struct _file_memory *fmem = (struct _file_memory *) file;
-
-	*offset = SIEVE_BINARY_ALIGN(*offset);
-
-	if ( (*offset) + size <= fmem->memory_size ) {
-		const void *data = PTR_OFFSET(fmem->memory, *offset);
-		*offset += size;
-		file->offset = *offset;
-
-		return buffer_create_const_data(file->pool, data, size);
-	}
-
-	return NULL;
-}
-
-static bool _file_memory_load(struct sieve_binary_file *file)
-{
-	struct _file_memory *fmem = (struct _file_memory *) file;
-	int ret;
-	size_t size;
-	void *indata;
-
-	i_assert(file->fd > 0);
-
-	/* Allocate memory buffer
-	 */
-	indata = p_malloc(file->pool, file->st.st_size);
-	size = file->st.st_size;
-
-	file->offset = 0;
-	fmem->memory = indata;
-	fmem->memory_size = file->st.st_size;
-
-	/* Return to beginning of the file */
-	if ( lseek(file->fd, 0, SEEK_SET) == (off_t) -1 ) {
-		sieve_sys_error("failed to seek() in binary %s: %m", file->path);
-		return FALSE;
-	}
-
-	/* Read the whole file into memory */
-	while (size > 0) {
-		if ( (ret=read(file->fd, indata, size)) <= 0 ) {
-			sieve_sys_error("failed to read from binary %s: %m", file->path);
-			break;
-		}
-
-		indata = PTR_OFFSET(indata, ret);
-		size -= ret;
-	}
-
-	if ( size != 0 ) {
-		/* Failed to read the whole file */
-		return FALSE;
-	}
-
-	return TRUE;
-}
-
-static struct sieve_binary_file *_file_memory_open(const char *path)
-{
-	pool_t pool;
-	struct _file_memory *file;
-
-	pool = pool_alloconly_create("sieve_binary_file_memory", 1024);
-	file = p_new(pool, struct _file_memory, 1);
-	file->binfile.pool = pool;
-	file->binfile.path = p_strdup(pool, path);
-	file->binfile.load = _file_memory_load;
-	file->binfile.load_data = _file_memory_load_data;
-	file->binfile.load_buffer = _file_memory_load_buffer;
-
-	if ( !sieve_binary_file_open(&file->binfile, path) ) {
-		pool_unref(&pool);
-		return NULL;
-	}
-
-	return &file->binfile;
-}
-
-#endif /* file_memory is currently unused */
-
 /* File open in lazy mode (only read what is needed into memory) */
 
 static bool _file_lazy_read
@@ -673,6 +593,147 @@ static struct sieve_binary_file *_file_lazy_open
 	return file;
 }
 
+/* File mapped into memory (blocks are zero-copy views into the mapping);
+   also used for binary images that are already in memory */
+
+struct _file_mmap {
+	struct sieve_binary_file binfile;
+
+	/* Mapping of the whole binary */
+	const void *mmap_base;
+	size_t mmap_size;
+};
+
+static const void *_file_mmap_get
+(struct sieve_binary_file *file, off_t *offset, size_t size)
+{
+	struct _file_mmap *fmap = (struct _file_mmap *) file;
+	const void *data;
+
+	*offset = SIEVE_BINARY_ALIGN(*offset);
+
+	if ( *offset < 0 || (uoff_t)*offset > fmap->mmap_size ||
+		size > fmap->mmap_size - (size_t)*offset ) {
+		sieve_sys_error(file->svinst,
+			"binary read: binary %s is truncated (more data expected)",
+			file->path);
+		return NULL;
+	}
+
+	data = CONST_PTR_OFFSET(fmap->mmap_base, *offset);
+	*offset += size;
+	file->offset = *offset;
+
+	return data;
+}
+
+static const void *_file_mmap_load_data
+(struct sieve_binary_file *file, off_t *offset, size_t size)
+{
+	return _file_mmap_get(file, offset, size);
+}
+
+static buffer_t *_file_mmap_load_buffer
+(struct sieve_binary_file *file, off_t *offset, size_t size)
+{
+	const void *data = _file_mmap_get(file, offset, size);
+
+	if ( data == NULL )
+		return NULL;
+
+	return buffer_create_const_data(file->pool, data, size);
+}
+
+static void _file_mmap_destroy(struct sieve_binary_file *file)
+{
+	struct _file_mmap *fmap = (struct _file_mmap *) file;
+
+	if ( fmap->mmap_base == NULL )
+		return;
+
+	if ( munmap((void *)fmap->mmap_base, fmap->mmap_size) < 0 ) {
+		sieve_sys_error(file->svinst,
+			"binary close: munmap(%s) failed: %m", file->path);
+	}
+	fmap->mmap_base = NULL;
+}
+
+static struct sieve_binary_file *_file_mmap_open
+(struct sieve_instance *svinst, const char *path, enum sieve_error *error_r)
+{
+	pool_t pool;
+	struct _file_mmap *file;
+	void *base;
+
+	pool = pool_alloconly_create("sieve_binary_file_mmap", 1024);
+	file = p_new(pool, struct _file_mmap, 1);
+	file->binfile.pool = pool;
+	file->binfile.path = p_strdup(pool, path);
+	file->binfile.load_data = _file_mmap_load_data;
+	file->binfile.load_buffer = _file_mmap_load_buffer;
+	file->binfile.destroy = _file_mmap_destroy;
+	file->binfile.const_buffers = TRUE;
+
+	if ( !sieve_binary_file_open(&file->binfile, svinst, path, error_r) ) {
+		pool_unref(&pool);
+		return NULL;
+	}
+
+	/* An empty file is reported as truncated once the header is read */
+	if ( file->binfile.st.st_size == 0 )
+		return &file->binfile;
+
+	if ( (uoff_t)file->binfile.st.st_size > SSIZE_T_MAX ) {
+		base = MAP_FAILED;
+		errno = EFBIG;
+	} else {
+		base = mmap(NULL, (size_t)file->binfile.st.st_size, PROT_READ,
+			MAP_SHARED, file->binfile.fd, 0);
+	}
+
+	if ( base == MAP_FAILED ) {
+		/* Keep going using the file descriptor we already have open */
+		sieve_sys_warning(svinst, "binary open: "
+			"mmap(%s) failed: %m (falling back to reading the file)", path);
+		file->binfile.load_data = _file_lazy_load_data;
+		file->binfile.load_buffer = _file_lazy_load_buffer;
+		file->binfile.destroy = NULL;
+		file->binfile.const_buffers = FALSE;
+		return &file->binfile;
+	}
+
+	file->mmap_base = base;
+	file->mmap_size = (size_t)file->binfile.st.st_size;
+
+	return &file->binfile;
+}
+
+static struct sieve_binary_file *_file_image_open
+(struct sieve_instance *svinst, const char *path,
+	const void *data, size_t size, time_t mtime)
+{
+	pool_t pool;
+	struct _file_mmap *file;
+
+	pool = pool_alloconly_create("sieve_binary_file_image", 1024);
+	file = p_new(pool, struct _file_mmap, 1);
+	file->binfile.pool = pool;
+	file->binfile.path = p_strdup(pool, path);
+	file->binfile.svinst = svinst;
+	file->binfile.fd = -1;
+	file->binfile.st.st_mode = S_IFREG;
+	file->binfile.st.st_size = size;
+	file->binfile.st.st_mtime = mtime;
+	file->binfile.load_data = _file_mmap_load_data;
+	file->binfile.load_buffer = _file_mmap_load_buffer;
+	file->binfile.const_buffers = TRUE;
+
+	file->mmap_base = data;
+	file->mmap_size = size;
+
+	return &file->binfile;
+}
+
 /*
  * Load binary from a file
  */
@@ -705,6 +766,7 @@ bool sieve_binary_load_block
 	}
 
 	sblock->data = sbin->file->load_buffer(sbin->file, &offset, header->size);
+	sblock->data_const = sbin->file->const_buffers;
 	if ( sblock->data == NULL ) {
 		sieve_sys_error(sbin->svinst,
 			"binary load: failed to read block %d of binary %s (size=%d)",
@@ -886,20 +948,13 @@ static bool _sieve_binary_open(struct sieve_binary *sbin)
 	return result;
 }
 
-struct sieve_binary *sieve_binary_open
-(struct sieve_instance *svinst, const char *path, struct sieve_script *script,
-	enum sieve_error *error_r)
+static struct sieve_binary *_sieve_binary_open_file
+(struct sieve_instance *svinst, struct sieve_binary_file *file,
+	const char *path, struct sieve_script *script, enum sieve_error *error_r)
 {
 	struct sieve_binary_extension_reg *const *regs;
 	unsigned int ext_count, i;
 	struct sieve_binary *sbin;
-	struct sieve_binary_file *file;
-
-	i_assert( script == NULL || sieve_script_svinst(script) == svinst );
-
-	//file = _file_memory_open(path);
-	if ( (file=_file_lazy_open(svinst, path, error_r)) == NULL )
-		return NULL;
 
 	/* Create binary object */
 	sbin = sieve_binary_create(svinst, script);
@@ -934,3 +989,37 @@ struct sieve_binary *sieve_binary_open
 
 	return sbin;
 }
+
+struct sieve_binary *sieve_binary_open
+(struct sieve_instance *svinst, const char *path, struct sieve_script *script,
+	enum sieve_error *error_r)
+{
+	struct sieve_binary_file *file;
+
+	i_assert( script == NULL || sieve_script_svinst(script) == svinst );
+
+	if ( svinst->binary_mmap )
+		file = _file_mmap_open(svinst, path, error_r);
+	else
+		file = _file_lazy_open(svinst, path, error_r);
+	if ( file == NULL )
+		return NULL;
+
+	return _sieve_binary_open_file(svinst, file, path, script, error_r);
+}
+
+struct sieve_binary *sieve_binary_open_image
+(struct sieve_instance *svinst, const char *path,
+	const void *data, size_t size, time_t mtime,
+	struct sieve_script *script, enum sieve_error *error_r)
+{
+	struct sieve_binary_file *file;
+
+	i_assert( script == NULL || sieve_script_svinst(script) == svinst );
+
+	if ( error_r != NULL )
+		*error_r = SIEVE_ERROR_NONE;
+
+	file = _file_image_open(svinst, path, data, size, mtime);
+	return _sieve_binary_open_file(svinst, file, path, script, error_r);
+}
@@ -27,6 +27,10 @@ struct sieve_binary_file {
 		(struct sieve_binary_file *file, off_t *offset, size_t size);
 	buffer_t *(*load_buffer)
 		(struct sieve_binary_file *file, off_t *offset, size_t size);
+	void (*destroy)(struct sieve_binary_file *file);
+
+	/* Buffers returned by load_buffer() are read-only views */
+	bool const_buffers;
 };
 
 bool sieve_binary_file_open
@@ -68,8 +72,13 @@ struct sieve_binary_block {
 	int ext_index;
 
 	buffer_t *data;
+	/* Data refers directly to the (mapped) binary file */
+	bool data_const;
 
 	uoff_t offset;
+
+	/* Operations already decoded by the interpreter */
+	struct sieve_operation_cache *op_cache;
 };
 
 /*
@@ -11,6 +11,8 @@
 #include "ostream.h"
 #include "eacces-error.h"
 #include "safe-mkstemp.h"
+#include "md5.h"
+#include "hex-binary.h"
 
 #include "sieve-error.h"
 #include "sieve-extensions.h"
@@ -92,6 +94,25 @@ struct sieve_binary *sieve_binary_create_new(struct sieve_script *script)
 	return sbin;
 }
 
+void sieve_binary_set_script
+(struct sieve_binary *sbin, struct sieve_script *script)
+{
+	struct sieve_binary_block *sblock;
+
+	/* Only possible for a freshly compiled binary */
+	i_assert( sbin->file == NULL );
+
+	/* Rewrite script metadata block */
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_SCRIPT_DATA);
+	sieve_binary_block_clear(sblock);
+	sieve_script_binary_write_metadata(script, sblock);
+
+	sieve_script_ref(script);
+	if ( sbin->script != NULL )
+		sieve_script_unref(&sbin->script);
+	sbin->script = script;
+}
+
 void sieve_binary_ref(struct sieve_binary *sbin)
 {
 	sbin->refcount++;
@@ -200,6 +221,56 @@ const char *sieve_binfile_from_name(const char *name)
 	return t_strconcat(name, "."SIEVE_BINARY_FILEEXT, NULL);
 }
 
+static bool sieve_binary_block_is_extension_main
+(struct sieve_binary *sbin, unsigned int id)
+{
+	struct sieve_binary_extension_reg *const *regs;
+	unsigned int count, i;
+
+	regs = array_get(&sbin->extensions, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( regs[i]->block_id == id )
+			return TRUE;
+	}
+	return FALSE;
+}
+
+const char *sieve_binary_digest(struct sieve_binary *sbin)
+{
+	unsigned char digest[MD5_RESULTLEN];
+	struct md5_context md5ctx;
+	unsigned int count, i;
+
+	md5_init(&md5ctx);
+
+	/* The script data block holds the location and file metadata of the
+	   script, which change without the code changing. The same applies to
+	   the main blocks of extensions, e.g. the include dependency block
+	   records the metadata of each included script; the code of included
+	   scripts lives in blocks of its own. */
+	count = sieve_binary_block_count(sbin);
+	for ( i = SBIN_SYSBLOCK_EXTENSIONS; i < count; i++ ) {
+		struct sieve_binary_block *sblock;
+		uint32_t id_size[2];
+
+		if ( i >= SBIN_SYSBLOCK_LAST &&
+			sieve_binary_block_is_extension_main(sbin, i) )
+			continue;
+
+		sblock = sieve_binary_block_get(sbin, i);
+		if ( sblock == NULL )
+			return NULL;
+
+		id_size[0] = i;
+		id_size[1] = (uint32_t) sieve_binary_block_get_size(sblock);
+		md5_update(&md5ctx, id_size, sizeof(id_size));
+		md5_update(&md5ctx, sblock->data->data, sblock->data->used);
+	}
+
+	md5_final(&md5ctx, digest);
+	return binary_to_hex(digest, sizeof(digest));
+}
+
 /*
  * Block management
  */
@@ -274,6 +345,15 @@ struct sieve_binary_block *sieve_binary_block_get
 void sieve_binary_block_clear
 (struct sieve_binary_block *sblock)
 {
+	sblock->op_cache = NULL;
+
+	if ( sblock->data_const ) {
+		/* Cannot write into the mapped file; start a fresh buffer */
+		sblock->data = buffer_create_dynamic(sblock->sbin->pool, 64);
+		sblock->data_const = FALSE;
+		return;
+	}
+
 	buffer_reset(sblock->data);
 }
 
@@ -304,6 +384,18 @@ size_t sieve_binary_block_get_size
 	return _sieve_binary_block_get_size(sblock);
 }
 
+struct sieve_operation_cache *sieve_binary_block_get_op_cache
+(const struct sieve_binary_block *sblock)
+{
+	return sblock->op_cache;
+}
+
+void sieve_binary_block_set_op_cache
+(struct sieve_binary_block *sblock, struct sieve_operation_cache *cache)
+{
+	sblock->op_cache = cache;
+}
+
 /*
  * Up-to-date checking
  */
@@ -22,6 +22,11 @@
 struct sieve_binary;
 
 struct sieve_binary *sieve_binary_create_new(struct sieve_script *script);
+/* Re-assigns a freshly compiled binary to another script with identical
+   content, e.g. when an uploaded temporary script is committed under its
+   final name. */
+void sieve_binary_set_script
+	(struct sieve_binary *sbin, struct sieve_script *script);
 void sieve_binary_ref(struct sieve_binary *sbin);
 void sieve_binary_unref(struct sieve_binary **sbin);
 
@@ -48,6 +53,13 @@ bool sieve_binary_saved(struct sieve_binary *sbin);
 
 const char *sieve_binfile_from_name(const char *name);
 
+/* Returns a hex digest over the contents of the program blocks, which
+   identifies the compiled code independent of when and where the binary was
+   saved and of the metadata of the script and any included scripts. The
+   script data block and the main blocks of extensions are left out. Returns
+   NULL when a block cannot be loaded. */
+const char *sieve_binary_digest(struct sieve_binary *sbin);
+
 /*
  * Activation after code generation
  */
@@ -61,6 +73,8 @@ void sieve_binary_activate(struct sieve_binary *sbin);
 int sieve_binary_save
 	(struct sieve_binary *sbin, const char *path, bool update, mode_t save_mode,
 		enum sieve_error *error_r);
+int sieve_binary_save_image
+	(struct sieve_binary *sbin, buffer_t *image);
 
 /*
  * Loading the binary
@@ -69,6 +83,12 @@ int sieve_binary_save
 struct sieve_binary *sieve_binary_open
 	(struct sieve_instance *svinst, const char *path,
 		struct sieve_script *script, enum sieve_error *error_r);
+/* The image must remain valid and unchanged until the binary is freed; mtime
+   is used in place of the binary file's modification time. */
+struct sieve_binary *sieve_binary_open_image
+	(struct sieve_instance *svinst, const char *path,
+		const void *data, size_t size, time_t mtime,
+		struct sieve_script *script, enum sieve_error *error_r);
 bool sieve_binary_up_to_date
 	(struct sieve_binary *sbin, enum sieve_compile_flags cpflags);
 
@@ -104,6 +124,13 @@ struct sieve_binary *sieve_binary_block_get_binary
 unsigned int sieve_binary_block_get_id
 	(const struct sieve_binary_block *sblock);
 
+struct sieve_operation_cache;
+
+struct sieve_operation_cache *sieve_binary_block_get_op_cache
+	(const struct sieve_binary_block *sblock);
+void sieve_binary_block_set_op_cache
+	(struct sieve_binary_block *sblock, struct sieve_operation_cache *cache);
+
 /*
  * Extension support
  */
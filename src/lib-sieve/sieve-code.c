@@ -4,6 +4,7 @@
 #include "lib.h"
 #include "str.h"
 #include "str-sanitize.h"
+#include "array.h"
 
 #include "sieve-common.h"
 #include "sieve-limits.h"
@@ -1116,6 +1117,78 @@ bool sieve_operation_read
 	return ( oprtn->def != NULL );
 }
 
+/* Decoded operation cache */
+
+struct sieve_operation_cache_entry {
+	const struct sieve_operation_def *def;
+	const struct sieve_extension *ext;
+
+	sieve_size_t operands;
+};
+
+struct sieve_operation_cache {
+	size_t code_size;
+
+	/* Code address -> (index of decoded entry + 1) */
+	unsigned int *index;
+	ARRAY(struct sieve_operation_cache_entry) entries;
+};
+
+static struct sieve_operation_cache *sieve_operation_cache_get
+(struct sieve_binary_block *sblock)
+{
+	struct sieve_operation_cache *cache =
+		sieve_binary_block_get_op_cache(sblock);
+	size_t size = sieve_binary_block_get_size(sblock);
+	pool_t pool;
+
+	if ( cache != NULL && cache->code_size == size )
+		return cache;
+
+	/* (Re)create the cache; the code block is not expected to change once it is
+	   executed, so this normally happens only once per block */
+	pool = sieve_binary_pool(sieve_binary_block_get_binary(sblock));
+	cache = p_new(pool, struct sieve_operation_cache, 1);
+	cache->code_size = size;
+	cache->index = p_new(pool, unsigned int, size + 1);
+	p_array_init(&cache->entries, pool, 64);
+
+	sieve_binary_block_set_op_cache(sblock, cache);
+	return cache;
+}
+
+bool sieve_operation_read_cached
+(struct sieve_binary_block *sblock, sieve_size_t *address,
+	struct sieve_operation *oprtn)
+{
+	struct sieve_operation_cache *cache = sieve_operation_cache_get(sblock);
+	const struct sieve_operation_cache_entry *entry;
+	struct sieve_operation_cache_entry *new_entry;
+	sieve_size_t op_address = *address;
+	unsigned int idx;
+
+	if ( op_address < cache->code_size &&
+		(idx=cache->index[op_address]) > 0 ) {
+		entry = array_idx(&cache->entries, idx - 1);
+
+		oprtn->address = op_address;
+		oprtn->def = entry->def;
+		oprtn->ext = entry->ext;
+		*address = entry->operands;
+		return TRUE;
+	}
+
+	if ( !sieve_operation_read(sblock, address, oprtn) )
+		return FALSE;
+
+	new_entry = array_append_space(&cache->entries);
+	new_entry->def = oprtn->def;
+	new_entry->ext = oprtn->ext;
+	new_entry->operands = *address;
+	cache->index[op_address] = array_count(&cache->entries);
+	return TRUE;
+}
+
 /*
  * Jump operations
  */
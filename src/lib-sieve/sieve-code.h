@@ -313,6 +313,11 @@ sieve_size_t sieve_operation_emit
 bool sieve_operation_read
 	(struct sieve_binary_block *sblock, sieve_size_t *address,
 		struct sieve_operation *oprtn);
+/* Same as sieve_operation_read(), but operations are decoded only once and
+   remembered by code address for as long as the binary exists. */
+bool sieve_operation_read_cached
+	(struct sieve_binary_block *sblock, sieve_size_t *address,
+		struct sieve_operation *oprtn);
 const char *sieve_operation_read_string
 	(struct sieve_binary_block *sblock, sieve_size_t *address);
 
@@ -214,6 +214,8 @@ struct sieve_instance {
 	unsigned int max_actions;
 	unsigned int max_redirects;
 	struct sieve_mail_sender redirect_from;
+	bool binary_mmap;
+	size_t body_stream_min_size;
 };
 
 #endif /* __SIEVE_COMMON_H */
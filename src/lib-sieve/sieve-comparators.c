@@ -18,6 +18,11 @@
 #include "sieve-comparators.h"
 
 #include <string.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#  define HAVE_SIEVE_SSE2
+#  include <emmintrin.h>
+#endif
 #include <stdio.h>
 
 /*
@@ -258,3 +263,267 @@ bool sieve_comparator_octet_skip
 
 	return FALSE;
 }
+
+/*
+ * ASCII case mapping
+ */
+
+static inline unsigned char sieve_ascii_fold(unsigned char c)
+{
+	if ( c >= 'A' && c <= 'Z' )
+		return c + ('a' - 'A');
+	return c;
+}
+
+#ifdef HAVE_SIEVE_SSE2
+static inline __m128i sieve_ascii_fold_sse2(__m128i data)
+{
+	/* Bytes >= 0x80 are negative in a signed compare, so these are never
+	   considered uppercase */
+	__m128i upper = _mm_and_si128(
+		_mm_cmpgt_epi8(data, _mm_set1_epi8('A' - 1)),
+		_mm_cmplt_epi8(data, _mm_set1_epi8('Z' + 1)));
+
+	return _mm_add_epi8(data, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+size_t sieve_ascii_casemap_mismatch
+(const char *str1, const char *str2, size_t size)
+{
+	const unsigned char *p1 = (const unsigned char *) str1;
+	const unsigned char *p2 = (const unsigned char *) str2;
+	size_t i = 0;
+
+#ifdef HAVE_SIEVE_SSE2
+	for ( ; i + 16 <= size; i += 16 ) {
+		__m128i d1 = _mm_loadu_si128((const __m128i *) (p1 + i));
+		__m128i d2 = _mm_loadu_si128((const __m128i *) (p2 + i));
+		unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(
+			sieve_ascii_fold_sse2(d1), sieve_ascii_fold_sse2(d2)));
+
+		if ( mask != 0xffff )
+			return i + __builtin_ctz(~mask & 0xffff);
+	}
+#endif
+
+	for ( ; i < size; i++ ) {
+		if ( sieve_ascii_fold(p1[i]) != sieve_ascii_fold(p2[i]) )
+			break;
+	}
+	return i;
+}
+
+int sieve_ascii_casemap_compare
+(const char *str1, const char *str2, size_t size)
+{
+	size_t pos = sieve_ascii_casemap_mismatch(str1, str2, size);
+
+	if ( pos == size )
+		return 0;
+
+	return (int) sieve_ascii_fold((unsigned char) str1[pos]) -
+		(int) sieve_ascii_fold((unsigned char) str2[pos]);
+}
+
+const char *sieve_ascii_casemap_find_char
+(const char *str, size_t size, char chr)
+{
+	const unsigned char *p = (const unsigned char *) str;
+	unsigned char lc = sieve_ascii_fold((unsigned char) chr);
+	unsigned char uc = ( lc >= 'a' && lc <= 'z' ? lc - ('a' - 'A') : lc );
+	size_t i = 0;
+
+	if ( lc == uc )
+		return memchr(str, chr, size);
+
+#ifdef HAVE_SIEVE_SSE2
+	for ( ; i + 16 <= size; i += 16 ) {
+		__m128i data = _mm_loadu_si128((const __m128i *) (p + i));
+		unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(data, _mm_set1_epi8((char) lc)),
+			_mm_cmpeq_epi8(data, _mm_set1_epi8((char) uc))));
+
+		if ( mask != 0 )
+			return str + i + __builtin_ctz(mask);
+	}
+#endif
+
+	for ( ; i < size; i++ ) {
+		if ( p[i] == lc || p[i] == uc )
+			return str + i;
+	}
+	return NULL;
+}
+
+/*
+ * Substring search
+ */
+
+/* Values shorter than this are searched naively; building the skip table does
+   not pay off for those. */
+#define SIEVE_SUBSTRING_BMH_MIN_VALUE_SIZE 64
+
+static inline unsigned char sieve_substring_fold
+(unsigned char c, bool casemap)
+{
+	return ( casemap ? sieve_ascii_fold(c) : c );
+}
+
+static inline bool sieve_substring_equals
+(const unsigned char *val, const unsigned char *key, size_t size,
+	bool casemap)
+{
+	if ( !casemap )
+		return ( memcmp(val, key, size) == 0 );
+
+	return ( sieve_ascii_casemap_mismatch
+		((const char *) val, (const char *) key, size) == size );
+}
+
+static inline const unsigned char *sieve_substring_find_naive
+(const unsigned char *val, size_t val_size,
+	const unsigned char *key, size_t key_size, bool casemap)
+{
+	size_t end = val_size - key_size, pos = 0;
+	const char *p;
+
+	while ( pos <= end ) {
+		/* Find next candidate for the first character */
+		if ( casemap ) {
+			p = sieve_ascii_casemap_find_char
+				((const char *) val + pos, end - pos + 1, (char) key[0]);
+		} else {
+			p = memchr(val + pos, key[0], end - pos + 1);
+		}
+		if ( p == NULL )
+			return NULL;
+		pos = (const unsigned char *) p - val;
+
+		if ( sieve_substring_equals
+			(val + pos + 1, key + 1, key_size - 1, casemap) )
+			return val + pos;
+		pos++;
+	}
+	return NULL;
+}
+
+/* Boyer-Moore-Horspool */
+static void sieve_substring_init_skip
+(size_t skip[256], const unsigned char *key, size_t key_size, bool casemap)
+{
+	size_t last = key_size - 1, i;
+
+	for ( i = 0; i < 256; i++ )
+		skip[i] = key_size;
+	for ( i = 0; i < last; i++ )
+		skip[sieve_substring_fold(key[i], casemap)] = last - i;
+}
+
+static inline const unsigned char *sieve_substring_find_bmh
+(const unsigned char *val, size_t val_size,
+	const unsigned char *key, size_t key_size, const size_t skip[256],
+	bool casemap)
+{
+	size_t last = key_size - 1, pos;
+	unsigned char key_last = sieve_substring_fold(key[last], casemap);
+	unsigned char c;
+
+	pos = 0;
+	while ( pos <= val_size - key_size ) {
+		c = sieve_substring_fold(val[pos + last], casemap);
+		if ( c == key_last &&
+			sieve_substring_equals(val + pos, key, last, casemap) )
+			return val + pos;
+		pos += skip[c];
+	}
+	return NULL;
+}
+
+static inline const char *sieve_substring_find_with
+(const char *val, size_t val_size, const char *key, size_t key_size,
+	const size_t *skip, bool casemap)
+{
+	const unsigned char *uval = (const unsigned char *) val;
+	const unsigned char *ukey = (const unsigned char *) key;
+	size_t local_skip[256];
+
+	if ( key_size == 0 )
+		return val;
+	if ( key_size > val_size )
+		return NULL;
+
+	if ( !casemap && key_size == 1 )
+		return memchr(val, key[0], val_size);
+
+	if ( key_size < 3 || val_size < SIEVE_SUBSTRING_BMH_MIN_VALUE_SIZE ) {
+		return (const char *) sieve_substring_find_naive
+			(uval, val_size, ukey, key_size, casemap);
+	}
+
+	if ( skip == NULL ) {
+		sieve_substring_init_skip(local_skip, ukey, key_size, casemap);
+		skip = local_skip;
+	}
+
+	return (const char *) sieve_substring_find_bmh
+		(uval, val_size, ukey, key_size, skip, casemap);
+}
+
+static inline bool sieve_substring_find
+(const char *val, size_t val_size, const char *key, size_t key_size,
+	bool casemap)
+{
+	return ( sieve_substring_find_with
+		(val, val_size, key, key_size, NULL, casemap) != NULL );
+}
+
+/* Precompiled search; the skip table is built once and reused for every value
+   the key is searched in. */
+
+struct sieve_substring_search {
+	const char *key;
+	size_t key_size;
+	bool casemap;
+
+	size_t skip[256];
+};
+
+struct sieve_substring_search *sieve_substring_search_create
+(pool_t pool, const char *key, size_t key_size, bool casemap)
+{
+	struct sieve_substring_search *search;
+
+	search = p_new(pool, struct sieve_substring_search, 1);
+	search->key = key;
+	search->key_size = key_size;
+	search->casemap = casemap;
+
+	if ( key_size > 0 ) {
+		sieve_substring_init_skip(search->skip,
+			(const unsigned char *) key, key_size, casemap);
+	}
+	return search;
+}
+
+const char *sieve_substring_search_find
+(const struct sieve_substring_search *search,
+	const char *val, size_t val_size)
+{
+	return sieve_substring_find_with(val, val_size,
+		search->key, search->key_size, search->skip, search->casemap);
+}
+
+bool sieve_comparator_octet_substring_match
+(const struct sieve_comparator *cmp ATTR_UNUSED,
+	const char *val, size_t val_size, const char *key, size_t key_size)
+{
+	return sieve_substring_find(val, val_size, key, key_size, FALSE);
+}
+
+bool sieve_comparator_ascii_casemap_substring_match
+(const struct sieve_comparator *cmp ATTR_UNUSED,
+	const char *val, size_t val_size, const char *key, size_t key_size)
+{
+	return sieve_substring_find(val, val_size, key, key_size, TRUE);
+}
@@ -56,6 +56,12 @@ struct sieve_comparator_def {
 		const char **key, const char *key_end);
 	bool (*char_skip)(const struct sieve_comparator *cmp,
 		const char **val, const char *val_end);
+
+	/* Substring search (optional; char_match is used when missing) */
+
+	bool (*substring_match)(const struct sieve_comparator *cmp,
+		const char *val, size_t val_size,
+		const char *key, size_t key_size);
 };
 
 /*
@@ -153,4 +159,31 @@ bool sieve_comparator_octet_skip
 	(const struct sieve_comparator *cmp ATTR_UNUSED,
 		const char **val, const char *val_end);
 
+/* ASCII case mapping; only the letters A-Z and a-z are considered equal
+   regardless of case. */
+size_t sieve_ascii_casemap_mismatch
+	(const char *str1, const char *str2, size_t size);
+int sieve_ascii_casemap_compare
+	(const char *str1, const char *str2, size_t size);
+const char *sieve_ascii_casemap_find_char
+	(const char *str, size_t size, char chr);
+
+/* Substring search with a precompiled skip table; the key is not copied and
+   must remain valid for as long as the search object is used. Returns a
+   pointer to the first occurrence of the key in the value or NULL. */
+struct sieve_substring_search;
+
+struct sieve_substring_search *sieve_substring_search_create
+	(pool_t pool, const char *key, size_t key_size, bool casemap);
+const char *sieve_substring_search_find
+	(const struct sieve_substring_search *search,
+		const char *val, size_t val_size);
+
+bool sieve_comparator_octet_substring_match
+	(const struct sieve_comparator *cmp ATTR_UNUSED,
+		const char *val, size_t val_size, const char *key, size_t key_size);
+bool sieve_comparator_ascii_casemap_substring_match
+	(const struct sieve_comparator *cmp ATTR_UNUSED,
+		const char *val, size_t val_size, const char *key, size_t key_size);
+
 #endif /* __SIEVE_COMPARATORS_H */
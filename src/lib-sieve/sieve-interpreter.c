@@ -22,11 +22,19 @@
 #include "sieve-result.h"
 #include "sieve-comparators.h"
 #include "sieve-runtime-trace.h"
+#include "sieve-profile.h"
 
 #include "sieve-interpreter.h"
 
 #include <string.h>
 
+/*
+ * Configuration
+ */
+
+/* Number of operations executed within a single data stack frame */
+#define SIEVE_INTERPRETER_FRAME_OPERATIONS 16
+
 /*
  * Interpreter extension
  */
@@ -84,6 +92,9 @@ struct sieve_interpreter {
 	/* Location information */
 	struct sieve_binary_debug_reader *dreader;
 	unsigned int command_line;
+
+	/* Execution profile */
+	struct sieve_profile_script *profile_script;
 };
 
 static struct sieve_interpreter *_sieve_interpreter_create
@@ -144,6 +155,15 @@ static struct sieve_interpreter *_sieve_interpreter_create
 	else
 		interp->runenv.script = script;
 
+	if ( senv->profile != NULL ) {
+		const char *location = ( interp->runenv.script == NULL ?
+			sieve_binary_path(sbin) :
+			sieve_script_location(interp->runenv.script) );
+
+		interp->profile_script =
+			sieve_profile_get_script(senv->profile, location);
+	}
+
 	interp->runenv.pc = 0;
 	address = &(interp->runenv.pc);
 
@@ -848,6 +868,20 @@ bool sieve_interpreter_get_test_result
  * Code execute
  */
 
+static inline int sieve_interpreter_operation_run
+(struct sieve_interpreter *interp, const struct sieve_operation_def *op,
+	sieve_size_t *address)
+{
+	if ( op->execute == NULL ) { /* Noop ? */
+		sieve_runtime_trace
+			(&interp->runenv, SIEVE_TRLVL_COMMANDS, "OP: %s (NOOP)",
+				sieve_operation_mnemonic(&interp->oprtn));
+		return SIEVE_EXEC_OK;
+	}
+
+	return op->execute(&(interp->runenv), address);
+}
+
 static int sieve_interpreter_operation_execute
 (struct sieve_interpreter *interp)
 {
@@ -857,7 +891,7 @@ static int sieve_interpreter_operation_execute
 	sieve_runtime_trace_toplevel(&interp->runenv);
 
 	/* Read the operation */
-	if ( sieve_operation_read(interp->runenv.sblock, address, oprtn) ) {
+	if ( sieve_operation_read_cached(interp->runenv.sblock, address, oprtn) ) {
 		const struct sieve_operation_def *op = oprtn->def;
 		int result = SIEVE_EXEC_OK;
 
@@ -865,14 +899,15 @@ static int sieve_interpreter_operation_execute
 		interp->command_line = 0;
 
 		/* Execute the operation */
-		if ( op->execute != NULL ) { /* Noop ? */
-			T_BEGIN {
-				result = op->execute(&(interp->runenv), address);
-			} T_END;
+		if ( interp->profile_script != NULL ) {
+			struct sieve_profile_sample sample;
+
+			sieve_profile_sample_start(&sample, oprtn->address);
+			result = sieve_interpreter_operation_run(interp, op, address);
+			sieve_profile_sample_finish
+				(interp->profile_script, &sample, &interp->runenv);
 		} else {
-			sieve_runtime_trace
-				(&interp->runenv, SIEVE_TRLVL_COMMANDS, "OP: %s (NOOP)",
-					sieve_operation_mnemonic(oprtn));
+			result = sieve_interpreter_operation_run(interp, op, address);
 		}
 
 		return result;
@@ -888,6 +923,7 @@ int sieve_interpreter_continue
 {
 	const struct sieve_runtime_env *renv = &interp->runenv;
 	sieve_size_t *address = &(interp->runenv.pc);
+	size_t code_size;
 	int ret = SIEVE_EXEC_OK;
 
 	sieve_result_ref(renv->result);
@@ -896,16 +932,26 @@ int sieve_interpreter_continue
 	if ( interrupted != NULL )
 		*interrupted = FALSE;
 
+	code_size = sieve_binary_block_get_size(renv->sblock);
 	while ( ret == SIEVE_EXEC_OK && !interp->interrupted &&
-		*address < sieve_binary_block_get_size(renv->sblock) ) {
-		if ( interp->loop_limit != 0 && *address > interp->loop_limit ) {
-			sieve_runtime_trace_error(renv,
-				"program crossed loop boundary");
-			ret = SIEVE_EXEC_BIN_CORRUPT;
-			break;
-		}
+		*address < code_size ) {
+		/* Operations share a data stack frame in batches */
+		T_BEGIN {
+			unsigned int count = 0;
+
+			while ( ret == SIEVE_EXEC_OK && !interp->interrupted &&
+				*address < code_size &&
+				count++ < SIEVE_INTERPRETER_FRAME_OPERATIONS ) {
+				if ( interp->loop_limit != 0 && *address > interp->loop_limit ) {
+					sieve_runtime_trace_error(renv,
+						"program crossed loop boundary");
+					ret = SIEVE_EXEC_BIN_CORRUPT;
+					break;
+				}
 
-		ret = sieve_interpreter_operation_execute(interp);
+				ret = sieve_interpreter_operation_execute(interp);
+			}
+		} T_END;
 	}
 
 	if ( ret != SIEVE_EXEC_OK ) {
@@ -45,20 +45,67 @@ struct sieve_lexical_scanner {
 	struct sieve_instance *svinst;
 
 	struct sieve_script *script;
-	struct istream *input;
 
 	struct sieve_error_handler *ehandler;
 
-	/* Currently scanned data */
+	/* The whole script */
+	buffer_t *data;
 	const unsigned char *buffer;
 	size_t buffer_size;
 	size_t buffer_pos;
 
 	struct sieve_lexer lexer;
 
+	/* Token string values: copied or referring to the script buffer */
+	string_t *str_value;
+	buffer_t str_const;
+
 	int current_line;
 };
 
+static buffer_t *sieve_lexer_read_script
+(struct sieve_script *script, struct istream *input,
+	struct sieve_error_handler *ehandler, enum sieve_error *error_r)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	const unsigned char *data;
+	buffer_t *buffer;
+	size_t size;
+	int ret;
+
+	buffer = buffer_create_dynamic(default_pool, 4096);
+	while ( (ret=i_stream_read_data(input, &data, &size, 0)) > 0 ) {
+		/* Size may not have been known beforehand */
+		if ( svinst->max_script_size > 0 &&
+			buffer->used + size > svinst->max_script_size ) {
+			sieve_error(ehandler, sieve_script_name(script),
+				"sieve script is too large (max %"PRIuSIZE_T" bytes)",
+				svinst->max_script_size);
+			if ( error_r != NULL )
+				*error_r = SIEVE_ERROR_NOT_POSSIBLE;
+			buffer_free(&buffer);
+			return NULL;
+		}
+
+		buffer_append(buffer, data, size);
+		i_stream_skip(input, size);
+	}
+	i_assert( ret == -1 );
+
+	if ( input->stream_errno != 0 ) {
+		sieve_critical(svinst, ehandler, sieve_script_name(script),
+			"error reading script",
+			"error reading script during lexical analysis: %s",
+			i_stream_get_error(input));
+		if ( error_r != NULL )
+			*error_r = SIEVE_ERROR_TEMP_FAILURE;
+		buffer_free(&buffer);
+		return NULL;
+	}
+
+	return buffer;
+}
+
 const struct sieve_lexer *sieve_lexer_create
 (struct sieve_script *script, struct sieve_error_handler *ehandler,
 	enum sieve_error *error_r)
@@ -67,6 +114,7 @@ const struct sieve_lexer *sieve_lexer_create
 	struct sieve_instance *svinst = sieve_script_svinst(script);
 	struct istream *stream;
 	const struct stat *st;
+	buffer_t *data;
 
 	/* Open script as stream */
 	if ( sieve_script_get_stream(script, &stream, error_r) < 0 )
@@ -84,24 +132,29 @@ const struct sieve_lexer *sieve_lexer_create
 		return NULL;
 	}
 
+	/* Read the whole script */
+	if ( (data=sieve_lexer_read_script
+		(script, stream, ehandler, error_r)) == NULL )
+		return NULL;
+
 	scanner = i_new(struct sieve_lexical_scanner, 1);
 	scanner->lexer.scanner = scanner;
 
 	scanner->ehandler = ehandler;
 	sieve_error_handler_ref(ehandler);
 
-	scanner->input = stream;
-	i_stream_ref(scanner->input);
-
 	scanner->script = script;
 	sieve_script_ref(script);
 
-	scanner->buffer = NULL;
-	scanner->buffer_size = 0;
+	scanner->data = data;
+	scanner->buffer = data->data;
+	scanner->buffer_size = data->used;
 	scanner->buffer_pos = 0;
 
+	scanner->str_value = str_new(default_pool, 256);
+
 	scanner->lexer.token_type = STT_NONE;
-	scanner->lexer.token_str_value = str_new(default_pool, 256);
+	scanner->lexer.token_str_value = scanner->str_value;
 	scanner->lexer.token_int_value = 0;
 	scanner->lexer.token_line = 1;
 
@@ -115,10 +168,10 @@ void sieve_lexer_free(const struct sieve_lexer **_lexer)
 	const struct sieve_lexer *lexer = *_lexer;
 	struct sieve_lexical_scanner *scanner = lexer->scanner;
 
-	i_stream_unref(&scanner->input);
 	sieve_script_unref(&scanner->script);
 	sieve_error_handler_unref(&scanner->ehandler);
-	str_free(&scanner->lexer.token_str_value);
+	str_free(&scanner->str_value);
+	buffer_free(&scanner->data);
 
 	i_free(scanner);
 	*_lexer = NULL;
@@ -234,36 +287,41 @@ void sieve_lexer_token_print(const struct sieve_lexer *lexer)
  * Lexical scanning
  */
 
-static void sieve_lexer_shift(struct sieve_lexical_scanner *scanner)
-{
-	if ( scanner->buffer != NULL && scanner->buffer[scanner->buffer_pos] == '\n' )
-		scanner->current_line++;
+/* The whole script is read into memory when the lexer is created, so that
+ * scanning can work directly on the script buffer. A quoted string without
+ * escapes or line breaks is not copied by the lexer at all: the token string
+ * refers to the script buffer. Other tokens are copied in chunks rather than
+ * character by character wherever possible.
+ */
 
-	if ( scanner->buffer != NULL &&
-		scanner->buffer_pos + 1 < scanner->buffer_size )
+static inline void sieve_lexer_shift(struct sieve_lexical_scanner *scanner)
+{
+	if ( scanner->buffer_pos < scanner->buffer_size ) {
+		if ( scanner->buffer[scanner->buffer_pos] == '\n' )
+			scanner->current_line++;
 		scanner->buffer_pos++;
-	else {
-		if ( scanner->buffer != NULL )
-			i_stream_skip(scanner->input, scanner->buffer_size);
-
-		scanner->buffer = i_stream_get_data(scanner->input, &scanner->buffer_size);
-
-		if ( scanner->buffer == NULL && i_stream_read(scanner->input) > 0 )
-	  		scanner->buffer = i_stream_get_data
-					(scanner->input, &scanner->buffer_size);
-
-		scanner->buffer_pos = 0;
 	}
 }
 
 static inline int sieve_lexer_curchar(struct sieve_lexical_scanner *scanner)
 {
-	if ( scanner->buffer == NULL )
+	if ( scanner->buffer_pos >= scanner->buffer_size )
 		return -1;
 
 	return scanner->buffer[scanner->buffer_pos];
 }
 
+static inline void sieve_lexer_str_append
+(string_t *str, const unsigned char *data, size_t size, size_t max_len)
+{
+	/* At most one byte beyond the limit is kept, so that it can be detected */
+	if ( str_len(str) > max_len )
+		return;
+	if ( size > max_len + 1 - str_len(str) )
+		size = max_len + 1 - str_len(str);
+	buffer_append(str, data, size);
+}
+
 static inline const char *_char_sanitize(int ch)
 {
 	if ( ch > 31 && ch < 127 )
@@ -280,8 +338,8 @@ sieve_lexer_scan_number(struct sieve_lexical_scanner *scanner)
 	string_t *str;
 	bool overflow = FALSE;
 
-	str_truncate(lexer->token_str_value,0);
-	str = lexer->token_str_value;
+	str_truncate(scanner->str_value, 0);
+	str = scanner->str_value;
 
 	while ( i_isdigit(sieve_lexer_curchar(scanner)) ) {
 		str_append_c(str, sieve_lexer_curchar(scanner));
@@ -342,61 +400,291 @@ static bool
 sieve_lexer_scan_hash_comment(struct sieve_lexical_scanner *scanner)
 {
 	struct sieve_lexer *lexer = &scanner->lexer;
+	const unsigned char *p = scanner->buffer + scanner->buffer_pos;
+	const unsigned char *pend = scanner->buffer + scanner->buffer_size;
+
+	/* Skip to the end of the line; stray CR is ignored */
+	while ( p < pend && *p != '\n' && *p != '\0' )
+		p++;
+	scanner->buffer_pos = p - scanner->buffer;
 
-	while ( sieve_lexer_curchar(scanner) != '\n' ) {
-		switch( sieve_lexer_curchar(scanner) ) {
+	switch( sieve_lexer_curchar(scanner) ) {
+	case -1:
+		sieve_lexer_warning(lexer,
+			"no newline (CRLF) at end of hash comment at end of file");
+		lexer->token_type = STT_WHITESPACE;
+		return TRUE;
+	case '\0':
+		sieve_lexer_error
+			(lexer, "encountered NUL character in hash comment");
+		lexer->token_type = STT_ERROR;
+		return FALSE;
+	default:
+		break;
+	}
+
+	sieve_lexer_shift(scanner);
+
+	lexer->token_type = STT_WHITESPACE;
+	return TRUE;
+}
+
+static bool
+sieve_lexer_scan_quoted_string(struct sieve_lexical_scanner *scanner)
+{
+	struct sieve_lexer *lexer = &scanner->lexer;
+	const unsigned char *start, *p, *pend;
+	string_t *str;
+
+	/* Find the end of the initial part that needs no processing */
+	start = p = scanner->buffer + scanner->buffer_pos;
+	pend = scanner->buffer + scanner->buffer_size;
+	while ( p < pend && *p != '"' && *p != '\\' &&
+		*p != '\r' && *p != '\n' && *p != '\0' )
+		p++;
+
+	if ( p < pend && *p == '"' &&
+		(size_t)(p - start) <= SIEVE_MAX_STRING_LEN ) {
+		/* Plain string; refer to the script buffer */
+		buffer_create_from_const_data
+			(&scanner->str_const, start, p - start);
+		lexer->token_str_value = &scanner->str_const;
+
+		scanner->buffer_pos = (p + 1) - scanner->buffer;
+		lexer->token_type = STT_STRING;
+		return TRUE;
+	}
+
+	/* Copy the initial part and process the rest character by character */
+	str_truncate(scanner->str_value, 0);
+	str = scanner->str_value;
+	sieve_lexer_str_append(str, start, p - start, SIEVE_MAX_STRING_LEN);
+	scanner->buffer_pos = p - scanner->buffer;
+
+	while ( sieve_lexer_curchar(scanner) != '"' ) {
+		if ( sieve_lexer_curchar(scanner) == '\\' )
+			sieve_lexer_shift(scanner);
+
+		switch ( sieve_lexer_curchar(scanner) ) {
+
+		/* End of file */
 		case -1:
-			if ( !scanner->input->eof ) {
-				lexer->token_type = STT_ERROR;
-				return FALSE;
-			}
-			sieve_lexer_warning(lexer,
-				"no newline (CRLF) at end of hash comment at end of file");
-			lexer->token_type = STT_WHITESPACE;
-			return TRUE;
+			sieve_lexer_error(lexer,
+				"end of file before end of quoted string "
+				"started at line %d", lexer->token_line);
+			lexer->token_type = STT_ERROR;
+			return FALSE;
+
+		/* NUL character */
 		case '\0':
-			sieve_lexer_error
-				(lexer, "encountered NUL character in hash comment");
+			sieve_lexer_error(lexer,
+				"encountered NUL character in quoted string "
+				"started at line %d", lexer->token_line);
 			lexer->token_type = STT_ERROR;
 			return FALSE;
-		default:
+
+		/* CR .. check for LF */
+		case '\r':
+			sieve_lexer_shift(scanner);
+
+			if ( sieve_lexer_curchar(scanner) != '\n' ) {
+				sieve_lexer_error(lexer,
+					"found stray carriage-return (CR) character "
+					"in quoted string started at line %d", lexer->token_line);
+				lexer->token_type = STT_ERROR;
+				return FALSE;
+			}
+
+			if ( str_len(str) <= SIEVE_MAX_STRING_LEN )
+				str_append(str, "\r\n");
 			break;
-		}
 
-		/* Stray CR is ignored */
+		/* Loose LF is allowed (non-standard) and converted to CRLF */
+		case '\n':
+			if ( str_len(str) <= SIEVE_MAX_STRING_LEN )
+				str_append(str, "\r\n");
+			break;
+
+		/* Other characters */
+		default:
+			if ( str_len(str) <= SIEVE_MAX_STRING_LEN )
+				str_append_c(str, sieve_lexer_curchar(scanner));
+		}
 
 		sieve_lexer_shift(scanner);
 	}
 
 	sieve_lexer_shift(scanner);
 
-	lexer->token_type = STT_WHITESPACE;
+	if ( str_len(str) > SIEVE_MAX_STRING_LEN ) {
+		sieve_lexer_error(lexer,
+			"quoted string started at line %d is too long "
+			"(longer than %llu bytes)", lexer->token_line,
+			(long long) SIEVE_MAX_STRING_LEN);
+		lexer->token_type = STT_ERROR;
+		return FALSE;
+	}
+
+	lexer->token_type = STT_STRING;
 	return TRUE;
 }
 
-/* sieve_lexer_scan_raw_token:
- *   Scans valid tokens and whitespace
- */
 static bool
-sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
+sieve_lexer_scan_multiline_string(struct sieve_lexical_scanner *scanner)
 {
 	struct sieve_lexer *lexer = &scanner->lexer;
-	string_t *str;
-	int ret;
+	string_t *str = scanner->str_value;
+
+	/* Discard SP and HTAB whitespace */
+	while ( sieve_lexer_curchar(scanner) == ' ' ||
+		sieve_lexer_curchar(scanner) == '\t' )
+		sieve_lexer_shift(scanner);
+
+	/* Discard hash comment or handle single CRLF */
+	if ( sieve_lexer_curchar(scanner) == '\r' )
+		sieve_lexer_shift(scanner);
+	switch ( sieve_lexer_curchar(scanner) ) {
+	case '#':
+		if ( !sieve_lexer_scan_hash_comment(scanner) )
+			return FALSE;
+		if ( sieve_lexer_curchar(scanner) == -1 ) {
+			sieve_lexer_error(lexer,
+				"end of file before end of multi-line string");
+			lexer->token_type = STT_ERROR;
+			return FALSE;
+		}
+		break;
+	case '\n':
+		sieve_lexer_shift(scanner);
+		break;
+	case -1:
+		sieve_lexer_error(lexer,
+			"end of file before end of multi-line string");
+		lexer->token_type = STT_ERROR;
+		return FALSE;
+	default:
+		sieve_lexer_error(lexer,
+			"invalid character %s after 'text:' in multiline string",
+			_char_sanitize(sieve_lexer_curchar(scanner)));
+		lexer->token_type = STT_ERROR;
+		return FALSE;
+	}
+
+	/* Start over */
+	str_truncate(str, 0);
+
+	/* Parse literal lines */
+	while ( TRUE ) {
+		const unsigned char *start, *p, *pend;
+		bool cr_shifted = FALSE;
 
-	/* Read first character */
-	if ( lexer->token_type == STT_NONE ) {
-		if ( (ret=i_stream_read(scanner->input)) < 0 ) {
-			i_assert( ret != -2 );
-			if ( !scanner->input->eof ) {
+		/* Remove dot-stuffing or detect end of text */
+		if ( sieve_lexer_curchar(scanner) == '.' ) {
+			sieve_lexer_shift(scanner);
+
+			/* Check for CR.. */
+			if ( sieve_lexer_curchar(scanner) == '\r' ) {
+				sieve_lexer_shift(scanner);
+				cr_shifted = TRUE;
+			}
+
+			/* ..LF */
+			if ( sieve_lexer_curchar(scanner) == '\n' ) {
+				sieve_lexer_shift(scanner);
+
+				/* End of multi-line string */
+
+				/* Check whether length limit was violated */
+				if ( str_len(str) > SIEVE_MAX_STRING_LEN ) {
+					sieve_lexer_error(lexer,
+						"multi-line string started at line %d is too long "
+						"(longer than %llu bytes)", lexer->token_line,
+						(long long) SIEVE_MAX_STRING_LEN);
+						lexer->token_type = STT_ERROR;
+						return FALSE;
+				}
+
+				lexer->token_type = STT_STRING;
+				return TRUE;
+			} else if ( cr_shifted ) {
+				/* Seen CR, but no LF */
+				if ( sieve_lexer_curchar(scanner) != -1 ) {
+					sieve_lexer_error(lexer,
+						"found stray carriage-return (CR) character "
+						"in multi-line string started at line %d", lexer->token_line);
+				}
 				lexer->token_type = STT_ERROR;
 				return FALSE;
 			}
+
+			/* Handle dot-stuffing */
+			if ( str_len(str) <= SIEVE_MAX_STRING_LEN )
+				str_append_c(str, '.');
+			if ( sieve_lexer_curchar(scanner) == '.' )
+				sieve_lexer_shift(scanner);
+		}
+
+		/* Copy the rest of the line at once */
+		start = p = scanner->buffer + scanner->buffer_pos;
+		pend = scanner->buffer + scanner->buffer_size;
+		while ( p < pend && *p != '\n' && *p != '\r' && *p != '\0' )
+			p++;
+		sieve_lexer_str_append(str, start, p - start, SIEVE_MAX_STRING_LEN);
+		scanner->buffer_pos = p - scanner->buffer;
+
+		switch ( sieve_lexer_curchar(scanner) ) {
+		case -1:
+			sieve_lexer_error(lexer,
+				"end of file before end of multi-line string");
+			lexer->token_type = STT_ERROR;
+			return FALSE;
+		case '\0':
+			sieve_lexer_error(lexer,
+				"encountered NUL character in quoted string "
+				"started at line %d", lexer->token_line);
+			lexer->token_type = STT_ERROR;
+			return FALSE;
+		default:
+			break;
+		}
+
+		/* If exited loop due to CR, skip it */
+		if ( sieve_lexer_curchar(scanner) == '\r' )
+			sieve_lexer_shift(scanner);
+
+		/* Now we must see an LF */
+		if ( sieve_lexer_curchar(scanner) != '\n' ) {
+			if ( sieve_lexer_curchar(scanner) != -1 ) {
+				sieve_lexer_error(lexer,
+					"found stray carriage-return (CR) character "
+					"in multi-line string started at line %d", lexer->token_line);
+			}
+			lexer->token_type = STT_ERROR;
+			return FALSE;
 		}
+
+		if ( str_len(str) <= SIEVE_MAX_STRING_LEN )
+			str_append(str, "\r\n");
+
 		sieve_lexer_shift(scanner);
 	}
 
+	i_unreached();
+	lexer->token_type = STT_ERROR;
+	return FALSE;
+}
+
+/* sieve_lexer_scan_raw_token:
+ *   Scans valid tokens and whitespace
+ */
+static bool
+sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
+{
+	struct sieve_lexer *lexer = &scanner->lexer;
+	string_t *str;
+
 	lexer->token_line = scanner->current_line;
+	lexer->token_str_value = scanner->str_value;
 
 	switch ( sieve_lexer_curchar(scanner) ) {
 
@@ -421,11 +709,9 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 			while ( TRUE ) {
 				switch ( sieve_lexer_curchar(scanner) ) {
 				case -1:
-					if ( scanner->input->eof ) {
-						sieve_lexer_error(lexer,
-							"end of file before end of bracket comment ('/* ... */') "
-							"started at line %d", lexer->token_line);
-					}
+					sieve_lexer_error(lexer,
+						"end of file before end of bracket comment ('/* ... */') "
+						"started at line %d", lexer->token_line);
 					lexer->token_type = STT_ERROR;
 					return FALSE;
 				case '*':
@@ -484,78 +770,7 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 	/* quoted-string */
 	case '"':
 		sieve_lexer_shift(scanner);
-
-		str_truncate(lexer->token_str_value, 0);
-		str = lexer->token_str_value;
-
-		while ( sieve_lexer_curchar(scanner) != '"' ) {
-			if ( sieve_lexer_curchar(scanner) == '\\' )
-				sieve_lexer_shift(scanner);
-
-			switch ( sieve_lexer_curchar(scanner) ) {
-
-			/* End of file */
-			case -1:
-				if ( scanner->input->eof ) {
-					sieve_lexer_error(lexer,
-						"end of file before end of quoted string "
-						"started at line %d", lexer->token_line);
-				}
-				lexer->token_type = STT_ERROR;
-				return FALSE;
-
-			/* NUL character */
-			case '\0':
-				sieve_lexer_error(lexer,
-					"encountered NUL character in quoted string "
-					"started at line %d", lexer->token_line);
-				lexer->token_type = STT_ERROR;
-				return FALSE;
-
-			/* CR .. check for LF */
-			case '\r':
-				sieve_lexer_shift(scanner);
-
-				if ( sieve_lexer_curchar(scanner) != '\n' ) {
-					sieve_lexer_error(lexer,
-						"found stray carriage-return (CR) character "
-						"in quoted string started at line %d", lexer->token_line);
-					lexer->token_type = STT_ERROR;
-					return FALSE;
-				}
-
-				if ( str_len(str) <= SIEVE_MAX_STRING_LEN )
-					str_append(str, "\r\n");
-				break;
-
-			/* Loose LF is allowed (non-standard) and converted to CRLF */
-			case '\n':
-				if ( str_len(str) <= SIEVE_MAX_STRING_LEN )
-					str_append(str, "\r\n");
-				break;
-
-			/* Other characters */
-			default:
-				if ( str_len(str) <= SIEVE_MAX_STRING_LEN )
-					str_append_c(str, sieve_lexer_curchar(scanner));
-			}
-
-			sieve_lexer_shift(scanner);
-		}
-
-		sieve_lexer_shift(scanner);
-
-		if ( str_len(str) > SIEVE_MAX_STRING_LEN ) {
-			sieve_lexer_error(lexer,
-				"quoted string started at line %d is too long "
-				"(longer than %llu bytes)", lexer->token_line,
-				(long long) SIEVE_MAX_STRING_LEN);
-			lexer->token_type = STT_ERROR;
-			return FALSE;
-		}
-
-		lexer->token_type = STT_STRING;
-		return TRUE;
+		return sieve_lexer_scan_quoted_string(scanner);
 
 	/* single character tokens */
 	case ']':
@@ -593,10 +808,6 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 
 	/* EOF */
 	case -1:
-		if ( !scanner->input->eof ) {
-			lexer->token_type = STT_ERROR;
-			return FALSE;
-		}
 		lexer->token_type = STT_EOF;
 		return TRUE;
 
@@ -611,8 +822,10 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 			sieve_lexer_curchar(scanner) == ':' ) {
 
 			enum sieve_token_type type = STT_IDENTIFIER;
-			str_truncate(lexer->token_str_value,0);
-			str = lexer->token_str_value;
+			const unsigned char *start, *p, *pend;
+
+			str_truncate(scanner->str_value, 0);
+			str = scanner->str_value;
 
 			/* If it starts with a ':' it is a tag and not an identifier */
  			if ( sieve_lexer_curchar(scanner) == ':' ) {
@@ -620,29 +833,23 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 				type = STT_TAG;
 
 				/* First character still can't be a DIGIT */
- 				if ( i_isalpha(sieve_lexer_curchar(scanner)) ||
-					sieve_lexer_curchar(scanner) == '_' ) {
-					str_append_c(str, sieve_lexer_curchar(scanner));
-					sieve_lexer_shift(scanner);
-				} else {
+ 				if ( !i_isalpha(sieve_lexer_curchar(scanner)) &&
+					sieve_lexer_curchar(scanner) != '_' ) {
 					/* Hmm, otherwise it is just a spurious colon */
 					lexer->token_type = STT_COLON;
 					return TRUE;
 				}
-			} else {
-				str_append_c(str, sieve_lexer_curchar(scanner));
-				sieve_lexer_shift(scanner);
 			}
 
 			/* Scan the rest of the identifier */
-			while ( i_isalnum(sieve_lexer_curchar(scanner)) ||
-				sieve_lexer_curchar(scanner) == '_' ) {
-
-				if ( str_len(str) <= SIEVE_MAX_IDENTIFIER_LEN ) {
-	 				str_append_c(str, sieve_lexer_curchar(scanner));
-				}
-				sieve_lexer_shift(scanner);
-			}
+			start = p = scanner->buffer + scanner->buffer_pos;
+			pend = scanner->buffer + scanner->buffer_size;
+			p++;
+			while ( p < pend && (i_isalnum(*p) || *p == '_') )
+				p++;
+			sieve_lexer_str_append
+				(str, start, p - start, SIEVE_MAX_IDENTIFIER_LEN);
+			scanner->buffer_pos = p - scanner->buffer;
 
 			/* Is this in fact a multiline text string ? */
 			if ( sieve_lexer_curchar(scanner) == ':' &&
@@ -650,151 +857,7 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 				strncasecmp(str_c(str), "text", 4) == 0 ) {
 				sieve_lexer_shift(scanner); // discard colon
 
-				/* Discard SP and HTAB whitespace */
-				while ( sieve_lexer_curchar(scanner) == ' ' ||
-					sieve_lexer_curchar(scanner) == '\t' )
- 					sieve_lexer_shift(scanner);
-
-				/* Discard hash comment or handle single CRLF */
-				if ( sieve_lexer_curchar(scanner) == '\r' )
-					sieve_lexer_shift(scanner);
- 				switch ( sieve_lexer_curchar(scanner) ) {
-				case '#':
-					if ( !sieve_lexer_scan_hash_comment(scanner) )
-						return FALSE;
-					if ( scanner->input->eof ) {
-						sieve_lexer_error(lexer,
-							"end of file before end of multi-line string");
-						lexer->token_type = STT_ERROR;
-						return FALSE;
-					} else if ( scanner->input->stream_errno != 0 ) {
-						lexer->token_type = STT_ERROR;
-						return FALSE;
-					}
-					break;
-				case '\n':
-					sieve_lexer_shift(scanner);
-					break;
-				case -1:
-					if ( scanner->input->eof ) {
-						sieve_lexer_error(lexer,
-							"end of file before end of multi-line string");
-					}
-					lexer->token_type = STT_ERROR;
-					return FALSE;
-				default:
- 					sieve_lexer_error(lexer,
- 						"invalid character %s after 'text:' in multiline string",
-						_char_sanitize(sieve_lexer_curchar(scanner)));
-					lexer->token_type = STT_ERROR;
-					return FALSE;
-				}
-
-				/* Start over */
-				str_truncate(str, 0);
-
- 				/* Parse literal lines */
-				while ( TRUE ) {
-					bool cr_shifted = FALSE;
-
-					/* Remove dot-stuffing or detect end of text */
-					if ( sieve_lexer_curchar(scanner) == '.' ) {
-						sieve_lexer_shift(scanner);
-
-						/* Check for CR.. */
-						if ( sieve_lexer_curchar(scanner) == '\r' ) {
-							sieve_lexer_shift(scanner);
-							cr_shifted = TRUE;
-						}
-
-						/* ..LF */
-						if ( sieve_lexer_curchar(scanner) == '\n' ) {
-							sieve_lexer_shift(scanner);
-
-							/* End of multi-line string */
-
-							/* Check whether length limit was violated */
-							if ( str_len(str) > SIEVE_MAX_STRING_LEN ) {
-								sieve_lexer_error(lexer,
-									"multi-line string started at line %d is too long "
-									"(longer than %llu bytes)", lexer->token_line,
-									(long long) SIEVE_MAX_STRING_LEN);
-									lexer->token_type = STT_ERROR;
-									return FALSE;
-							}
-
-							lexer->token_type = STT_STRING;
-							return TRUE;
-						} else if ( cr_shifted ) {
-							/* Seen CR, but no LF */
-							if ( sieve_lexer_curchar(scanner) != -1 ||
-								!scanner->input->eof ) {
-								sieve_lexer_error(lexer,
-									"found stray carriage-return (CR) character "
-									"in multi-line string started at line %d", lexer->token_line);
-							}
-							lexer->token_type = STT_ERROR;
-							return FALSE;
-						}
-
-						/* Handle dot-stuffing */
-						if ( str_len(str) <= SIEVE_MAX_STRING_LEN )
-							str_append_c(str, '.');
-						if ( sieve_lexer_curchar(scanner) == '.' )
-							sieve_lexer_shift(scanner);
-					}
-
-					/* Scan the rest of the line */
-					while ( sieve_lexer_curchar(scanner) != '\n' &&
-						sieve_lexer_curchar(scanner) != '\r' ) {
-
-						switch ( sieve_lexer_curchar(scanner) ) {
-						case -1:
-							if ( scanner->input->eof ) {
-								sieve_lexer_error(lexer,
-									"end of file before end of multi-line string");
-							}
- 							lexer->token_type = STT_ERROR;
- 							return FALSE;
-						case '\0':
-							sieve_lexer_error(lexer,
-								"encountered NUL character in quoted string "
-								"started at line %d", lexer->token_line);
-							lexer->token_type = STT_ERROR;
-							return FALSE;
-						default:
-							if ( str_len(str) <= SIEVE_MAX_STRING_LEN )
-  								str_append_c(str, sieve_lexer_curchar(scanner));
-						}
-
-						sieve_lexer_shift(scanner);
-					}
-
-					/* If exited loop due to CR, skip it */
-					if ( sieve_lexer_curchar(scanner) == '\r' )
-						sieve_lexer_shift(scanner);
-
-					/* Now we must see an LF */
-					if ( sieve_lexer_curchar(scanner) != '\n' ) {
-						if ( sieve_lexer_curchar(scanner) != -1 ||
-							!scanner->input->eof ) {
-							sieve_lexer_error(lexer,
-								"found stray carriage-return (CR) character "
-								"in multi-line string started at line %d", lexer->token_line);
-						}
- 						lexer->token_type = STT_ERROR;
- 						return FALSE;
-					}
-
-					if ( str_len(str) <= SIEVE_MAX_STRING_LEN )
-						str_append(str, "\r\n");
-
-					sieve_lexer_shift(scanner);
-				}
-
- 				i_unreached();
-				lexer->token_type = STT_ERROR;
-				return FALSE;
+				return sieve_lexer_scan_multiline_string(scanner);
 			}
 
 			if ( str_len(str) > SIEVE_MAX_IDENTIFIER_LEN ) {
@@ -826,16 +889,7 @@ void sieve_lexer_skip_token(const struct sieve_lexer *lexer)
 	do {
 		struct sieve_lexical_scanner *scanner = lexer->scanner;
 
-		if ( !sieve_lexer_scan_raw_token(scanner) ) {
-			if ( !scanner->input->eof && scanner->input->stream_errno != 0 ) {
-				sieve_critical(scanner->svinst, scanner->ehandler,
-					sieve_error_script_location(scanner->script, scanner->current_line),
-					"error reading script",
-					"error reading script during lexical analysis: %s",
-					i_stream_get_error(scanner->input));
-			}
+		if ( !sieve_lexer_scan_raw_token(scanner) )
 			return;
-		}
 	} while ( lexer->token_type == STT_WHITESPACE );
 }
-
@@ -79,6 +79,8 @@ static inline enum sieve_token_type sieve_lexer_token_type
 	return lexer->token_type;
 }
 
+/* The returned string may refer directly to the script data, in which case it
+   is not NUL-terminated. It is only valid until the next token is scanned. */
 static inline const string_t *sieve_lexer_token_str
 (const struct sieve_lexer *lexer)
 {
@@ -35,6 +35,12 @@
 
 #define SIEVE_MAX_MATCH_VALUES         32
 
+/*
+ * Message
+ */
+
+#define SIEVE_DEFAULT_BODY_STREAM_MIN_SIZE (1 << 20)
+
 /*
  * Actions
  */
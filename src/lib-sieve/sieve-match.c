@@ -5,7 +5,9 @@
 #include "mempool.h"
 #include "hash.h"
 #include "array.h"
+#include "str.h"
 #include "str-sanitize.h"
+#include "buffer.h"
 
 #include "sieve-extensions.h"
 #include "sieve-commands.h"
@@ -195,6 +197,462 @@ int sieve_match
 	return match;
 }
 
+/*
+ * Stream matching
+ */
+
+/* Values that are too large to be held in memory as a whole (e.g. message
+ * bodies) can be matched block by block. Every key is compiled into a list of
+ * sections separated by '*' wildcards:
+ *
+ *   <section>*<section>*...*<section>
+ *
+ * The first section must match the start of the value, the last section must
+ * match its end and the sections in between are found in order with the
+ * leftmost possible match, which is sufficient for deciding whether the key
+ * matches at all. Only the tail of the value needed to recognize a section
+ * that spans a block boundary is retained between blocks. Keys for :is and
+ * :contains are trivial instances of this. This does not support match
+ * values.
+ */
+
+struct sieve_match_stream_section {
+	const char *data;
+	size_t size;
+
+	/* Positions of '?' wildcards (NULL if there are none) */
+	const unsigned char *any;
+
+	struct sieve_substring_search *search;
+};
+
+ARRAY_DEFINE_TYPE(sieve_match_stream_section,
+	struct sieve_match_stream_section);
+
+struct sieve_match_stream_key {
+	const struct sieve_match_stream_section *sections;
+	unsigned int count;
+
+	/* Value state */
+	size_t prefix_pos;
+	unsigned int section;
+	uoff_t mid_end;
+	buffer_t *carry, *tail;
+
+	unsigned int failed:1;
+};
+
+struct sieve_match_stream {
+	pool_t pool;
+
+	const struct sieve_runtime_env *runenv;
+	const struct sieve_match_type *match_type;
+	const struct sieve_comparator *comparator;
+
+	ARRAY(struct sieve_match_stream_key) keys;
+	uoff_t offset;
+
+	int match_status;
+
+	unsigned int casemap:1;
+	unsigned int value_matched:1;
+};
+
+bool sieve_match_stream_supported
+(const struct sieve_match_type *mcht, const struct sieve_comparator *cmp)
+{
+	if ( !sieve_comparator_is(cmp, i_octet_comparator) &&
+		!sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
+		return FALSE;
+
+	return ( sieve_match_type_is(mcht, is_match_type) ||
+		sieve_match_type_is(mcht, contains_match_type) ||
+		sieve_match_type_is(mcht, matches_match_type) );
+}
+
+static void *sieve_match_stream_dup
+(pool_t pool, const void *data, size_t size)
+{
+	void *copy = p_malloc(pool, size);
+
+	memcpy(copy, data, size);
+	return copy;
+}
+
+static void sieve_match_stream_section_add
+(struct sieve_match_stream *mstream,
+	ARRAY_TYPE(sieve_match_stream_section) *sections,
+	const char *data, size_t size, const unsigned char *any)
+{
+	struct sieve_match_stream_section *section;
+
+	section = array_append_space(sections);
+	section->data = sieve_match_stream_dup(mstream->pool, data, size + 1);
+	section->size = size;
+	if ( any != NULL )
+		section->any = sieve_match_stream_dup(mstream->pool, any, size + 1);
+	else if ( size > 0 ) {
+		section->search = sieve_substring_search_create
+			(mstream->pool, section->data, size, mstream->casemap);
+	}
+}
+
+static void sieve_match_stream_key_add
+(struct sieve_match_stream *mstream, const char *key, size_t key_size)
+{
+	const struct sieve_match_type *mcht = mstream->match_type;
+	struct sieve_match_stream_key *skey;
+	ARRAY_TYPE(sieve_match_stream_section) sections;
+
+	p_array_init(&sections, mstream->pool, 4);
+
+	if ( sieve_match_type_is(mcht, is_match_type) ) {
+		sieve_match_stream_section_add
+			(mstream, &sections, key, key_size, NULL);
+	} else if ( sieve_match_type_is(mcht, contains_match_type) ) {
+		sieve_match_stream_section_add(mstream, &sections, "", 0, NULL);
+		sieve_match_stream_section_add
+			(mstream, &sections, key, key_size, NULL);
+		sieve_match_stream_section_add(mstream, &sections, "", 0, NULL);
+	} else {
+		string_t *section = t_str_new(64);
+		buffer_t *any = buffer_create_dynamic(pool_datastack_create(), 64);
+		bool have_any = FALSE;
+		size_t i;
+
+		/* Split key at '*' wildcards and resolve escape sequences */
+		for ( i = 0; i <= key_size; i++ ) {
+			if ( i == key_size || key[i] == '*' ) {
+				buffer_append_c(any, '\0');
+				sieve_match_stream_section_add(mstream, &sections,
+					str_c(section), str_len(section),
+					( have_any ? any->data : NULL ));
+				str_truncate(section, 0);
+				buffer_set_used_size(any, 0);
+				have_any = FALSE;
+				continue;
+			}
+
+			if ( key[i] == '?' ) {
+				str_append_c(section, '?');
+				buffer_append_c(any, 1);
+				have_any = TRUE;
+				continue;
+			}
+
+			if ( key[i] == '\\' && ++i == key_size )
+				break;
+			str_append_c(section, key[i]);
+			buffer_append_c(any, 0);
+		}
+	}
+
+	skey = array_append_space(&mstream->keys);
+	skey->sections = array_get(&sections, &skey->count);
+	skey->carry = buffer_create_dynamic(mstream->pool, 256);
+	skey->tail = buffer_create_dynamic
+		(mstream->pool, skey->sections[skey->count-1].size + 1);
+}
+
+int sieve_match_stream_begin
+(const struct sieve_runtime_env *renv,
+	const struct sieve_match_type *mcht,
+	const struct sieve_comparator *cmp,
+	struct sieve_stringlist *key_list,
+	struct sieve_match_stream **mstream_r)
+{
+	struct sieve_match_stream *mstream;
+	string_t *key_item = NULL;
+	pool_t pool;
+	int ret;
+
+	*mstream_r = NULL;
+	i_assert( sieve_match_stream_supported(mcht, cmp) );
+
+	pool = pool_alloconly_create("sieve_match_stream", 4096);
+	mstream = p_new(pool, struct sieve_match_stream, 1);
+	mstream->pool = pool;
+	mstream->runenv = renv;
+	mstream->match_type = mcht;
+	mstream->comparator = cmp;
+	mstream->casemap = sieve_comparator_is(cmp, i_ascii_casemap_comparator);
+	p_array_init(&mstream->keys, pool, 8);
+
+	/* Compile all keys */
+	sieve_stringlist_reset(key_list);
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		T_BEGIN {
+			sieve_match_stream_key_add
+				(mstream, str_c(key_item), str_len(key_item));
+		} T_END;
+	}
+
+	if ( ret < 0 ) {
+		pool_unref(&pool);
+		return key_list->exec_status;
+	}
+
+	sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING,
+		"starting streamed `:%s' match with `%s' comparator for %u keys",
+		sieve_match_type_name(mcht), sieve_comparator_name(cmp),
+		array_count(&mstream->keys));
+
+	*mstream_r = mstream;
+	return SIEVE_EXEC_OK;
+}
+
+static bool sieve_match_stream_section_equals
+(struct sieve_match_stream *mstream,
+	const struct sieve_match_stream_section *section, size_t offset,
+	const unsigned char *data, size_t size)
+{
+	const unsigned char *sdata =
+		(const unsigned char *) section->data + offset;
+	size_t i;
+
+	if ( section->any == NULL ) {
+		if ( !mstream->casemap )
+			return ( memcmp(sdata, data, size) == 0 );
+		return ( sieve_ascii_casemap_mismatch
+			((const char *) sdata, (const char *) data, size) == size );
+	}
+
+	for ( i = 0; i < size; i++ ) {
+		if ( section->any[offset + i] != 0 )
+			continue;
+		if ( sdata[i] == data[i] )
+			continue;
+		if ( !mstream->casemap || i_tolower(sdata[i]) != i_tolower(data[i]) )
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static const unsigned char *sieve_match_stream_section_find
+(struct sieve_match_stream *mstream,
+	const struct sieve_match_stream_section *section,
+	const unsigned char *data, size_t size)
+{
+	size_t i;
+
+	if ( section->size == 0 )
+		return data;
+	if ( section->search != NULL ) {
+		return (const unsigned char *)sieve_substring_search_find
+			(section->search, (const char *) data, size);
+	}
+
+	for ( i = 0; i + section->size <= size; i++ ) {
+		if ( sieve_match_stream_section_equals
+			(mstream, section, 0, data + i, section->size) )
+			return data + i;
+	}
+	return NULL;
+}
+
+static bool sieve_match_stream_key_more
+(struct sieve_match_stream *mstream, struct sieve_match_stream_key *skey,
+	const unsigned char *data, size_t size)
+{
+	const struct sieve_match_stream_section *first = &skey->sections[0];
+	const struct sieve_match_stream_section *last =
+		&skey->sections[skey->count-1];
+	const unsigned char *p = data, *win, *found;
+	size_t left = size, wsize, wpos, keep;
+	uoff_t wbase;
+
+	/* Maintain the tail of the value for matching the last section */
+	if ( skey->count > 1 && last->size > 0 ) {
+		if ( size >= last->size ) {
+			buffer_set_used_size(skey->tail, 0);
+			buffer_append(skey->tail, data + size - last->size, last->size);
+		} else {
+			buffer_append(skey->tail, data, size);
+			if ( skey->tail->used > last->size ) {
+				buffer_delete(skey->tail, 0,
+					skey->tail->used - last->size);
+			}
+		}
+	}
+
+	/* Match the first section at the start of the value */
+	if ( skey->prefix_pos < first->size ) {
+		size_t n = I_MIN(left, first->size - skey->prefix_pos);
+
+		if ( !sieve_match_stream_section_equals
+			(mstream, first, skey->prefix_pos, p, n) ) {
+			skey->failed = TRUE;
+			return FALSE;
+		}
+		skey->prefix_pos += n;
+		p += n;
+		left -= n;
+
+		if ( skey->prefix_pos < first->size )
+			return FALSE;
+	}
+
+	if ( skey->count == 1 ) {
+		/* No '*' wildcards: value must not be any longer */
+		if ( left > 0 )
+			skey->failed = TRUE;
+		return FALSE;
+	}
+
+	/* Find the middle sections in order */
+	if ( skey->section < skey->count - 1 ) {
+		if ( skey->carry->used > 0 ) {
+			buffer_append(skey->carry, p, left);
+			win = skey->carry->data;
+			wsize = skey->carry->used;
+		} else {
+			win = p;
+			wsize = left;
+		}
+		wbase = mstream->offset + (p - data) + left - wsize;
+
+		wpos = 0;
+		while ( skey->section < skey->count - 1 ) {
+			const struct sieve_match_stream_section *section =
+				&skey->sections[skey->section];
+
+			found = sieve_match_stream_section_find
+				(mstream, section, win + wpos, wsize - wpos);
+			if ( found == NULL ) {
+				/* Retain what is needed to find it across the block boundary */
+				keep = section->size - 1;
+				if ( wsize - wpos > keep )
+					wpos = wsize - keep;
+				break;
+			}
+
+			wpos = (found - win) + section->size;
+			skey->mid_end = wbase + wpos;
+			skey->section++;
+		}
+
+		if ( skey->section == skey->count - 1 ) {
+			buffer_set_used_size(skey->carry, 0);
+		} else if ( win == skey->carry->data ) {
+			buffer_delete(skey->carry, 0, wpos);
+		} else {
+			buffer_append(skey->carry, win + wpos, wsize - wpos);
+		}
+	}
+
+	/* Key ending in '*' matches as soon as all other sections are found */
+	return ( skey->section == skey->count - 1 && last->size == 0 );
+}
+
+static bool sieve_match_stream_key_end
+(struct sieve_match_stream *mstream, struct sieve_match_stream_key *skey)
+{
+	const struct sieve_match_stream_section *last =
+		&skey->sections[skey->count-1];
+
+	if ( skey->prefix_pos < skey->sections[0].size )
+		return FALSE;
+	if ( skey->count == 1 )
+		return TRUE;
+	if ( skey->section < skey->count - 1 )
+		return FALSE;
+
+	/* Last section must fit after the middle sections at the value end */
+	if ( mstream->offset < skey->mid_end + last->size ||
+		skey->tail->used != last->size )
+		return FALSE;
+
+	return sieve_match_stream_section_equals
+		(mstream, last, 0, skey->tail->data, last->size);
+}
+
+static bool sieve_match_stream_feed
+(struct sieve_match_stream *mstream, const unsigned char *data, size_t size)
+{
+	struct sieve_match_stream_key *skey;
+
+	array_foreach_modifiable(&mstream->keys, skey) {
+		if ( skey->failed )
+			continue;
+		if ( sieve_match_stream_key_more(mstream, skey, data, size) ) {
+			mstream->value_matched = TRUE;
+			break;
+		}
+	}
+	mstream->offset += size;
+
+	if ( mstream->value_matched )
+		mstream->match_status = 1;
+	return mstream->value_matched;
+}
+
+bool sieve_match_stream_value_begin(struct sieve_match_stream *mstream)
+{
+	struct sieve_match_stream_key *skey;
+
+	mstream->offset = 0;
+	mstream->value_matched = FALSE;
+
+	array_foreach_modifiable(&mstream->keys, skey) {
+		skey->prefix_pos = 0;
+		skey->section = 1;
+		skey->mid_end = skey->sections[0].size;
+		skey->failed = FALSE;
+		buffer_set_used_size(skey->carry, 0);
+		buffer_set_used_size(skey->tail, 0);
+	}
+
+	/* Keys consisting of wildcards only may match right away */
+	return sieve_match_stream_feed(mstream, (const unsigned char *) "", 0);
+}
+
+bool sieve_match_stream_value_more
+(struct sieve_match_stream *mstream, const void *data, size_t size)
+{
+	if ( mstream->value_matched )
+		return TRUE;
+	return sieve_match_stream_feed(mstream, data, size);
+}
+
+bool sieve_match_stream_value_end(struct sieve_match_stream *mstream)
+{
+	struct sieve_match_stream_key *skey;
+
+	if ( !mstream->value_matched ) {
+		array_foreach_modifiable(&mstream->keys, skey) {
+			if ( !skey->failed &&
+				sieve_match_stream_key_end(mstream, skey) ) {
+				mstream->value_matched = TRUE;
+				break;
+			}
+		}
+	}
+
+	sieve_runtime_trace(mstream->runenv, SIEVE_TRLVL_MATCHING,
+		"streamed value of %"PRIuUOFF_T" bytes => %d",
+		mstream->offset, ( mstream->value_matched ? 1 : 0 ));
+
+	if ( mstream->value_matched )
+		mstream->match_status = 1;
+	return mstream->value_matched;
+}
+
+int sieve_match_stream_end(struct sieve_match_stream **_mstream)
+{
+	struct sieve_match_stream *mstream = *_mstream;
+	const struct sieve_runtime_env *renv = mstream->runenv;
+	int match = mstream->match_status;
+
+	*_mstream = NULL;
+
+	pool_unref(&mstream->pool);
+
+	sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING,
+		"finishing streamed match with result: %s",
+		( match > 0 ? "matched" : "not matched" ));
+	return match;
+}
+
 /*
  * Reading match operands
  */
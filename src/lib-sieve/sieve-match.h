@@ -49,6 +49,27 @@ int sieve_match
 		struct sieve_stringlist *key_list,
 		int *exec_status);
 
+/* Stream matching (for values too large to be held in memory); only
+   available for the core match types and comparators and it does not produce
+   match values. The value_* functions return TRUE once the current value is
+   known to match. */
+struct sieve_match_stream;
+
+bool sieve_match_stream_supported
+	(const struct sieve_match_type *mcht, const struct sieve_comparator *cmp);
+
+int sieve_match_stream_begin
+	(const struct sieve_runtime_env *renv,
+		const struct sieve_match_type *mcht,
+		const struct sieve_comparator *cmp,
+		struct sieve_stringlist *key_list,
+		struct sieve_match_stream **mstream_r);
+bool sieve_match_stream_value_begin(struct sieve_match_stream *mstream);
+bool sieve_match_stream_value_more
+	(struct sieve_match_stream *mstream, const void *data, size_t size);
+bool sieve_match_stream_value_end(struct sieve_match_stream *mstream);
+int sieve_match_stream_end(struct sieve_match_stream **_mstream);
+
 /*
  * Read matching operands
  */
@@ -5,14 +5,17 @@
 #include "ioloop.h"
 #include "mempool.h"
 #include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "str-sanitize.h"
+#include "time-util.h"
 #include "istream.h"
 #include "rfc822-parser.h"
 #include "message-date.h"
 #include "message-parser.h"
 #include "message-decoder.h"
 #include "message-header-decode.h"
+#include "message-address.h"
 #include "mail-html2text.h"
 #include "mail-storage.h"
 #include "mail-user.h"
@@ -73,10 +76,41 @@ struct sieve_message_part {
 	size_t decoded_body_size;
 	size_t text_body_size;
 
+	/* Part holding the epilogue of this multipart part */
+	struct sieve_message_part *epilogue_part;
+
 	unsigned int have_body:1; /* there's the empty end-of-headers line */
 	unsigned int epilogue:1;  /* this is a multipart epilogue */
 };
 
+ARRAY_DEFINE_TYPE(sieve_message_part, struct sieve_message_part *);
+
+/* Header fields of the message, looked up by lowercase field name. The
+   values are right-trimmed and NUL-terminated. */
+
+struct sieve_message_header_value {
+	const char *value;
+	size_t size;
+};
+
+struct sieve_message_header_values {
+	const struct sieve_message_header_value *items;
+	unsigned int count;
+
+	unsigned int cached:1;
+};
+
+struct sieve_message_header_field {
+	struct sieve_message_header_values raw, decoded;
+};
+
+/* Parsed address header values, looked up by the value itself */
+
+struct sieve_message_address_value {
+	const struct message_address *addresses;
+	bool valid;
+};
+
 struct sieve_message_version {
 	struct mail *mail;
 	struct mailbox *box;
@@ -112,9 +146,16 @@ struct sieve_message_context {
 
 	ARRAY(void *) ext_contexts;
 
+	/* Header fields */
+
+	HASH_TABLE(const char *, struct sieve_message_header_field *) header_cache;
+	HASH_TABLE(const char *, struct sieve_message_address_value *)
+		address_cache;
+
 	/* Body */
 
-	ARRAY(struct sieve_message_part *) cached_body_parts;
+	struct message_part *mime_parts;
+	ARRAY_TYPE(sieve_message_part) cached_body_parts;
 	ARRAY(struct sieve_message_part_data) return_body_parts;
 	buffer_t *raw_body;
 
@@ -224,6 +265,10 @@ void sieve_message_context_unref(struct sieve_message_context **msgctx)
 
 	sieve_message_context_clear(*msgctx);
 
+	if ( hash_table_is_created((*msgctx)->header_cache) )
+		hash_table_destroy(&(*msgctx)->header_cache);
+	if ( hash_table_is_created((*msgctx)->address_cache) )
+		hash_table_destroy(&(*msgctx)->address_cache);
 	if ( (*msgctx)->context_pool != NULL )
 		pool_unref(&((*msgctx)->context_pool));
 
@@ -235,6 +280,10 @@ static void sieve_message_context_flush(struct sieve_message_context *msgctx)
 {
 	pool_t pool;
 
+	if ( hash_table_is_created(msgctx->header_cache) )
+		hash_table_destroy(&msgctx->header_cache);
+	if ( hash_table_is_created(msgctx->address_cache) )
+		hash_table_destroy(&msgctx->address_cache);
 	if ( msgctx->context_pool != NULL )
 		pool_unref(&(msgctx->context_pool));
 
@@ -244,6 +293,10 @@ static void sieve_message_context_flush(struct sieve_message_context *msgctx)
 	p_array_init(&msgctx->ext_contexts, pool,
 		sieve_extensions_get_count(msgctx->svinst));
 
+	hash_table_create(&msgctx->header_cache, pool, 0, str_hash, strcmp);
+	hash_table_create(&msgctx->address_cache, pool, 0, str_hash, strcmp);
+
+	msgctx->mime_parts = NULL;
 	p_array_init(&msgctx->cached_body_parts, pool, 8);
 	p_array_init(&msgctx->return_body_parts, pool, 8);
 	msgctx->raw_body = NULL;
@@ -400,6 +453,52 @@ const char *sieve_message_get_sender
 	return sieve_address_to_string(msgctx->envelope_sender);
 }
 
+/* Address headers */
+
+static bool sieve_message_address_list_validate
+(const struct message_address *addresses)
+{
+	const struct message_address *aitem;
+
+	for ( aitem = addresses; aitem != NULL; aitem = aitem->next ) {
+		if ( aitem->invalid_syntax )
+			return FALSE;
+	}
+	return TRUE;
+}
+
+bool sieve_message_address_list_parse
+(struct sieve_message_context *msgctx, string_t *value,
+	const struct message_address **addresses_r)
+{
+	pool_t pool = msgctx->context_pool;
+	struct sieve_message_address_value *avalue;
+	const char *key = str_c(value);
+
+	/* Values with NULs cannot be looked up; these are rare enough to parse
+	   every time */
+	if ( strlen(key) != str_len(value) ) {
+		*addresses_r = message_address_parse
+			(pool_datastack_create(), str_data(value), str_len(value),
+				256, FALSE);
+		return sieve_message_address_list_validate(*addresses_r);
+	}
+
+	avalue = hash_table_lookup(msgctx->address_cache, key);
+	if ( avalue == NULL ) {
+		avalue = p_new(pool, struct sieve_message_address_value, 1);
+		avalue->addresses = message_address_parse
+			(pool, str_data(value), str_len(value), 256, FALSE);
+		avalue->valid = sieve_message_address_list_validate(avalue->addresses);
+
+		hash_table_insert(msgctx->address_cache,
+			p_strdup(pool, key), avalue);
+	}
+
+	*addresses_r = avalue->addresses;
+	return avalue->valid;
+}
+
 /*
  * Mail
  */
@@ -490,6 +589,16 @@ struct edit_mail *sieve_message_edit
 
 	msgctx->edit_snapshot = FALSE;
 
+	/* The headers are about to change */
+	hash_table_clear(msgctx->header_cache, TRUE);
+	hash_table_clear(msgctx->address_cache, TRUE);
+
+	/* Part offsets and part headers of the old stream no longer apply; the
+	   raw body itself is not affected by header edits */
+	msgctx->mime_parts = NULL;
+	array_clear(&msgctx->cached_body_parts);
+	array_clear(&msgctx->return_body_parts);
+
 	return version->edit_mail;
 }
 
@@ -522,8 +631,8 @@ struct sieve_message_header_list {
 	struct sieve_stringlist *field_names;
 
 	const char *header_name;
-	const char *const *headers;
-	int headers_index;
+	const struct sieve_message_header_values *headers;
+	unsigned int headers_index;
 
 	unsigned int mime_decode:1;
 };
@@ -547,19 +656,61 @@ struct sieve_header_list *sieve_message_header_list_create
 	return &hdrlist->hdrlist;
 }
 
-// NOTE: get rid of this once we have a proper Sieve string type
-static inline string_t *_header_right_trim(const char *raw)
+/* Header cache */
+
+static int sieve_message_header_get_values
+(struct sieve_message_context *msgctx, const char *field_name,
+	bool mime_decode, const struct sieve_message_header_values **values_r)
 {
-	string_t *result;
-	int i;
+	struct mail *mail = sieve_message_get_mail(msgctx);
+	pool_t pool = msgctx->context_pool;
+	struct sieve_message_header_field *field;
+	struct sieve_message_header_values *values;
+	struct sieve_message_header_value *items;
+	const char *const *headers, *key;
+	unsigned int count, i;
+	int ret;
+
+	key = t_str_lcase(field_name);
+	field = hash_table_lookup(msgctx->header_cache, key);
+	if ( field == NULL ) {
+		field = p_new(pool, struct sieve_message_header_field, 1);
+		hash_table_insert(msgctx->header_cache, p_strdup(pool, key), field);
+	}
+
+	values = ( mime_decode ? &field->decoded : &field->raw );
+	if ( values->cached ) {
+		*values_r = values;
+		return 0;
+	}
 
-	for ( i = strlen(raw)-1; i >= 0; i-- ) {
-		if ( raw[i] != ' ' && raw[i] != '\t' ) break;
+	/* Fetch all matching headers from the e-mail */
+	if ( mime_decode )
+		ret = mail_get_headers_utf8(mail, field_name, &headers);
+	else
+		ret = mail_get_headers(mail, field_name, &headers);
+	if ( ret < 0 )
+		return -1;
+
+	/* Store right-trimmed copies */
+	count = ( headers == NULL ? 0 : str_array_length(headers) );
+	items = p_new(pool, struct sieve_message_header_value, count + 1);
+	for ( i = 0; i < count; i++ ) {
+		size_t size = strlen(headers[i]);
+
+		while ( size > 0 &&
+			(headers[i][size-1] == ' ' || headers[i][size-1] == '\t') )
+			size--;
+		items[i].value = p_strndup(pool, headers[i], size);
+		items[i].size = size;
 	}
 
-	result = t_str_new(i+1);
-	str_append_n(result, raw, i + 1);
-	return result;
+	values->items = items;
+	values->count = count;
+	values->cached = TRUE;
+
+	*values_r = values;
+	return 0;
 }
 
 /* String list implementation */
@@ -572,6 +723,7 @@ static int sieve_message_header_list_next_item
 		(struct sieve_message_header_list *) _hdrlist;
 	const struct sieve_runtime_env *renv = _hdrlist->strlist.runenv;
 	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	const struct sieve_message_header_value *item;
 
 	if ( name_r != NULL )
 		*name_r = NULL;
@@ -580,13 +732,14 @@ static int sieve_message_header_list_next_item
 	/* Check for end of current header list */
 	if ( hdrlist->headers == NULL ) {
 		hdrlist->headers_index = 0;
- 	} else if ( hdrlist->headers[hdrlist->headers_index] == NULL ) {
+ 	} else if ( hdrlist->headers_index >= hdrlist->headers->count ) {
 		hdrlist->headers = NULL;
 		hdrlist->headers_index = 0;
 	}
 
 	/* Fetch next header */
 	while ( hdrlist->headers == NULL ) {
+		const struct sieve_message_header_values *values;
 		string_t *hdr_item = NULL;
 		int ret;
 
@@ -604,31 +757,24 @@ static int sieve_message_header_list_next_item
 		}
 
 		/* Fetch all matching headers from the e-mail */
-		if ( hdrlist->mime_decode ) {
-			ret = mail_get_headers_utf8(mail,
-				str_c(hdr_item), &hdrlist->headers);
-		} else {
-			ret = mail_get_headers(mail,
-				str_c(hdr_item), &hdrlist->headers);
-		}
-
-		if (ret < 0) {
+		if ( sieve_message_header_get_values(renv->msgctx,
+			str_c(hdr_item), hdrlist->mime_decode, &values) < 0 ) {
 			_hdrlist->strlist.exec_status =
 				sieve_runtime_mail_error(renv, mail,
 					"failed to read header field `%s'", str_c(hdr_item));
 			return -1;
 		}
 
-		if ( hdrlist->headers == NULL || hdrlist->headers[0] == NULL ) {
-			/* Try next item when no headers found */
-			hdrlist->headers = NULL;
-		}
+		/* Try next item when no headers found */
+		if ( values->count > 0 )
+			hdrlist->headers = values;
 	}
 
 	/* Return next item */
 	if ( name_r != NULL )
 		*name_r = hdrlist->header_name;
-	*value_r = _header_right_trim(hdrlist->headers[hdrlist->headers_index++]);
+	item = &hdrlist->headers->items[hdrlist->headers_index++];
+	*value_r = t_str_new_const(item->value, item->size);
 	return 1;
 }
 
@@ -1043,25 +1189,25 @@ static void sieve_message_part_save
 	buffer_t *result_buf, *text_buf = NULL;
 	char *part_data;
 	size_t part_size;
+	bool html;
+
+	html = ( body_part->children == NULL && !body_part->epilogue &&
+		buf->used > 0 && mail_html2text_content_type_match
+			(body_part->content_type) );
 
 	/* Extract text if requested */
 	result_buf = buf;
-	if ( extract_text && body_part->children == NULL &&
-		!body_part->epilogue ) {
-
-		if ( buf->used > 0 && mail_html2text_content_type_match
-			(body_part->content_type) ) {
-			struct mail_html2text *html2text;
+	if ( extract_text && html ) {
+		struct mail_html2text *html2text;
 
-			text_buf = buffer_create_dynamic(default_pool, 4096);
+		text_buf = buffer_create_dynamic(default_pool, 4096);
 
-			/* Remove HTML markup */
-			html2text = mail_html2text_init(0);
-			mail_html2text_more(html2text, buf->data, buf->used, text_buf);
-			mail_html2text_deinit(&html2text);
+		/* Remove HTML markup */
+		html2text = mail_html2text_init(0);
+		mail_html2text_more(html2text, buf->data, buf->used, text_buf);
+		mail_html2text_deinit(&html2text);
 
-			result_buf = text_buf;
-		}
+		result_buf = text_buf;
 	}
 
 	/* Add terminating NUL to the body part buffer */
@@ -1077,12 +1223,14 @@ static void sieve_message_part_save
 		buffer_free(&text_buf);
 
 	/* Depending on whether the part is processed into text, store message
-	 * body in the appropriate cache location.
+	 * body in the appropriate cache location. Without any markup to remove,
+	 * the text is the decoded body itself.
 	 */
-	if ( !extract_text ) {
+	if ( !extract_text || !html ) {
 		body_part->decoded_body = part_data;
 		body_part->decoded_body_size = part_size;
-	} else {
+	}
+	if ( extract_text || !html ) {
 		body_part->text_body = part_data;
 		body_part->text_body_size = part_size;
 	}
@@ -1091,6 +1239,101 @@ static void sieve_message_part_save
 	buffer_set_used_size(buf, 0);
 }
 
+/* Streamed body parts */
+
+struct sieve_message_body_streamer {
+	const struct sieve_message_body_sink *sink;
+	void *context;
+
+	struct mail_html2text *html2text;
+	buffer_t *text_buf;
+
+	unsigned int part_open:1;
+	unsigned int done:1;
+};
+
+static void sieve_message_part_stream_open
+(struct sieve_message_body_streamer *streamer,
+	struct sieve_message_part *body_part, bool extract_text)
+{
+	if ( streamer->part_open )
+		return;
+	streamer->part_open = TRUE;
+
+	if ( !streamer->done &&
+		streamer->sink->part_begin(streamer->context) )
+		streamer->done = TRUE;
+
+	/* Remove HTML markup on the fly if requested */
+	if ( extract_text && body_part->children == NULL &&
+		!body_part->epilogue &&
+		mail_html2text_content_type_match(body_part->content_type) ) {
+		streamer->html2text = mail_html2text_init(0);
+		if ( streamer->text_buf == NULL ) {
+			streamer->text_buf =
+				buffer_create_dynamic(pool_datastack_create(), 4096);
+		}
+	}
+}
+
+static void sieve_message_part_stream_more
+(struct sieve_message_body_streamer *streamer,
+	struct sieve_message_part *body_part, bool extract_text,
+	const unsigned char *data, size_t size)
+{
+	sieve_message_part_stream_open(streamer, body_part, extract_text);
+	if ( streamer->done )
+		return;
+
+	if ( streamer->html2text != NULL ) {
+		buffer_set_used_size(streamer->text_buf, 0);
+		mail_html2text_more
+			(streamer->html2text, data, size, streamer->text_buf);
+		data = streamer->text_buf->data;
+		size = streamer->text_buf->used;
+	}
+
+	if ( size > 0 &&
+		streamer->sink->part_more(streamer->context, data, size) )
+		streamer->done = TRUE;
+}
+
+static void sieve_message_part_stream_end
+(struct sieve_message_body_streamer *streamer,
+	struct sieve_message_part *body_part, bool extract_text)
+{
+	sieve_message_part_stream_open(streamer, body_part, extract_text);
+
+	if ( streamer->html2text != NULL )
+		mail_html2text_deinit(&streamer->html2text);
+
+	/* Parts without a body never match (see
+	   sieve_message_body_get_return_parts()) */
+	if ( !streamer->done && body_part->have_body &&
+		streamer->sink->part_end(streamer->context) )
+		streamer->done = TRUE;
+
+	streamer->part_open = FALSE;
+}
+
+static void sieve_message_part_finish
+(const struct sieve_runtime_env *renv,
+	struct sieve_message_body_streamer *streamer, buffer_t *buf,
+	struct sieve_message_part *body_part, bool extract_text)
+{
+	if ( streamer == NULL ) {
+		sieve_message_part_save(renv, buf, body_part, extract_text);
+		return;
+	}
+
+	if ( buf->used > 0 ) {
+		sieve_message_part_stream_more
+			(streamer, body_part, extract_text, buf->data, buf->used);
+	}
+	sieve_message_part_stream_end(streamer, body_part, extract_text);
+	buffer_set_used_size(buf, 0);
+}
+
 static const char *
 _parse_content_type(const struct message_header_line *hdr)
 {
@@ -1139,17 +1382,80 @@ _parse_content_disposition(const struct message_header_line *hdr)
 	return str_c(content_disp);
 }
 
-/* sieve_message_parts_add_missing():
- *   Add requested message body parts to the cache that are missing.
+/* sieve_message_part_lookup():
+ *   Find the cached part for a block of a message that is parsed again using
+ *   the retained MIME structure. Returning to a multipart part after its
+ *   children means that its epilogue is reached.
  */
-static int sieve_message_parts_add_missing
+static struct sieve_message_part *sieve_message_part_lookup
+(struct message_part *mpart, struct message_part *prev_mpart)
+{
+	struct sieve_message_part *body_part =
+		(struct sieve_message_part *)mpart->context;
+
+	i_assert( body_part != NULL );
+
+	for (; prev_mpart != NULL; prev_mpart = prev_mpart->parent) {
+		if ( prev_mpart->parent == mpart ) {
+			i_assert( body_part->epilogue_part != NULL );
+			return body_part->epilogue_part;
+		}
+	}
+	return body_part;
+}
+
+static inline bool sieve_message_part_missing
+(struct sieve_message_part *body_part, bool extract_text)
+{
+	return ( extract_text ?
+		body_part->text_body == NULL : body_part->decoded_body == NULL );
+}
+
+static bool sieve_message_parts_cached
 (const struct sieve_runtime_env *renv,
 	const char *const *content_types,
 	bool extract_text, bool iter_all)
-	ATTR_NULL(2)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	struct sieve_message_part *const *body_parts;
+	unsigned int i, count;
+
+	if ( msgctx->mime_parts == NULL )
+		return FALSE;
+
+	if ( !iter_all ) {
+		return sieve_message_body_get_return_parts
+			(renv, content_types, extract_text);
+	}
+
+	body_parts = array_get(&msgctx->cached_body_parts, &count);
+	for (i = 0; i < count; i++) {
+		if ( sieve_message_part_missing(body_parts[i], extract_text) )
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* sieve_message_parts_add_missing():
+ *   Add requested message body parts to the cache that are missing. If a
+ *   streamer is provided, the requested parts are passed to its sink instead
+ *   and nothing is cached.
+ *
+ *   The MIME structure and the headers of all parts are only parsed once;
+ *   the resulting message_part tree is retained, so that later requests only
+ *   need to decode the bodies of the parts that are still missing.
+ */
+static int _sieve_message_parts_add_missing
+(const struct sieve_runtime_env *renv,
+	const char *const *content_types,
+	bool extract_text, bool iter_all,
+	struct sieve_message_body_streamer *streamer)
+	ATTR_NULL(2, 5)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
 	pool_t pool = msgctx->context_pool;
+	ARRAY_TYPE(sieve_message_part) *parts = &msgctx->cached_body_parts;
+	ARRAY_TYPE(sieve_message_part) stream_parts;
 	struct mail *mail = sieve_message_get_mail(renv->msgctx);
 	enum message_parser_flags mparser_flags =
 		MESSAGE_PARSER_FLAG_INCLUDE_MULTIPART_BLOCKS;
@@ -1164,17 +1470,30 @@ static int sieve_message_parts_add_missing
 	buffer_t *buf;
 	struct istream *input;
 	unsigned int idx = 0;
-	bool save_body = FALSE, have_all;
+	bool save_body = FALSE, save_header = FALSE, have_all;
+	bool have_structure, collect_headers;
 	string_t *hdr_content = NULL;
 	int ret;
 
 	/* First check whether any are missing */
-	if ( !iter_all && sieve_message_body_get_return_parts
-		(renv, content_types, extract_text) ) {
+	if ( streamer == NULL && sieve_message_parts_cached
+		(renv, content_types, extract_text, iter_all) ) {
 		/* Cache hit; all are present */
 		return SIEVE_EXEC_OK;
 	}
 
+	/* Once parsed, the MIME structure and headers are not parsed again */
+	have_structure = ( msgctx->mime_parts != NULL );
+	collect_headers = ( !have_structure && streamer == NULL );
+
+	/* Streamed parts are not retained beyond this call */
+	if ( streamer != NULL && !have_structure ) {
+		i_assert( !iter_all );
+		pool = pool_datastack_create();
+		t_array_init(&stream_parts, 8);
+		parts = &stream_parts;
+	}
+
 	/* Get the message stream */
 	if ( mail_get_stream(mail, NULL, NULL, &input) < 0 ) {
 		return sieve_runtime_mail_error(renv, mail,
@@ -1188,7 +1507,7 @@ static int sieve_message_parts_add_missing
 	buf = buffer_create_dynamic(default_pool, 4096);
 	body_part = header_part = last_part = NULL;
 
-	if (iter_all) {
+	if (collect_headers) {
 		t_array_init(&headers, 64);
 		hdr_content = t_str_new(512);
 		hparser_flags |= MESSAGE_HEADER_PARSER_FLAG_CLEAN_ONELINE;
@@ -1199,18 +1518,30 @@ static int sieve_message_parts_add_missing
 	/* Initialize body decoder */
 	decoder = message_decoder_init(NULL, 0);
 
-	// FIXME: currently not tested with edit-mail.
-		//parser = message_parser_init_from_parts(parts, input,
-		// hparser_flags, mparser_flags);
-	parser = message_parser_init(pool_datastack_create(),
-		input, hparser_flags, mparser_flags);
+	/* The structure obtained from mail_get_parts() is not used here, since
+	   it belongs to the mail (the part contexts are used below) and it need
+	   not match the stream of an edited message. Our own tree is retained
+	   instead. */
+	if ( have_structure ) {
+		parser = message_parser_init_from_parts(msgctx->mime_parts,
+			input, hparser_flags, mparser_flags);
+	} else {
+		parser = message_parser_init
+			((streamer == NULL ? pool : pool_datastack_create()),
+				input, hparser_flags, mparser_flags);
+	}
 	while ( (ret=message_parser_parse_next_block
 		(parser, &block)) > 0 ) {
 		struct sieve_message_part **body_part_idx;
 		struct message_header_line *hdr = block.hdr;
 		struct sieve_message_header *header;
+		struct sieve_message_part *prev_part = body_part;
 		unsigned char *data;
 
+		/* Stop once the streamed parts are no longer needed */
+		if ( streamer != NULL && streamer->done )
+			break;
+
 		if ( block.part != prev_mpart ) {
 			bool message_rfc822 = FALSE;
 
@@ -1222,11 +1553,11 @@ static int sieve_message_parts_add_missing
 					message_rfc822 = TRUE;
 				} else {
 					if ( save_body ) {
-						sieve_message_part_save
-							(renv, buf, body_part, extract_text);
+						sieve_message_part_finish
+							(renv, streamer, buf, body_part, extract_text);
 					}
 				}
-				if ( iter_all && !array_is_created(&body_part->headers) &&
+				if ( collect_headers && !array_is_created(&body_part->headers) &&
 					array_count(&headers) > 0 ) {
 					p_array_init(&body_part->headers, pool, array_count(&headers));
 					array_copy(&body_part->headers.arr, 0,
@@ -1234,68 +1565,84 @@ static int sieve_message_parts_add_missing
 				}
 			}
 
-			/* Start processing next part */
-			body_part_idx = array_idx_modifiable
-				(&msgctx->cached_body_parts, idx);
-			if ( *body_part_idx == NULL )
-				*body_part_idx = p_new(pool, struct sieve_message_part, 1);
-			body_part = *body_part_idx;
-			body_part->content_type = "text/plain";
-			if ( iter_all )
-				array_clear(&headers);
-
-			/* Copy tree structure */
-			if ( block.part->context != NULL ) {
-				struct sieve_message_part *epipart =
-					(struct sieve_message_part *)block.part->context;
-				i_assert(epipart != NULL);
-
-				/* multipart epilogue */
-				body_part->content_type = epipart->content_type;
-				body_part->have_body = TRUE;
-				body_part->epilogue = TRUE;
-				save_body = iter_all || _is_wanted_content_type
-					(content_types, body_part->content_type);
+			if ( have_structure ) {
+				/* Known part */
+				body_part = sieve_message_part_lookup(block.part, prev_mpart);
+				save_body = FALSE;
 
 			} else {
-				struct sieve_message_part *parent = NULL;
+				/* Start processing next part */
+				body_part_idx = array_idx_modifiable(parts, idx);
+				if ( *body_part_idx == NULL )
+					*body_part_idx = p_new(pool, struct sieve_message_part, 1);
+				body_part = *body_part_idx;
+				body_part->content_type = "text/plain";
+				if ( collect_headers )
+					array_clear(&headers);
+
+				/* Copy tree structure */
+				if ( block.part->context != NULL ) {
+					struct sieve_message_part *epipart =
+						(struct sieve_message_part *)block.part->context;
+					i_assert(epipart != NULL);
+
+					/* multipart epilogue */
+					body_part->content_type = epipart->content_type;
+					body_part->have_body = TRUE;
+					body_part->epilogue = TRUE;
+					epipart->epilogue_part = body_part;
 
-				if ( block.part->parent != NULL ) {
-					body_part->parent = parent =
-						(struct sieve_message_part *)
-							block.part->parent->context;
-				}
+				} else {
+					struct sieve_message_part *parent = NULL;
 
-				/* new part */
-				block.part->context = (void*)body_part;
-
-				if ( last_part != NULL ) {
-					i_assert( parent != NULL );
-					if ( last_part->parent == parent ) {
-						last_part->next = body_part;
-					}	else if (parent->children == NULL) {
-						parent->children = body_part;
-					} else {
-						struct sieve_message_part *child = parent->children;
-						while (child->next != NULL && child != body_part)
-							child = child->next;
-						if (child != body_part)
-							child->next = body_part;
+					if ( block.part->parent != NULL ) {
+						body_part->parent = parent =
+							(struct sieve_message_part *)
+								block.part->parent->context;
+					}
+
+					/* new part */
+					block.part->context = (void*)body_part;
+
+					if ( last_part != NULL ) {
+						i_assert( parent != NULL );
+						if ( last_part->parent == parent ) {
+							last_part->next = body_part;
+						}	else if (parent->children == NULL) {
+							parent->children = body_part;
+						} else {
+							struct sieve_message_part *child = parent->children;
+							while (child->next != NULL && child != body_part)
+								child = child->next;
+							if (child != body_part)
+								child->next = body_part;
+						}
 					}
 				}
+				last_part = body_part;
+			}
+
+			/* A multipart epilogue has no headers */
+			if ( body_part->epilogue ) {
+				save_body = ( iter_all || _is_wanted_content_type
+					(content_types, body_part->content_type) ) &&
+					( streamer != NULL ||
+						sieve_message_part_missing(body_part, extract_text) );
 			}
-			last_part = body_part;
 
 			/* If this is message/rfc822 content, retain the enveloping part for
 			 * storing headers as content.
 			 */
 			if ( message_rfc822 ) {
-				i_assert(idx > 0);
-				body_part_idx = array_idx_modifiable
-					(&msgctx->cached_body_parts, idx-1);
-				header_part = *body_part_idx;
+				i_assert( prev_part != NULL );
+				header_part = prev_part;
+				save_header = ( iter_all || _is_wanted_content_type
+					(content_types, header_part->content_type) ) &&
+					( streamer != NULL ||
+						sieve_message_part_missing(header_part, extract_text) );
 			} else {
 				header_part = NULL;
+				save_header = FALSE;
 			}
 
 			prev_mpart = block.part;
@@ -1319,15 +1666,21 @@ static int sieve_message_parts_add_missing
 			if ( hdr == NULL ) {
 				/* Save headers for message/rfc822 part */
 				if ( header_part != NULL ) {
-					sieve_message_part_save
-						(renv, buf, header_part, FALSE);
+					if ( save_header ) {
+						sieve_message_part_finish
+							(renv, streamer, buf, header_part, FALSE);
+					}
 					header_part = NULL;
+					save_header = FALSE;
 				}
 
-				/* Save bodies only if we have a wanted content-type */
+				/* Save bodies only if we have a wanted content-type and these
+				   are not cached already */
 				i_assert( body_part != NULL );
-				save_body = iter_all || _is_wanted_content_type
-					(content_types, body_part->content_type);
+				save_body = ( iter_all || _is_wanted_content_type
+					(content_types, body_part->content_type) ) &&
+					( streamer != NULL ||
+						sieve_message_part_missing(body_part, extract_text) );
 				continue;
 			}
 
@@ -1336,9 +1689,10 @@ static int sieve_message_parts_add_missing
 			 */
 			if ( hdr->eoh ) {
 				i_assert( body_part != NULL );
-				body_part->have_body = TRUE;
+				if ( !have_structure )
+					body_part->have_body = TRUE;
 				continue;
-			} else if ( header_part != NULL ) {
+			} else if ( save_header ) {
 				/* Save message/rfc822 header as part content */
 				if ( hdr->continued ) {
 					buffer_append(buf, hdr->value, hdr->value_len);
@@ -1352,11 +1706,15 @@ static int sieve_message_parts_add_missing
 				}
 			}
 
+			/* The headers are only parsed once */
+			if ( have_structure )
+				continue;
+
 			if ( strcasecmp(hdr->name, "Content-Type" ) == 0 )
 				hdr_field = _HDR_CONTENT_TYPE;
 			else if ( strcasecmp(hdr->name, "Content-Disposition" ) == 0 )
 				hdr_field = _HDR_CONTENT_DISPOSITION;
-			else if ( iter_all && !array_is_created(&body_part->headers) )
+			else if ( collect_headers && !array_is_created(&body_part->headers) )
 				hdr_field = _HDR_OTHER;
 			else {
 				/* Not interested in this header */
@@ -1371,7 +1729,7 @@ static int sieve_message_parts_add_missing
 				continue;
 			}
 
-			if ( iter_all && !array_is_created(&body_part->headers) ) {
+			if ( collect_headers && !array_is_created(&body_part->headers) ) {
 				const unsigned char *value, *vp;
 				size_t vlen;
 
@@ -1447,33 +1805,38 @@ static int sieve_message_parts_add_missing
 		if ( save_body ) {
 			(void)message_decoder_decode_next_block
 					(decoder, &block, &decoded);
-			buffer_append(buf, decoded.data, decoded.size);
+			if ( streamer != NULL ) {
+				sieve_message_part_stream_more(streamer,
+					body_part, extract_text, decoded.data, decoded.size);
+			} else {
+				buffer_append(buf, decoded.data, decoded.size);
+			}
 		}
 	}
 
 	/* Save last body part if necessary */
-	if ( header_part != NULL ) {
-		sieve_message_part_save
-			(renv, buf, header_part, FALSE);
+	if ( streamer != NULL && streamer->done ) {
+		/* Stopped early */
+	} else if ( header_part != NULL ) {
+		if ( save_header ) {
+			sieve_message_part_finish
+				(renv, streamer, buf, header_part, FALSE);
+		}
 	} else if ( body_part != NULL && save_body ) {
-		sieve_message_part_save
-			(renv, buf, body_part, extract_text);
+		sieve_message_part_finish
+			(renv, streamer, buf, body_part, extract_text);
 	}
-	if ( iter_all && !array_is_created(&body_part->headers) &&
+	if ( collect_headers && body_part != NULL &&
+		!array_is_created(&body_part->headers) &&
 		array_count(&headers) > 0 ) {
 		p_array_init(&body_part->headers, pool, array_count(&headers));
 		array_copy(&body_part->headers.arr, 0,
 			&headers.arr, 0, array_count(&headers));
 	}
 
-	/* Try to fill the return_body_parts array once more */
-	have_all = iter_all || sieve_message_body_get_return_parts
-		(renv, content_types, extract_text);
-
-	/* This time, failure is a bug */
-	i_assert(have_all);
-
 	/* Cleanup */
+	if ( streamer != NULL && streamer->html2text != NULL )
+		mail_html2text_deinit(&streamer->html2text);
 	(void)message_parser_deinit(&parser, &mparts);
 	message_decoder_deinit(&decoder);
 	buffer_free(&buf);
@@ -1486,9 +1849,45 @@ static int sieve_message_parts_add_missing
 			i_stream_get_error(input));
 		return SIEVE_EXEC_TEMP_FAILURE;
 	}
+
+	/* Retain the parsed structure */
+	if ( collect_headers )
+		msgctx->mime_parts = mparts;
+
+	/* Try to fill the return_body_parts array once more */
+	have_all = iter_all || streamer != NULL ||
+		sieve_message_body_get_return_parts(renv, content_types, extract_text);
+
+	/* This time, failure is a bug */
+	i_assert(have_all);
+
 	return SIEVE_EXEC_OK;
 }
 
+static int sieve_message_parts_add_missing
+(const struct sieve_runtime_env *renv,
+	const char *const *content_types,
+	bool extract_text, bool iter_all,
+	struct sieve_message_body_streamer *streamer)
+	ATTR_NULL(2, 5)
+{
+	struct sieve_exec_stats *stats = renv->scriptenv->exec_stats;
+	struct timeval start = { 0, 0 }, end;
+	long long usecs;
+	int ret;
+
+	if ( stats != NULL )
+		(void)gettimeofday(&start, NULL);
+
+	ret = _sieve_message_parts_add_missing
+		(renv, content_types, extract_text, iter_all, streamer);
+
+	if ( stats != NULL && gettimeofday(&end, NULL) == 0 &&
+		(usecs=timeval_diff_usecs(&end, &start)) > 0 )
+		stats->message_parse_usecs += usecs;
+	return ret;
+}
+
 int sieve_message_body_get_content
 (const struct sieve_runtime_env *renv,
 	const char * const *content_types,
@@ -1500,7 +1899,7 @@ int sieve_message_body_get_content
 	T_BEGIN {
 		/* Fill the return_body_parts array */
 		status = sieve_message_parts_add_missing
-			(renv, content_types, FALSE, FALSE);
+			(renv, content_types, FALSE, FALSE, NULL);
 	} T_END;
 
 	/* Check status */
@@ -1514,12 +1913,13 @@ int sieve_message_body_get_content
 	return status;
 }
 
+static const char * const _text_content_types[] =
+	{ "application/xhtml+xml", "text", NULL };
+
 int sieve_message_body_get_text
 (const struct sieve_runtime_env *renv,
 	struct sieve_message_part_data **parts_r)
 {
-	static const char * const _text_content_types[] =
-		{ "application/xhtml+xml", "text", NULL };
 	struct sieve_message_context *msgctx = renv->msgctx;
 	int status;
 
@@ -1534,7 +1934,7 @@ int sieve_message_body_get_text
 	T_BEGIN {
 		/* Fill the return_body_parts array */
 		status = sieve_message_parts_add_missing
-			(renv, _text_content_types, TRUE, FALSE);
+			(renv, _text_content_types, TRUE, FALSE, NULL);
 	} T_END;
 
 	/* Check status */
@@ -1620,6 +2020,147 @@ int sieve_message_body_get_raw
 	return SIEVE_EXEC_OK;
 }
 
+/*
+ * Streamed message body
+ */
+
+static bool sieve_message_body_feed
+(const struct sieve_message_part_data *parts,
+	const struct sieve_message_body_sink *sink, void *context)
+{
+	for ( ; parts->content != NULL; parts++ ) {
+		if ( sink->part_begin(context) ||
+			sink->part_more(context, parts->content, parts->size) ||
+			sink->part_end(context) )
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static bool sieve_message_body_want_stream
+(const struct sieve_runtime_env *renv)
+{
+	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	uoff_t size;
+
+	/* Messages smaller than sieve_body_stream_min_size are always cached as
+	   a whole; streaming requires parsing the message again for every test.
+	   Errors are reported once the message is actually read. */
+	if ( mail_get_physical_size(mail, &size) < 0 )
+		return FALSE;
+	return ( size >= renv->svinst->body_stream_min_size );
+}
+
+static int sieve_message_body_stream
+(const struct sieve_runtime_env *renv,
+	const char * const *content_types, bool extract_text,
+	const struct sieve_message_body_sink *sink, void *context)
+{
+	struct sieve_message_body_streamer streamer;
+	struct sieve_message_part_data *parts;
+	int status;
+
+	/* Use the cache if the parts are cached already or the message is small
+	   enough to cache */
+	if ( sieve_message_body_get_return_parts
+			(renv, content_types, extract_text) ||
+		!sieve_message_body_want_stream(renv) ) {
+		if ( extract_text ) {
+			status = sieve_message_body_get_text(renv, &parts);
+		} else {
+			status = sieve_message_body_get_content
+				(renv, content_types, &parts);
+		}
+		if ( status > 0 )
+			(void)sieve_message_body_feed(parts, sink, context);
+		return status;
+	}
+
+	memset(&streamer, 0, sizeof(streamer));
+	streamer.sink = sink;
+	streamer.context = context;
+
+	T_BEGIN {
+		status = sieve_message_parts_add_missing
+			(renv, content_types, extract_text, FALSE, &streamer);
+	} T_END;
+
+	return status;
+}
+
+int sieve_message_body_stream_content
+(const struct sieve_runtime_env *renv,
+	const char * const *content_types,
+	const struct sieve_message_body_sink *sink, void *context)
+{
+	return sieve_message_body_stream
+		(renv, content_types, FALSE, sink, context);
+}
+
+int sieve_message_body_stream_text
+(const struct sieve_runtime_env *renv,
+	const struct sieve_message_body_sink *sink, void *context)
+{
+	return sieve_message_body_stream
+		(renv, _text_content_types, TRUE, sink, context);
+}
+
+int sieve_message_body_stream_raw
+(const struct sieve_runtime_env *renv,
+	const struct sieve_message_body_sink *sink, void *context)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	struct sieve_message_part_data *parts;
+	struct mail *mail;
+	struct istream *input;
+	struct message_size hdr_size, body_size;
+	const unsigned char *data;
+	size_t size;
+	bool begun = FALSE, done = FALSE;
+	int ret, status;
+
+	if ( msgctx->raw_body != NULL || !sieve_message_body_want_stream(renv) ) {
+		status = sieve_message_body_get_raw(renv, &parts);
+		if ( status > 0 )
+			(void)sieve_message_body_feed(parts, sink, context);
+		return status;
+	}
+
+	/* Get stream for message */
+	mail = sieve_message_get_mail(msgctx);
+	if ( mail_get_stream(mail, &hdr_size, &body_size, &input) < 0 ) {
+		return sieve_runtime_mail_error(renv, mail,
+			"failed to open input message");
+	}
+
+	/* Skip stream to beginning of body */
+	i_stream_skip(input, hdr_size.physical_size);
+
+	/* Pass raw message body to the sink; an empty body is no part at all */
+	while ( !done && (ret=i_stream_read_data(input, &data, &size, 0)) > 0 ) {
+		if ( !begun ) {
+			begun = TRUE;
+			done = sink->part_begin(context);
+		}
+		if ( !done )
+			done = sink->part_more(context, data, size);
+
+		i_stream_skip(input, size);
+	}
+
+	if ( !done && ret == -1 && input->stream_errno != 0 ) {
+		sieve_runtime_critical(renv, NULL,
+			"failed to read input message",
+			"failed to read raw message stream: %s",
+			i_stream_get_error(input));
+		return SIEVE_EXEC_TEMP_FAILURE;
+	}
+
+	if ( begun && !done )
+		(void)sink->part_end(context);
+	return SIEVE_EXEC_OK;
+}
+
 /*
  * Message part iterator
  */
@@ -1636,7 +2177,7 @@ int sieve_message_part_iter_init
 	T_BEGIN {
 		/* Fill the return_body_parts array */
 		status = sieve_message_parts_add_missing
-			(renv, NULL, TRUE, TRUE);
+			(renv, NULL, TRUE, TRUE, NULL);
 	} T_END;
 
 	/* Check status */
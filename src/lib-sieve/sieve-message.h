@@ -59,6 +59,16 @@ const char *sieve_message_get_final_recipient
 const char *sieve_message_get_sender
 	(struct sieve_message_context *msgctx);
 
+/* Address headers */
+
+struct message_address;
+
+/* Parses an address header value once per message; returns FALSE if any of
+   the addresses is invalid. */
+bool sieve_message_address_list_parse
+	(struct sieve_message_context *msgctx, string_t *value,
+		const struct message_address **addresses_r);
+
 /* Mail */
 
 struct mail *sieve_message_get_mail
@@ -252,6 +262,28 @@ int sieve_message_body_get_raw
 	(const struct sieve_runtime_env *renv,
 		struct sieve_message_part_data **parts_r);
 
+/* Streamed message body; large message bodies are passed to the sink block by
+   block rather than being cached as a whole. The sink functions return TRUE
+   once no more body data is needed. Small messages are cached as usual and
+   passed to the sink from the cache. */
+
+struct sieve_message_body_sink {
+	bool (*part_begin)(void *context);
+	bool (*part_more)(void *context, const void *data, size_t size);
+	bool (*part_end)(void *context);
+};
+
+int sieve_message_body_stream_content
+	(const struct sieve_runtime_env *renv,
+		const char * const *content_types,
+		const struct sieve_message_body_sink *sink, void *context);
+int sieve_message_body_stream_text
+	(const struct sieve_runtime_env *renv,
+		const struct sieve_message_body_sink *sink, void *context);
+int sieve_message_body_stream_raw
+	(const struct sieve_runtime_env *renv,
+		const struct sieve_message_body_sink *sink, void *context);
+
 /*
  * Message part iterator
  */
@@ -0,0 +1,350 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "str.h"
+#include "array.h"
+#include "hash.h"
+#include "ostream.h"
+
+#include "sieve-common.h"
+#include "sieve-code.h"
+#include "sieve-extensions.h"
+#include "sieve-interpreter.h"
+#include "sieve-runtime.h"
+#include "sieve-profile.h"
+
+#include <time.h>
+
+/*
+ * Types
+ */
+
+struct sieve_profile_script {
+	struct sieve_profile *profile;
+	const char *location;
+
+	/* Code address + 1 -> entry */
+	HASH_TABLE(void *, struct sieve_profile_entry *) entries;
+};
+
+struct sieve_profile {
+	pool_t pool;
+
+	HASH_TABLE(const char *, struct sieve_profile_script *) scripts;
+	ARRAY(struct sieve_profile_script *) script_list;
+	ARRAY(struct sieve_profile_entry *) entries;
+};
+
+/*
+ * Profile object
+ */
+
+static void sieve_profile_init(struct sieve_profile *profile)
+{
+	profile->pool = pool_alloconly_create("sieve_profile", 8192);
+	hash_table_create
+		(&profile->scripts, profile->pool, 0, str_hash, strcmp);
+	p_array_init(&profile->script_list, profile->pool, 4);
+	p_array_init(&profile->entries, profile->pool, 64);
+}
+
+static void sieve_profile_deinit(struct sieve_profile *profile)
+{
+	struct sieve_profile_script *const *pscripts;
+	unsigned int count, i;
+
+	pscripts = array_get(&profile->script_list, &count);
+	for ( i = 0; i < count; i++ )
+		hash_table_destroy(&pscripts[i]->entries);
+
+	hash_table_destroy(&profile->scripts);
+	pool_unref(&profile->pool);
+}
+
+struct sieve_profile *sieve_profile_create(void)
+{
+	struct sieve_profile *profile;
+
+	profile = i_new(struct sieve_profile, 1);
+	sieve_profile_init(profile);
+
+	return profile;
+}
+
+void sieve_profile_free(struct sieve_profile **_profile)
+{
+	struct sieve_profile *profile = *_profile;
+
+	*_profile = NULL;
+
+	sieve_profile_deinit(profile);
+	i_free(profile);
+}
+
+void sieve_profile_reset(struct sieve_profile *profile)
+{
+	sieve_profile_deinit(profile);
+	sieve_profile_init(profile);
+}
+
+/*
+ * Sampling
+ */
+
+static inline uint64_t sieve_profile_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	if ( clock_gettime(clock, &ts) < 0 )
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+struct sieve_profile_script *sieve_profile_get_script
+(struct sieve_profile *profile, const char *location)
+{
+	struct sieve_profile_script *pscript;
+
+	if ( location == NULL )
+		location = "(unknown)";
+
+	pscript = hash_table_lookup(profile->scripts, location);
+	if ( pscript == NULL ) {
+		pscript = p_new(profile->pool, struct sieve_profile_script, 1);
+		pscript->profile = profile;
+		pscript->location = p_strdup(profile->pool, location);
+		hash_table_create_direct(&pscript->entries, profile->pool, 0);
+
+		hash_table_insert(profile->scripts, pscript->location, pscript);
+		array_append(&profile->script_list, &pscript, 1);
+	}
+	return pscript;
+}
+
+void sieve_profile_sample_start
+(struct sieve_profile_sample *sample, sieve_size_t address)
+{
+	sample->address = address;
+	sample->wall_start = sieve_profile_clock(CLOCK_MONOTONIC);
+	sample->cpu_start = sieve_profile_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void sieve_profile_sample_finish
+(struct sieve_profile_script *pscript, struct sieve_profile_sample *sample,
+	const struct sieve_runtime_env *renv)
+{
+	struct sieve_profile *profile = pscript->profile;
+	struct sieve_profile_entry *entry;
+	uint64_t wall_end, cpu_end;
+	void *key = POINTER_CAST(sample->address + 1);
+
+	cpu_end = sieve_profile_clock(CLOCK_PROCESS_CPUTIME_ID);
+	wall_end = sieve_profile_clock(CLOCK_MONOTONIC);
+
+	entry = hash_table_lookup(pscript->entries, key);
+	if ( entry == NULL ) {
+		const struct sieve_operation *oprtn = renv->oprtn;
+
+		/* First execution of this operation */
+		entry = p_new(profile->pool, struct sieve_profile_entry, 1);
+		entry->script = pscript->location;
+		entry->address = sample->address;
+		entry->line = sieve_runtime_get_command_location(renv);
+		entry->operation = sieve_operation_mnemonic(oprtn);
+		entry->extension = ( oprtn->ext == NULL ?
+			NULL : sieve_extension_name(oprtn->ext) );
+
+		hash_table_insert(pscript->entries, key, entry);
+		array_append(&profile->entries, &entry, 1);
+	}
+
+	entry->totals.count++;
+	if ( wall_end > sample->wall_start )
+		entry->totals.wall_nsecs += wall_end - sample->wall_start;
+	if ( cpu_end > sample->cpu_start )
+		entry->totals.cpu_nsecs += cpu_end - sample->cpu_start;
+}
+
+/*
+ * Totals
+ */
+
+struct sieve_profile_entry *const *sieve_profile_get_entries
+(struct sieve_profile *profile, unsigned int *count_r)
+{
+	return array_get(&profile->entries, count_r);
+}
+
+static const char *sieve_profile_group_key
+(const struct sieve_profile_entry *entry, enum sieve_profile_group group)
+{
+	switch ( group ) {
+	case SIEVE_PROFILE_GROUP_OPERATION:
+		return entry->operation;
+	case SIEVE_PROFILE_GROUP_LINE:
+		return t_strdup_printf("%u:%s", entry->line, entry->script);
+	case SIEVE_PROFILE_GROUP_EXTENSION:
+		return ( entry->extension == NULL ? "" : entry->extension );
+	}
+	i_unreached();
+}
+
+static int sieve_profile_entry_cmp
+(const struct sieve_profile_entry *entry1,
+	const struct sieve_profile_entry *entry2)
+{
+	if ( entry1->totals.cpu_nsecs != entry2->totals.cpu_nsecs )
+		return ( entry1->totals.cpu_nsecs > entry2->totals.cpu_nsecs ? -1 : 1 );
+	if ( entry1->totals.count != entry2->totals.count )
+		return ( entry1->totals.count > entry2->totals.count ? -1 : 1 );
+	return 0;
+}
+
+const struct sieve_profile_entry *sieve_profile_get_totals
+(struct sieve_profile *profile, enum sieve_profile_group group,
+	unsigned int *count_r)
+{
+	HASH_TABLE(const char *, void *) groups;
+	ARRAY(struct sieve_profile_entry) totals;
+	struct sieve_profile_entry *const *entries, *total;
+	unsigned int count, i;
+
+	t_array_init(&totals, 32);
+	hash_table_create(&groups, pool_datastack_create(), 0, str_hash, strcmp);
+
+	entries = array_get(&profile->entries, &count);
+	for ( i = 0; i < count; i++ ) {
+		const struct sieve_profile_entry *entry = entries[i];
+		const char *key = sieve_profile_group_key(entry, group);
+		void *idx;
+
+		/* Group index + 1 */
+		idx = hash_table_lookup(groups, key);
+		if ( idx == NULL ) {
+			total = array_append_space(&totals);
+			switch ( group ) {
+			case SIEVE_PROFILE_GROUP_OPERATION:
+				total->operation = entry->operation;
+				total->extension = entry->extension;
+				break;
+			case SIEVE_PROFILE_GROUP_LINE:
+				total->script = entry->script;
+				total->line = entry->line;
+				break;
+			case SIEVE_PROFILE_GROUP_EXTENSION:
+				total->extension = entry->extension;
+				break;
+			}
+			hash_table_insert(groups, key,
+				POINTER_CAST(array_count(&totals)));
+		} else {
+			total = array_idx_modifiable
+				(&totals, POINTER_CAST_TO(idx, unsigned int) - 1);
+		}
+
+		total->totals.count += entry->totals.count;
+		total->totals.wall_nsecs += entry->totals.wall_nsecs;
+		total->totals.cpu_nsecs += entry->totals.cpu_nsecs;
+	}
+	hash_table_destroy(&groups);
+
+	array_sort(&totals, sieve_profile_entry_cmp);
+	return array_get(&totals, count_r);
+}
+
+/*
+ * Output
+ */
+
+static void sieve_profile_write_totals
+(string_t *line, const struct sieve_profile_totals *totals)
+{
+	str_printfa(line, "%10u %14llu %14llu  ", totals->count,
+		(unsigned long long)(totals->wall_nsecs / 1000),
+		(unsigned long long)(totals->cpu_nsecs / 1000));
+}
+
+static void sieve_profile_write_group
+(struct sieve_profile *profile, struct ostream *stream,
+	enum sieve_profile_group group)
+{
+	const struct sieve_profile_entry *totals;
+	unsigned int count, i;
+	string_t *line;
+
+	line = t_str_new(128);
+	switch ( group ) {
+	case SIEVE_PROFILE_GROUP_OPERATION:
+		str_append(line, "\n## Operations:\n");
+		break;
+	case SIEVE_PROFILE_GROUP_LINE:
+		str_append(line, "\n## Source lines:\n");
+		break;
+	case SIEVE_PROFILE_GROUP_EXTENSION:
+		str_append(line, "\n## Extensions:\n");
+		break;
+	}
+	str_append(line,
+		"     count    wall (usec)     cpu (usec)\n");
+	o_stream_send(stream, str_data(line), str_len(line));
+
+	totals = sieve_profile_get_totals(profile, group, &count);
+	for ( i = 0; i < count; i++ ) {
+		str_truncate(line, 0);
+		sieve_profile_write_totals(line, &totals[i].totals);
+
+		switch ( group ) {
+		case SIEVE_PROFILE_GROUP_OPERATION:
+			str_append(line, totals[i].operation);
+			break;
+		case SIEVE_PROFILE_GROUP_LINE:
+			str_printfa(line, "%s: line %u",
+				totals[i].script, totals[i].line);
+			break;
+		case SIEVE_PROFILE_GROUP_EXTENSION:
+			str_append(line, ( totals[i].extension == NULL ?
+				"(core)" : totals[i].extension ));
+			break;
+		}
+
+		str_append_c(line, '\n');
+		o_stream_send(stream, str_data(line), str_len(line));
+	}
+}
+
+void sieve_profile_write
+(struct sieve_profile *profile, struct ostream *stream)
+{
+	struct sieve_profile_entry *const *entries;
+	unsigned int count, i;
+	string_t *line;
+
+	T_BEGIN {
+		o_stream_send_str(stream, "## Sieve execution profile\n");
+
+		sieve_profile_write_group
+			(profile, stream, SIEVE_PROFILE_GROUP_OPERATION);
+		sieve_profile_write_group
+			(profile, stream, SIEVE_PROFILE_GROUP_LINE);
+		sieve_profile_write_group
+			(profile, stream, SIEVE_PROFILE_GROUP_EXTENSION);
+
+		/* Addresses match those printed in the binary code dump */
+		o_stream_send_str(stream, "\n## Code addresses:\n"
+			"     count    wall (usec)     cpu (usec)\n");
+
+		line = t_str_new(128);
+		entries = array_get(&profile->entries, &count);
+		for ( i = 0; i < count; i++ ) {
+			str_truncate(line, 0);
+			sieve_profile_write_totals(line, &entries[i]->totals);
+			str_printfa(line, "%s: %08llx: ", entries[i]->script,
+				(unsigned long long) entries[i]->address);
+			if ( entries[i]->line > 0 )
+				str_printfa(line, "%4u: ", entries[i]->line);
+			str_printfa(line, "%s\n", entries[i]->operation);
+			o_stream_send(stream, str_data(line), str_len(line));
+		}
+	} T_END;
+}
@@ -0,0 +1,89 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __SIEVE_PROFILE_H
+#define __SIEVE_PROFILE_H
+
+#include "sieve-common.h"
+
+/*
+ * Execution profile
+ *
+ * When a profile is assigned to senv->profile, the interpreter counts how
+ * often each operation is executed and accumulates the wall and CPU time it
+ * takes. The samples are kept per script and per code address, so a single
+ * profile can collect the totals of any number of executions.
+ */
+
+struct ostream;
+
+struct sieve_profile;
+struct sieve_profile_script;
+
+struct sieve_profile_totals {
+	unsigned int count;
+	uint64_t wall_nsecs;
+	uint64_t cpu_nsecs;
+};
+
+struct sieve_profile_entry {
+	/* Location of the script (NULL when summed over scripts) */
+	const char *script;
+	/* Code address of the operation */
+	sieve_size_t address;
+	/* Source line of the command (0 when unknown or summed over lines) */
+	unsigned int line;
+	/* Operation mnemonic (NULL when summed over operations) */
+	const char *operation;
+	/* Extension name (NULL for the core language) */
+	const char *extension;
+
+	struct sieve_profile_totals totals;
+};
+
+enum sieve_profile_group {
+	SIEVE_PROFILE_GROUP_OPERATION,
+	SIEVE_PROFILE_GROUP_LINE,
+	SIEVE_PROFILE_GROUP_EXTENSION
+};
+
+struct sieve_profile *sieve_profile_create(void);
+void sieve_profile_free(struct sieve_profile **_profile);
+
+void sieve_profile_reset(struct sieve_profile *profile);
+
+/* Returns one entry for every operation address executed so far */
+struct sieve_profile_entry *const *sieve_profile_get_entries
+	(struct sieve_profile *profile, unsigned int *count_r);
+
+/* Returns the totals summed per operation, source line or extension, sorted
+   by descending CPU time. The returned array is allocated from the data
+   stack. */
+const struct sieve_profile_entry *sieve_profile_get_totals
+	(struct sieve_profile *profile, enum sieve_profile_group group,
+		unsigned int *count_r);
+
+void sieve_profile_write
+	(struct sieve_profile *profile, struct ostream *stream);
+
+/*
+ * Interpreter interface
+ */
+
+struct sieve_profile_sample {
+	sieve_size_t address;
+
+	uint64_t wall_start;
+	uint64_t cpu_start;
+};
+
+struct sieve_profile_script *sieve_profile_get_script
+	(struct sieve_profile *profile, const char *location);
+
+void sieve_profile_sample_start
+	(struct sieve_profile_sample *sample, sieve_size_t address);
+void sieve_profile_sample_finish
+	(struct sieve_profile_script *pscript, struct sieve_profile_sample *sample,
+		const struct sieve_runtime_env *renv);
+
+#endif /* __SIEVE_PROFILE_H */
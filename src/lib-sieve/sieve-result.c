@@ -9,6 +9,7 @@
 #include "strfuncs.h"
 #include "str-sanitize.h"
 #include "var-expand.h"
+#include "time-util.h"
 #include "message-address.h"
 #include "mail-storage.h"
 #include "mail-deliver.h"
@@ -37,6 +38,9 @@ struct sieve_result_action {
 
 	bool keep;
 
+	/* Order in which the actions were added to the result */
+	unsigned int seq;
+
 	struct sieve_side_effects_list *seffects;
 
 	struct sieve_result_action *prev, *next;
@@ -60,6 +64,17 @@ struct sieve_result_action_context {
 	struct sieve_side_effects_list *seffects;
 };
 
+/* Index of the actions in the result, used to find duplicates and conflicts
+   of new actions without checking every action already in the result. */
+
+struct sieve_result_action_class {
+	/* Number of actions of this type in the result */
+	unsigned int count;
+
+	/* Normalized target -> first action with this target */
+	HASH_TABLE(const char *, struct sieve_result_action *) targets;
+};
+
 /*
  * Result object
  */
@@ -87,7 +102,14 @@ struct sieve_result {
 	HASH_TABLE(const struct sieve_action_def *,
 			   struct sieve_result_action_context *) action_contexts;
 
+	/* Action index */
+	unsigned int action_seq;
+	HASH_TABLE(const struct sieve_action_def *,
+		struct sieve_result_action_class *) action_classes;
+	ARRAY(struct sieve_result_action *) conflict_actions;
+
 	unsigned int executed:1;
+	unsigned int index_invalid:1;
 };
 
 struct sieve_result *sieve_result_create
@@ -129,6 +151,8 @@ void sieve_result_ref(struct sieve_result *result)
 	result->refcount++;
 }
 
+static void sieve_result_action_index_free(struct sieve_result *result);
+
 void sieve_result_unref(struct sieve_result **result)
 {
 	i_assert((*result)->refcount > 0);
@@ -140,6 +164,7 @@ void sieve_result_unref(struct sieve_result **result)
 
 	if ( hash_table_is_created((*result)->action_contexts) )
         hash_table_destroy(&(*result)->action_contexts);
+	sieve_result_action_index_free(*result);
 
 	if ( (*result)->action_env.ehandler != NULL )
 		sieve_error_handler_unref(&(*result)->action_env.ehandler);
@@ -466,6 +491,144 @@ static void sieve_result_action_detach
 
 	if ( result->action_count > 0 )
 		result->action_count--;
+
+	result->index_invalid = TRUE;
+}
+
+/*
+ * Action index
+ */
+
+static void sieve_result_action_index_free(struct sieve_result *result)
+{
+	struct hash_iterate_context *hctx;
+	const struct sieve_action_def *act_def;
+	struct sieve_result_action_class *aclass;
+
+	if ( !hash_table_is_created(result->action_classes) )
+		return;
+
+	hctx = hash_table_iterate_init(result->action_classes);
+	while ( hash_table_iterate(hctx, result->action_classes,
+		&act_def, &aclass) )
+		hash_table_destroy(&aclass->targets);
+	hash_table_iterate_deinit(&hctx);
+
+	hash_table_destroy(&result->action_classes);
+}
+
+static void sieve_result_action_index_add
+(struct sieve_result *result, const struct sieve_script_env *senv,
+	struct sieve_result_action *raction)
+{
+	const struct sieve_action_def *act_def = raction->action.def;
+	struct sieve_result_action_class *aclass;
+	const char *target;
+
+	if ( act_def == NULL )
+		return;
+
+	if ( act_def->check_conflict != NULL )
+		array_append(&result->conflict_actions, &raction, 1);
+
+	aclass = hash_table_lookup(result->action_classes, act_def);
+	if ( aclass == NULL ) {
+		aclass = p_new(result->pool, struct sieve_result_action_class, 1);
+		hash_table_create(&aclass->targets, result->pool, 0, str_hash, strcmp);
+		hash_table_insert(result->action_classes, act_def, aclass);
+	}
+	aclass->count++;
+
+	if ( act_def->get_target == NULL )
+		return;
+
+	/* Only the first action with a particular target is ever found as
+	   duplicate */
+	T_BEGIN {
+		target = act_def->get_target(senv, &raction->action);
+		if ( hash_table_lookup(aclass->targets, target) == NULL ) {
+			hash_table_insert(aclass->targets,
+				p_strdup(result->pool, target), raction);
+		}
+	} T_END;
+}
+
+static void sieve_result_action_index_update
+(struct sieve_result *result, const struct sieve_script_env *senv)
+{
+	struct sieve_result_action *raction;
+
+	if ( hash_table_is_created(result->action_classes) &&
+		!result->index_invalid )
+		return;
+
+	/* (Re)build the index from scratch */
+	sieve_result_action_index_free(result);
+	hash_table_create_direct(&result->action_classes, result->pool, 0);
+	if ( array_is_created(&result->conflict_actions) )
+		array_clear(&result->conflict_actions);
+	else
+		p_array_init(&result->conflict_actions, result->pool, 4);
+
+	for ( raction = result->first_action; raction != NULL;
+		raction = raction->next )
+		sieve_result_action_index_add(result, senv, raction);
+
+	result->index_invalid = FALSE;
+}
+
+/* sieve_result_check_indexed():
+ *   Check a new action for duplicates and conflicts using the index, which is
+ *   equivalent to checking it against all actions in the result. This is
+ *   only possible when the action is not a keep, its duplicates can be
+ *   identified by target and it cannot conflict with other types of action
+ *   by itself. Returns 0 when the action is to be added.
+ */
+static int sieve_result_check_indexed
+(const struct sieve_runtime_env *renv, struct sieve_action *action,
+	struct sieve_side_effects_list *seffects, unsigned int *instance_count_r)
+{
+	struct sieve_result *result = renv->result;
+	const struct sieve_action_def *act_def = action->def;
+	struct sieve_result_action_class *aclass;
+	struct sieve_result_action *dup = NULL, *const *cractions;
+	unsigned int count, i;
+	int ret;
+
+	sieve_result_action_index_update(result, renv->scriptenv);
+
+	*instance_count_r = 0;
+	aclass = hash_table_lookup(result->action_classes, act_def);
+	if ( aclass != NULL ) {
+		*instance_count_r = aclass->count;
+		dup = hash_table_lookup(aclass->targets,
+			act_def->get_target(renv->scriptenv, action));
+	}
+
+	if ( dup != NULL ) {
+		if ( (ret=act_def->check_duplicate(renv, action, &dup->action)) < 0 )
+			return ret;
+		if ( ret == 0 )
+			dup = NULL;
+	}
+
+	/* Check conflicts with the preceding actions in the result */
+	cractions = array_get(&result->conflict_actions, &count);
+	for ( i = 0; i < count; i++ ) {
+		const struct sieve_action *oact = &cractions[i]->action;
+
+		if ( dup != NULL && cractions[i]->seq > dup->seq )
+			break;
+
+		if ( !oact->executed &&
+			(ret=oact->def->check_conflict(renv, oact, action)) != 0 )
+			return ret;
+	}
+
+	/* Merge side-effects, but don't add new action */
+	if ( dup != NULL )
+		return sieve_result_side_effects_merge(renv, action, dup, seffects);
+	return 0;
 }
 
 static int _sieve_result_add_action
@@ -480,6 +643,7 @@ static int _sieve_result_add_action
 	struct sieve_result *result = renv->result;
 	struct sieve_result_action *raction = NULL, *kaction = NULL;
 	struct sieve_action action;
+	bool indexed;
 
 	action.def = act_def;
 	action.ext = ext;
@@ -488,7 +652,18 @@ static int _sieve_result_add_action
 	action.executed = FALSE;
 
 	/* First, check for duplicates or conflicts */
-	raction = result->first_action;
+	indexed = ( !keep && act_def != NULL && act_def->get_target != NULL &&
+		act_def->check_duplicate != NULL && act_def->check_conflict == NULL );
+	if ( indexed ) {
+		if ( (ret=sieve_result_check_indexed
+			(renv, &action, seffects, &instance_count)) != 0 )
+			return ret;
+	} else {
+		/* Any action in the result may change here */
+		result->index_invalid = TRUE;
+	}
+
+	raction = ( indexed ? NULL : result->first_action );
 	while ( raction != NULL ) {
 		const struct sieve_action *oact = &raction->action;
 
@@ -625,6 +800,11 @@ static int _sieve_result_add_action
 			raction->next = NULL;
 		}
 		result->action_count++;
+		raction->seq = ++result->action_seq;
+
+		if ( !result->index_invalid &&
+			hash_table_is_created(result->action_classes) )
+			sieve_result_action_index_add(result, renv->scriptenv, raction);
 
 		/* Apply any implicit side effects */
 		if ( hash_table_is_created(result->action_contexts) ) {
@@ -920,6 +1100,32 @@ static void _sieve_result_prepare_execution(struct sieve_result *result,
 			t_new(struct sieve_exec_status, 1) : senv->exec_status );
 }
 
+static void sieve_result_action_count
+(struct sieve_result *result, const struct sieve_action *act)
+{
+	struct sieve_exec_stats *stats = result->action_env.scriptenv->exec_stats;
+	unsigned int i;
+
+	if ( stats == NULL )
+		return;
+
+	for ( i = 0; i < stats->action_types; i++ ) {
+		if ( strcmp(stats->actions[i].name, act->def->name) == 0 ) {
+			stats->actions[i].count++;
+			return;
+		}
+	}
+
+	if ( stats->action_types >= SIEVE_EXEC_STATS_MAX_ACTION_TYPES ) {
+		stats->other_actions++;
+		return;
+	}
+
+	stats->actions[i].name = act->def->name;
+	stats->actions[i].count = 1;
+	stats->action_types++;
+}
+
 static int _sieve_result_implicit_keep
 (struct sieve_result *result, bool rollback)
 {
@@ -1002,6 +1208,8 @@ static int _sieve_result_implicit_keep
 		if ( act_keep.def->commit != NULL )
 			status = act_keep.def->commit
 				(&act_keep, &result->action_env, tr_context, &dummy);
+		if ( status == SIEVE_EXEC_OK )
+			sieve_result_action_count(result, &act_keep);
 
 		rsef = rsef_first;
 		while ( rsef != NULL ) {
@@ -1033,14 +1241,23 @@ int sieve_result_implicit_keep
 (struct sieve_result *result,
 	struct sieve_error_handler *ehandler, bool success)
 {
+	struct sieve_exec_stats *stats = result->action_env.scriptenv->exec_stats;
+	struct timeval start = { 0, 0 }, end;
+	long long usecs;
 	int ret;
 
+	if ( stats != NULL )
+		(void)gettimeofday(&start, NULL);
+
 	_sieve_result_prepare_execution(result, ehandler);
 
 	ret = _sieve_result_implicit_keep(result, !success);
 
 	result->action_env.ehandler = NULL;
 
+	if ( stats != NULL && gettimeofday(&end, NULL) == 0 &&
+		(usecs=timeval_diff_usecs(&end, &start)) > 0 )
+		stats->result_usecs += usecs;
 	return ret;
 }
 
@@ -1169,6 +1386,7 @@ static int sieve_result_action_commit
 		if ( cstatus == SIEVE_EXEC_OK ) {
 			act->executed = TRUE;
 			result->executed = TRUE;
+			sieve_result_action_count(result, act);
 		}
 	}
 
@@ -1321,7 +1539,7 @@ static void sieve_result_transaction_finish
 	}
 }
 
-int sieve_result_execute
+static int _sieve_result_execute
 (struct sieve_result *result, bool *keep,
 	struct sieve_error_handler *ehandler)
 {
@@ -1396,6 +1614,26 @@ int sieve_result_execute
 	return result_status;
 }
 
+int sieve_result_execute
+(struct sieve_result *result, bool *keep,
+	struct sieve_error_handler *ehandler)
+{
+	struct sieve_exec_stats *stats = result->action_env.scriptenv->exec_stats;
+	struct timeval start = { 0, 0 }, end;
+	long long usecs;
+	int ret;
+
+	if ( stats != NULL )
+		(void)gettimeofday(&start, NULL);
+
+	ret = _sieve_result_execute(result, keep, ehandler);
+
+	if ( stats != NULL && gettimeofday(&end, NULL) == 0 &&
+		(usecs=timeval_diff_usecs(&end, &start)) > 0 )
+		stats->result_usecs += usecs;
+	return ret;
+}
+
 /*
  * Result evaluation
  */
@@ -1464,6 +1702,8 @@ void sieve_result_iterate_delete
 	else
 		rac->next->prev = rac->prev;
 
+	result->index_invalid = TRUE;
+
 	/* Skip to next action in iteration */
 
 	rictx->current_action = NULL;
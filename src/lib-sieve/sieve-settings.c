@@ -272,6 +272,16 @@ void sieve_settings_load
 		svinst->redirect_from.source =
 			SIEVE_MAIL_SENDER_SOURCE_DEFAULT;
 	}
+
+	svinst->binary_mmap = FALSE;
+	(void)sieve_setting_get_bool_value
+		(svinst, "sieve_binary_mmap", &svinst->binary_mmap);
+
+	svinst->body_stream_min_size = SIEVE_DEFAULT_BODY_STREAM_MIN_SIZE;
+	if ( sieve_setting_get_size_value
+		(svinst, "sieve_body_stream_min_size", &size_setting) ) {
+		svinst->body_stream_min_size = size_setting;
+	}
 }
 
 
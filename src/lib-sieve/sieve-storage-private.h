@@ -120,6 +120,9 @@ struct sieve_storage {
 
 	enum sieve_storage_flags flags;
 
+	/* seconds for which cached script status may be reused */
+	unsigned int status_cache_ttl;
+
 	/* this is the main personal storage */
 	unsigned int main_storage:1;
 	unsigned int allows_synchronization:1;
@@ -611,6 +611,12 @@ void sieve_storage_unref(struct sieve_storage **_storage)
 	*_storage = NULL;
 }
 
+void sieve_storage_set_status_cache_ttl
+(struct sieve_storage *storage, unsigned int ttl)
+{
+	storage->status_cache_ttl = ttl;
+}
+
 int sieve_storage_setup_bindir
 (struct sieve_storage *storage, mode_t mode)
 {
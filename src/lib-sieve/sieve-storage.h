@@ -40,6 +40,13 @@ struct sieve_storage *sieve_storage_create_main
 void sieve_storage_ref(struct sieve_storage *storage);
 void sieve_storage_unref(struct sieve_storage **_storage);
 
+/* Allow scripts opened from this storage to reuse the status information
+   (e.g. the file stat) obtained by an earlier open in the same process for at
+   most `ttl' seconds. Changes to the scripts may go unnoticed for that long.
+   Not all drivers support this; 0 disables it (the default). */
+void sieve_storage_set_status_cache_ttl
+	(struct sieve_storage *storage, unsigned int ttl);
+
 /*
  * Script access
  */
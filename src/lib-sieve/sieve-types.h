@@ -180,6 +180,10 @@ struct sieve_script_env {
 	bool mailbox_autocreate;
 	bool mailbox_autosubscribe;
 
+	/* Mailboxes kept open across executions for the store action (optional;
+	   see sieve_mailbox_cache_create()) */
+	struct sieve_mailbox_cache *mailbox_cache;
+
 	/* External context data */
 
 	void *script_context;
@@ -221,6 +225,12 @@ struct sieve_script_env {
 	/* Runtime trace*/
 	struct ostream *trace_stream;
 	struct sieve_trace_config trace_config;
+
+	/* Execution profile (optional; see sieve-profile.h) */
+	struct sieve_profile *profile;
+
+	/* Execution statistics (optional); accumulated over all executions */
+	struct sieve_exec_stats *exec_stats;
 };
 
 #define SIEVE_SCRIPT_DEFAULT_MAILBOX(senv) \
@@ -240,6 +250,30 @@ struct sieve_exec_status {
 	unsigned int store_failed:1;
 };
 
+/*
+ * Script execution statistics
+ */
+
+#define SIEVE_EXEC_STATS_MAX_ACTION_TYPES 16
+
+struct sieve_exec_action_stats {
+	const char *name;
+	unsigned int count;
+};
+
+struct sieve_exec_stats {
+	/* Time spent in microseconds */
+	unsigned long long interpreter_usecs;
+	unsigned long long result_usecs;
+	unsigned long long message_parse_usecs;
+
+	/* Number of committed actions per action type; any types beyond the
+	   maximum are counted as other_actions */
+	struct sieve_exec_action_stats actions[SIEVE_EXEC_STATS_MAX_ACTION_TYPES];
+	unsigned int action_types;
+	unsigned int other_actions;
+};
+
 /*
  * Execution exit codes
  */
@@ -7,6 +7,7 @@
 #include "buffer.h"
 #include "eacces-error.h"
 #include "home-expand.h"
+#include "time-util.h"
 
 #include "sieve-settings.h"
 #include "sieve-extensions.h"
@@ -277,6 +278,48 @@ struct sieve_binary *sieve_compile_script
 	return sbin;
 }
 
+bool sieve_validate_script
+(struct sieve_script *script, struct sieve_error_handler *ehandler,
+	enum sieve_compile_flags flags, enum sieve_error *error_r)
+{
+	struct sieve_ast *ast;
+	enum sieve_error error, *errorp;
+	bool result = TRUE;
+
+	if ( error_r != NULL )
+		errorp = error_r;
+	else
+		errorp = &error;
+	*errorp = SIEVE_ERROR_NONE;
+
+	/* Parse */
+	if ( (ast = sieve_parse(script, ehandler, errorp)) == NULL ) {
+		switch ( *errorp ) {
+		case SIEVE_ERROR_NOT_FOUND:
+			if (error_r == NULL) {
+				sieve_error(ehandler, sieve_script_name(script),
+					"script not found");
+			}
+			break;
+		default:
+			sieve_error(ehandler, sieve_script_name(script),
+				"parse failed");
+		}
+		return FALSE;
+	}
+
+	/* Validate */
+	if ( !sieve_validate(ast, ehandler, flags, errorp) ) {
+		sieve_error(ehandler, sieve_script_name(script),
+			"validation failed");
+		result = FALSE;
+	}
+
+	/* Cleanup */
+	sieve_ast_unref(&ast);
+	return result;
+}
+
 struct sieve_binary *sieve_compile
 (struct sieve_instance *svinst, const char *script_location,
 	const char *script_name, struct sieve_error_handler *ehandler,
@@ -322,6 +365,8 @@ static int sieve_run
 	struct sieve_error_handler *ehandler, enum sieve_runtime_flags flags)
 {
 	struct sieve_interpreter *interp;
+	struct timeval start = { 0, 0 }, end;
+	long long usecs;
 	int ret = 0;
 
 	/* Create the interpreter */
@@ -340,7 +385,12 @@ static int sieve_run
 	}
 
 	/* Run the interpreter */
+	if ( senv->exec_stats != NULL )
+		(void)gettimeofday(&start, NULL);
 	ret = sieve_interpreter_run(interp, *result);
+	if ( senv->exec_stats != NULL && gettimeofday(&end, NULL) == 0 &&
+		(usecs=timeval_diff_usecs(&end, &start)) > 0 )
+		senv->exec_stats->interpreter_usecs += usecs;
 
 	/* Free the interpreter */
 	sieve_interpreter_free(&interp);
@@ -51,6 +51,17 @@ struct sieve_binary *sieve_compile_script
 		enum sieve_compile_flags flags, enum sieve_error *error_r)
 		ATTR_NULL(2, 4);
 
+/* sieve_validate_script:
+ *
+ *   Parses and validates the script without generating code. Errors that are
+ *   only found during code generation, such as problems in included scripts,
+ *   are not reported.
+ */
+bool sieve_validate_script
+	(struct sieve_script *script, struct sieve_error_handler *ehandler,
+		enum sieve_compile_flags flags, enum sieve_error *error_r)
+		ATTR_NULL(2, 4);
+
 /* sieve_compile:
  *
  *   Compiles the script into a binary.
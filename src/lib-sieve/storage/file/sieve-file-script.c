@@ -3,12 +3,14 @@
 
 #include "lib.h"
 #include "mempool.h"
+#include "hash.h"
 #include "abspath.h"
 #include "istream.h"
 #include "time-util.h"
 #include "eacces-error.h"
 
 #include "sieve-binary.h"
+#include "sieve-dump.h"
 #include "sieve-script-private.h"
 
 #include "sieve-file-storage.h"
@@ -264,6 +266,80 @@ static int sieve_file_script_stat
 	return 0;
 }
 
+/* Status cache: a process that opens the same scripts over and over (e.g. the
+   tree of included scripts for every delivery in an LMTP process) can reuse
+   the result of an earlier stat() for a short while, rather than checking
+   every script file again. Only successful results are cached. */
+
+#define SIEVE_FILE_STAT_CACHE_MAX_ENTRIES 1024
+
+struct sieve_file_stat_cache_entry {
+	const char *path;
+	struct stat st, lnk_st;
+	time_t stat_time;
+};
+
+static pool_t sieve_file_stat_cache_pool = NULL;
+static HASH_TABLE(const char *, struct sieve_file_stat_cache_entry *)
+	sieve_file_stat_cache;
+
+static void sieve_file_stat_cache_init(void)
+{
+	sieve_file_stat_cache_pool =
+		pool_alloconly_create("sieve_file_stat_cache", 8192);
+	hash_table_create(&sieve_file_stat_cache, sieve_file_stat_cache_pool,
+		0, str_hash, strcmp);
+}
+
+static void sieve_file_stat_cache_clear(void)
+{
+	hash_table_destroy(&sieve_file_stat_cache);
+	pool_unref(&sieve_file_stat_cache_pool);
+}
+
+static int sieve_file_script_stat_cached
+(struct sieve_storage *storage, const char *path,
+	struct stat *st, struct stat *lnk_st)
+{
+	struct sieve_file_stat_cache_entry *entry;
+	unsigned int ttl = storage->status_cache_ttl;
+	time_t now;
+
+	if ( ttl == 0 )
+		return sieve_file_script_stat(path, st, lnk_st);
+
+	now = time(NULL);
+	if ( sieve_file_stat_cache_pool == NULL )
+		sieve_file_stat_cache_init();
+
+	entry = hash_table_lookup(sieve_file_stat_cache, path);
+	if ( entry != NULL && entry->stat_time <= now &&
+		now - entry->stat_time < (time_t)ttl ) {
+		*st = entry->st;
+		*lnk_st = entry->lnk_st;
+		return 0;
+	}
+
+	if ( sieve_file_script_stat(path, st, lnk_st) < 0 )
+		return -1;
+
+	if ( entry == NULL ) {
+		if ( hash_table_count(sieve_file_stat_cache) >=
+			SIEVE_FILE_STAT_CACHE_MAX_ENTRIES ) {
+			sieve_file_stat_cache_clear();
+			sieve_file_stat_cache_init();
+		}
+		entry = p_new(sieve_file_stat_cache_pool,
+			struct sieve_file_stat_cache_entry, 1);
+		entry->path = p_strdup(sieve_file_stat_cache_pool, path);
+		hash_table_insert(sieve_file_stat_cache, entry->path, entry);
+	}
+	entry->st = *st;
+	entry->lnk_st = *lnk_st;
+	entry->stat_time = now;
+	return 0;
+}
+
 static const char *
 path_split_filename(const char *path, const char **dirpath_r)
 {
@@ -333,7 +409,8 @@ static int sieve_file_script_open
 				dirpath = path;
 
 				path = sieve_file_storage_path_extend(fstorage, filename);
-				ret = sieve_file_script_stat(path, &st, &lnk_st);
+				ret = sieve_file_script_stat_cached
+					(storage, path, &st, &lnk_st);
 			}
 
 		} else {
@@ -466,7 +543,7 @@ static int sieve_file_script_get_stream
 
 static int sieve_file_script_binary_read_metadata
 (struct sieve_script *script, struct sieve_binary_block *sblock,
-	sieve_size_t *offset ATTR_UNUSED)
+	sieve_size_t *offset)
 {
 	struct sieve_file_script *fscript = (struct sieve_file_script *)script;
 	struct sieve_instance *svinst = script->storage->svinst;
@@ -474,6 +551,28 @@ static int sieve_file_script_binary_read_metadata
 	time_t bmtime = sieve_binary_mtime(sbin);
 	time_t smtime = ( fscript->st.st_mtime > fscript->lnk_st.st_mtime ?
 		fscript->st.st_mtime : fscript->lnk_st.st_mtime );
+	sieve_number_t ino, size, mtime;
+
+	/* The identity of the script file when it was compiled */
+	if ( !sieve_binary_read_integer(sblock, offset, &ino) ||
+		!sieve_binary_read_integer(sblock, offset, &size) ||
+		!sieve_binary_read_integer(sblock, offset, &mtime) ) {
+		sieve_script_sys_error(script,
+			"Binary `%s' has invalid metadata for script `%s'",
+			sieve_binary_path(sbin), sieve_script_location(script));
+		return -1;
+	}
+	if ( ino != (sieve_number_t)fscript->st.st_ino ||
+		size != (sieve_number_t)fscript->st.st_size ||
+		mtime != (sieve_number_t)fscript->st.st_mtime ) {
+		if ( svinst->debug ) {
+			sieve_script_sys_debug(script,
+				"Sieve binary `%s' was compiled from a different version "
+				"of the Sieve script `%s'",
+				sieve_binary_path(sbin), sieve_script_location(script));
+		}
+		return 0;
+	}
 
 	if ( bmtime <= smtime ) {
 		if ( svinst->debug ) {
@@ -490,6 +589,34 @@ static int sieve_file_script_binary_read_metadata
 	return 1;
 }
 
+static void sieve_file_script_binary_write_metadata
+(struct sieve_script *script, struct sieve_binary_block *sblock)
+{
+	struct sieve_file_script *fscript = (struct sieve_file_script *)script;
+
+	sieve_binary_emit_integer(sblock, fscript->st.st_ino);
+	sieve_binary_emit_integer(sblock, fscript->st.st_size);
+	sieve_binary_emit_integer(sblock, fscript->st.st_mtime);
+}
+
+static int sieve_file_script_binary_dump_metadata
+(struct sieve_script *script ATTR_UNUSED, struct sieve_dumptime_env *denv,
+	struct sieve_binary_block *sblock, sieve_size_t *offset)
+{
+	sieve_number_t ino, size, mtime;
+
+	if ( !sieve_binary_read_integer(sblock, offset, &ino) ||
+		!sieve_binary_read_integer(sblock, offset, &size) ||
+		!sieve_binary_read_integer(sblock, offset, &mtime) )
+		return FALSE;
+	sieve_binary_dumpf(denv, "file.inode = %llu\n", (unsigned long long)ino);
+	sieve_binary_dumpf(denv, "file.size = %llu\n", (unsigned long long)size);
+	sieve_binary_dumpf(denv, "file.mtime = %s\n",
+		t_strflocaltime("%Y-%m-%d %H:%M:%S", (time_t)mtime));
+
+	return TRUE;
+}
+
 static struct sieve_binary *sieve_file_script_binary_load
 (struct sieve_script *script, enum sieve_error *error_r)
 {
@@ -504,14 +631,33 @@ static int sieve_file_script_binary_save
 	enum sieve_error *error_r)
 {
 	struct sieve_storage *storage = script->storage;
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)storage;
 	struct sieve_file_script *fscript = (struct sieve_file_script *)script;
+	struct sieve_file_quota_index qidx;
+	bool in_script_dir;
+	int ret;
 
 	if ( storage->bin_dir != NULL &&
 		sieve_storage_setup_bindir(storage, 0700) < 0 )
 		return -1;
 
-	return sieve_binary_save(sbin, fscript->binpath, update,
+	/* Binaries saved next to the scripts change the directory mtime, but
+	   not the scripts counted by the quota index */
+	in_script_dir = ( storage->bin_dir == NULL && fstorage->path != NULL &&
+		strcmp(fscript->dirpath, fstorage->path) == 0 );
+	if ( in_script_dir )
+		sieve_file_storage_quota_index_begin(fstorage, &qidx);
+
+	ret = sieve_binary_save(sbin, fscript->binpath, update,
 		fscript->st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO), error_r);
+
+	if ( in_script_dir ) {
+		if ( ret >= 0 )
+			sieve_file_storage_quota_index_update(fstorage, &qidx, 0, 0);
+		sieve_file_storage_quota_index_end(fstorage, &qidx);
+	}
+	return ret;
 }
 
 static const char *sieve_file_script_binary_get_prefix
@@ -551,13 +697,29 @@ static int sieve_file_storage_script_delete(struct sieve_script *script)
 {
 	struct sieve_file_script *fscript =
 		(struct sieve_file_script *)script;
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)script->storage;
+	struct sieve_file_quota_index qidx;
+	struct stat st;
+	int64_t size = 0;
 	int ret = 0;
 
 	if ( sieve_file_storage_pre_modify(script->storage) < 0 )
 		return -1;
 
+	sieve_file_storage_quota_index_begin(fstorage, &qidx);
+	if ( qidx.valid ) {
+		if ( stat(fscript->path, &st) == 0 )
+			size = st.st_size;
+		else
+			qidx.valid = FALSE;
+	}
+
 	ret = unlink(fscript->path);
-	if ( ret < 0 ) {
+	if ( ret == 0 ) {
+		sieve_file_storage_quota_index_update
+			(fstorage, &qidx, -1, -size);
+	} else {
 		if ( errno == ENOENT ) {
 			sieve_script_set_error(script,
 				SIEVE_ERROR_NOT_FOUND,
@@ -568,6 +730,7 @@ static int sieve_file_storage_script_delete(struct sieve_script *script)
 				fscript->path);
 		}
 	}
+	sieve_file_storage_quota_index_end(fstorage, &qidx);
 	return ret;
 }
 
@@ -660,12 +823,15 @@ static int sieve_file_storage_script_rename
 	struct sieve_storage *storage = script->storage;
 	struct sieve_file_storage *fstorage =
 		(struct sieve_file_storage *)storage;
+	struct sieve_file_quota_index qidx;
 	const char *newpath, *newfile, *link_path;
 	int ret = 0;
 
 	if ( sieve_file_storage_pre_modify(storage) < 0 )
 		return -1;
 
+	sieve_file_storage_quota_index_begin(fstorage, &qidx);
+
 	T_BEGIN {
 		newfile = sieve_script_file_from_name(newname);
 		newpath = t_strconcat( fstorage->path, "/", newfile, NULL );
@@ -694,6 +860,10 @@ static int sieve_file_storage_script_rename
 					sieve_script_sys_error(script,
 						"Failed to clean up after rename: "
 						"unlink(%s) failed: %m", fscript->path);
+				} else {
+					/* Same script under a new name */
+					sieve_file_storage_quota_index_update
+						(fstorage, &qidx, 0, 0);
 				}
 
 				if ( script->name != NULL && *script->name != '\0' )
@@ -729,6 +899,7 @@ static int sieve_file_storage_script_rename
 		}
 	} T_END;
 
+	sieve_file_storage_quota_index_end(fstorage, &qidx);
 	return ret;
 }
 
@@ -795,6 +966,8 @@ const struct sieve_script sieve_file_script = {
 		.get_stream = sieve_file_script_get_stream,
 
 		.binary_read_metadata = sieve_file_script_binary_read_metadata,
+		.binary_write_metadata = sieve_file_script_binary_write_metadata,
+		.binary_dump_metadata = sieve_file_script_binary_dump_metadata,
 		.binary_load = sieve_file_script_binary_load,
 		.binary_save = sieve_file_script_binary_save,
 		.binary_get_prefix = sieve_file_script_binary_get_prefix,
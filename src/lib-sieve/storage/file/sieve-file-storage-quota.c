@@ -3,6 +3,11 @@
 
 #include "lib.h"
 #include "str.h"
+#include "strnum.h"
+#include "ioloop.h"
+#include "hostpid.h"
+#include "write-full.h"
+#include "file-dotlock.h"
 
 #include "sieve.h"
 #include "sieve-script.h"
@@ -14,17 +19,183 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-int sieve_file_storage_quota_havespace
-(struct sieve_storage *storage, const char *scriptname, size_t size,
-	enum sieve_storage_quota *quota_r, uint64_t *limit_r)
+/*
+ * Quota index
+ */
+
+/* The number of scripts and their total size are kept in tmp/quota-index,
+   together with the mtime of the script directory at the time the values were
+   last known to be correct. Any change to the directory that did not pass
+   through the index (e.g. another process or manual editing) changes the
+   mtime, which makes the index stale and forces a rescan. Modifications that
+   do update the index hold a dotlock on it from reading it until writing the
+   new values, so that concurrent modifications cannot lose each other's
+   difference. The index is also rebuilt periodically to correct any drift
+   caused by changes that could not take the lock.
+ */
+
+#define SIEVE_FILE_QUOTA_INDEX_FNAME "quota-index"
+#define SIEVE_FILE_QUOTA_INDEX_VERSION 1
+#define SIEVE_FILE_QUOTA_INDEX_MAX_SIZE 128
+
+/* The lock is only held across a single rename() or unlink() */
+#define SIEVE_FILE_QUOTA_INDEX_LOCK_TIMEOUT 10
+#define SIEVE_FILE_QUOTA_INDEX_LOCK_STALE_TIMEOUT 30
+
+static const char *
+sieve_file_storage_quota_index_path(struct sieve_file_storage *fstorage)
 {
-	struct sieve_file_storage *fstorage =
-		(struct sieve_file_storage *)storage;
+	return t_strconcat(fstorage->path,
+		"/tmp/"SIEVE_FILE_QUOTA_INDEX_FNAME, NULL);
+}
+
+static bool
+sieve_file_storage_quota_dir_usable(const struct stat *st)
+{
+	/* With second granularity mtimes, changes made later within the same
+	   second cannot be detected */
+	return ( ST_MTIME_NSEC(*st) != 0 || st->st_mtime < ioloop_time );
+}
+
+static int sieve_file_storage_quota_index_read
+(struct sieve_file_storage *fstorage, struct sieve_file_quota_index *qidx)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	const char *path, *const *args;
+	char buf[SIEVE_FILE_QUOTA_INDEX_MAX_SIZE];
+	unsigned int version;
+	uint64_t mtime_nsec;
+	time_t mtime, scan_time;
+	struct stat st;
+	ssize_t ret;
+	int fd;
+
+	memset(qidx, 0, sizeof(*qidx));
+
+	path = sieve_file_storage_quota_index_path(fstorage);
+	if ( (fd=open(path, O_RDONLY)) < 0 ) {
+		if ( errno != ENOENT ) {
+			sieve_storage_sys_warning(storage,
+				"quota: open(%s) failed: %m", path);
+		}
+		return 0;
+	}
+	ret = read(fd, buf, sizeof(buf) - 1);
+	if ( ret < 0 ) {
+		sieve_storage_sys_warning(storage,
+			"quota: read(%s) failed: %m", path);
+	}
+	if ( close(fd) < 0 ) {
+		sieve_storage_sys_warning(storage,
+			"quota: close(%s) failed: %m", path);
+	}
+	if ( ret <= 0 || buf[ret-1] != '\n' )
+		return 0;
+	buf[ret-1] = '\0';
+
+	/* <version> <count> <size> <dir mtime> <dir mtime nsec> <scan time> */
+	args = t_strsplit(buf, "\t");
+	if ( str_array_length(args) != 6 ||
+		str_to_uint(args[0], &version) < 0 ||
+		version != SIEVE_FILE_QUOTA_INDEX_VERSION ||
+		str_to_uint64(args[1], &qidx->script_count) < 0 ||
+		str_to_uint64(args[2], &qidx->script_storage) < 0 ||
+		str_to_time(args[3], &mtime) < 0 ||
+		str_to_uint64(args[4], &mtime_nsec) < 0 ||
+		str_to_time(args[5], &scan_time) < 0 ) {
+		sieve_storage_sys_warning(storage,
+			"quota: index file %s is corrupt", path);
+		return 0;
+	}
+
+	/* Rebuild periodically */
+	if ( scan_time > ioloop_time ||
+		scan_time + SIEVE_FILE_QUOTA_INDEX_REBUILD_SECS <= ioloop_time )
+		return 0;
+
+	/* Is the index still up-to-date with the script directory? */
+	if ( stat(fstorage->path, &st) < 0 ) {
+		sieve_storage_sys_warning(storage,
+			"quota: stat(%s) failed: %m", fstorage->path);
+		return 0;
+	}
+	if ( st.st_mtime != mtime ||
+		(uint64_t)ST_MTIME_NSEC(st) != mtime_nsec ||
+		!sieve_file_storage_quota_dir_usable(&st) )
+		return 0;
+
+	qidx->scan_time = scan_time;
+	qidx->valid = TRUE;
+	return 1;
+}
+
+static void sieve_file_storage_quota_index_write
+(struct sieve_file_storage *fstorage,
+	const struct sieve_file_quota_index *qidx, const struct stat *dir_st)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	const char *path, *tmp_path, *data;
+	mode_t old_mask;
+	int fd;
+
+	if ( !sieve_file_storage_quota_dir_usable(dir_st) )
+		return;
+
+	data = t_strdup_printf("%u\t%llu\t%llu\t%ld\t%lu\t%ld\n",
+		SIEVE_FILE_QUOTA_INDEX_VERSION,
+		(unsigned long long)qidx->script_count,
+		(unsigned long long)qidx->script_storage,
+		(long)dir_st->st_mtime, (unsigned long)ST_MTIME_NSEC(*dir_st),
+		(long)qidx->scan_time);
+
+	/* Replace the index atomically */
+	path = sieve_file_storage_quota_index_path(fstorage);
+	tmp_path = t_strdup_printf("%s.%s.%s.tmp", path, my_pid, my_hostname);
+
+	old_mask = umask(0777 & ~(fstorage->file_create_mode));
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+	umask(old_mask);
+	if ( fd < 0 ) {
+		if ( errno != ENOENT ) {
+			sieve_storage_sys_warning(storage,
+				"quota: open(%s) failed: %m", tmp_path);
+		}
+		return;
+	}
+	if ( write_full(fd, data, strlen(data)) < 0 ) {
+		sieve_storage_sys_warning(storage,
+			"quota: write(%s) failed: %m", tmp_path);
+		i_close_fd(&fd);
+		(void)unlink(tmp_path);
+		return;
+	}
+	i_close_fd(&fd);
+
+	if ( rename(tmp_path, path) < 0 ) {
+		sieve_storage_sys_warning(storage,
+			"quota: rename(%s, %s) failed: %m", tmp_path, path);
+		(void)unlink(tmp_path);
+	}
+}
+
+static int sieve_file_storage_quota_index_scan
+(struct sieve_file_storage *fstorage, struct sieve_file_quota_index *qidx)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	struct stat dir_st;
 	struct dirent *dp;
 	DIR *dirp;
-	uint64_t script_count = 1;
-	uint64_t script_storage = size;
-	int result = 1;
+	int result = 0;
+
+	memset(qidx, 0, sizeof(*qidx));
+
+	/* Remember the directory mtime before scanning, so that concurrent
+	   changes make the new index stale rather than being lost */
+	if ( stat(fstorage->path, &dir_st) < 0 ) {
+		sieve_storage_set_critical(storage,
+			"quota: stat(%s) failed: %m", fstorage->path);
+		return -1;
+	}
 
 	/* Open the directory */
 	if ( (dirp = opendir(fstorage->path)) == NULL ) {
@@ -35,8 +206,8 @@ int sieve_file_storage_quota_havespace
 
 	/* Scan all files */
 	for (;;) {
-		const char *name;
-		bool replaced = FALSE;
+		const char *name, *path;
+		struct stat st;
 
 		/* Read next entry */
 		errno = 0;
@@ -64,57 +235,209 @@ int sieve_file_storage_quota_havespace
 			strcmp(fstorage->active_fname, dp->d_name) == 0 )
 			continue;
 
-		if ( strcmp(name, scriptname) == 0 )
-			replaced = TRUE;
+		path = t_strconcat(fstorage->path, "/", dp->d_name, NULL);
+		if ( stat(path, &st) < 0 ) {
+			sieve_storage_sys_warning(storage,
+				"quota: stat(%s) failed: %m", path);
+			continue;
+		}
 
-		/* Check count quota if necessary */
-		if ( storage->max_scripts > 0 ) {
-			if ( !replaced ) {
-				script_count++;
+		qidx->script_count++;
+		qidx->script_storage += st.st_size;
+	}
 
-				if ( script_count > storage->max_scripts ) {
-					*quota_r = SIEVE_STORAGE_QUOTA_MAXSCRIPTS;
-					*limit_r = storage->max_scripts;
-					result = 0;
-					break;
-				}
-			}
-		}
+	/* Close directory */
+	if ( closedir(dirp) < 0 ) {
+		sieve_storage_set_critical(storage,
+			"quota: closedir(%s) failed: %m", fstorage->path);
+	}
 
-		/* Check storage quota if necessary */
-		if ( storage->max_storage > 0 ) {
-			const char *path;
-			struct stat st;
+	if ( result < 0 )
+		return -1;
 
-			path = t_strconcat(fstorage->path, "/", dp->d_name, NULL);
+	qidx->scan_time = ioloop_time;
+	qidx->valid = TRUE;
+	sieve_file_storage_quota_index_write(fstorage, qidx, &dir_st);
+	return 0;
+}
 
-			if ( stat(path, &st) < 0 ) {
-				sieve_storage_sys_warning(storage,
-					"quota: stat(%s) failed: %m", path);
-				continue;
-			}
+static bool sieve_file_storage_quota_enabled
+(struct sieve_file_storage *fstorage)
+{
+	struct sieve_storage *storage = &fstorage->storage;
 
-			if ( !replaced ) {
-				script_storage += st.st_size;
+	return ( storage->max_scripts > 0 || storage->max_storage > 0 );
+}
 
-				if ( script_storage > storage->max_storage ) {
-					*quota_r = SIEVE_STORAGE_QUOTA_MAXSTORAGE;
-					*limit_r = storage->max_storage;
-					result = 0;
-					break;
-				}
-			}
+static void sieve_file_storage_quota_index_lock
+(struct sieve_file_storage *fstorage, struct sieve_file_quota_index *qidx)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	struct dotlock_settings dotlock_set;
+	const char *path;
+	int ret;
+
+	memset(&dotlock_set, 0, sizeof(dotlock_set));
+	dotlock_set.timeout = SIEVE_FILE_QUOTA_INDEX_LOCK_TIMEOUT;
+	dotlock_set.stale_timeout = SIEVE_FILE_QUOTA_INDEX_LOCK_STALE_TIMEOUT;
+
+	path = sieve_file_storage_quota_index_path(fstorage);
+	ret = file_dotlock_create(&dotlock_set, path, 0, &qidx->dotlock);
+	if ( ret > 0 )
+		return;
+
+	if ( ret == 0 ) {
+		sieve_storage_sys_warning(storage,
+			"quota: timed out waiting for lock on %s", path);
+	} else if ( errno != ENOENT ) {
+		sieve_storage_sys_warning(storage,
+			"quota: file_dotlock_create(%s) failed: %m", path);
+	}
+	qidx->dotlock = NULL;
+}
+
+void sieve_file_storage_quota_index_begin
+(struct sieve_file_storage *fstorage, struct sieve_file_quota_index *qidx)
+{
+	memset(qidx, 0, sizeof(*qidx));
+
+	if ( !sieve_file_storage_quota_enabled(fstorage) )
+		return;
+
+	T_BEGIN {
+		sieve_file_storage_quota_index_lock(fstorage, qidx);
+		if ( qidx->dotlock != NULL )
+			(void)sieve_file_storage_quota_index_read(fstorage, qidx);
+		else
+			qidx->invalidate = TRUE;
+	} T_END;
+}
+
+void sieve_file_storage_quota_index_update
+(struct sieve_file_storage *fstorage, struct sieve_file_quota_index *qidx,
+	int count_diff, int64_t storage_diff)
+{
+	const char *path;
+	struct stat st;
+
+	if ( qidx->invalidate ) {
+		/* Changed without holding the lock; a concurrent update could
+		   record the new directory mtime without accounting for this
+		   change, so make sure the next quota check rescans */
+		path = sieve_file_storage_quota_index_path(fstorage);
+		if ( unlink(path) < 0 && errno != ENOENT ) {
+			sieve_storage_sys_warning(&fstorage->storage,
+				"quota: unlink(%s) failed: %m", path);
 		}
+		qidx->invalidate = FALSE;
+		return;
 	}
 
-	/* Close directory */
-	if ( closedir(dirp) < 0 ) {
-		sieve_storage_set_critical(storage,
-			"quota: closedir(%s) failed: %m", fstorage->path);
+	/* Without a valid index before the change, the next quota check simply
+	   rescans the directory */
+	if ( !qidx->valid )
+		return;
+	qidx->valid = FALSE;
+
+	if ( count_diff < 0 && qidx->script_count < (uint64_t)-count_diff )
+		return;
+	if ( storage_diff < 0 && qidx->script_storage < (uint64_t)-storage_diff )
+		return;
+	qidx->script_count += count_diff;
+	qidx->script_storage += storage_diff;
+
+	if ( stat(fstorage->path, &st) < 0 ) {
+		sieve_storage_sys_warning(&fstorage->storage,
+			"quota: stat(%s) failed: %m", fstorage->path);
+		return;
+	}
+
+	T_BEGIN {
+		sieve_file_storage_quota_index_write(fstorage, qidx, &st);
+	} T_END;
+}
+
+void sieve_file_storage_quota_index_end
+(struct sieve_file_storage *fstorage, struct sieve_file_quota_index *qidx)
+{
+	qidx->valid = FALSE;
+	qidx->invalidate = FALSE;
+
+	if ( qidx->dotlock == NULL )
+		return;
+	if ( file_dotlock_delete(&qidx->dotlock) < 0 ) {
+		sieve_storage_sys_warning(&fstorage->storage,
+			"quota: file_dotlock_delete(%s) failed: %m",
+			sieve_file_storage_quota_index_path(fstorage));
 	}
-	return result;
 }
 
+bool sieve_file_storage_quota_index_is_fresh
+(struct sieve_file_storage *fstorage)
+{
+	struct sieve_file_quota_index qidx;
+	int ret;
 
+	T_BEGIN {
+		ret = sieve_file_storage_quota_index_read(fstorage, &qidx);
+	} T_END;
+	return ( ret > 0 );
+}
 
+/*
+ * Quota check
+ */
 
+int sieve_file_storage_quota_havespace
+(struct sieve_storage *storage, const char *scriptname, size_t size,
+	enum sieve_storage_quota *quota_r, uint64_t *limit_r)
+{
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)storage;
+	struct sieve_file_quota_index qidx;
+	uint64_t script_count, script_storage;
+	const char *path;
+	struct stat st;
+
+	/* Get the current totals from the index or rescan the directory */
+	if ( sieve_file_storage_quota_index_read(fstorage, &qidx) <= 0 ) {
+		if ( storage->svinst->debug ) {
+			sieve_storage_sys_debug(storage,
+				"quota: rescanning script directory %s", fstorage->path);
+		}
+		if ( sieve_file_storage_quota_index_scan(fstorage, &qidx) < 0 )
+			return -1;
+	}
+
+	script_count = qidx.script_count + 1;
+	script_storage = qidx.script_storage + size;
+
+	/* Account for the script that is replaced */
+	path = t_strconcat(fstorage->path, "/",
+		sieve_script_file_from_name(scriptname), NULL);
+	if ( stat(path, &st) == 0 ) {
+		script_count--;
+		if ( (uint64_t)st.st_size <= script_storage )
+			script_storage -= st.st_size;
+	} else if ( errno != ENOENT ) {
+		sieve_storage_sys_warning(storage,
+			"quota: stat(%s) failed: %m", path);
+	}
+
+	/* Check count quota if necessary */
+	if ( storage->max_scripts > 0 &&
+		script_count > storage->max_scripts ) {
+		*quota_r = SIEVE_STORAGE_QUOTA_MAXSCRIPTS;
+		*limit_r = storage->max_scripts;
+		return 0;
+	}
+
+	/* Check storage quota if necessary */
+	if ( storage->max_storage > 0 &&
+		script_storage > storage->max_storage ) {
+		*quota_r = SIEVE_STORAGE_QUOTA_MAXSTORAGE;
+		*limit_r = storage->max_storage;
+		return 0;
+	}
+	return 1;
+}
@@ -356,7 +356,11 @@ int sieve_file_storage_save_commit
 	struct sieve_storage *storage = sctx->storage;
 	struct sieve_file_storage *fstorage =
 		(struct sieve_file_storage *)sctx->storage;
+	struct sieve_file_quota_index qidx;
 	const char *dest_path;
+	struct stat st;
+	int count_diff = 1;
+	int64_t storage_diff = 0;
 	bool failed = FALSE;
 
 	i_assert(fsctx->output == NULL);
@@ -365,7 +369,24 @@ int sieve_file_storage_save_commit
 		dest_path = t_strconcat(fstorage->path, "/",
 			sieve_script_file_from_name(sctx->scriptname), NULL);
 
+		sieve_file_storage_quota_index_begin(fstorage, &qidx);
+		if ( qidx.valid ) {
+			if ( stat(fsctx->tmp_path, &st) == 0 )
+				storage_diff = st.st_size;
+			else
+				qidx.valid = FALSE;
+			if ( stat(dest_path, &st) == 0 ) {
+				count_diff = 0;
+				storage_diff -= st.st_size;
+			}
+		}
+
 		failed = ( sieve_file_storage_script_move(fsctx, dest_path) < 0 );
+		if ( !failed ) {
+			sieve_file_storage_quota_index_update
+				(fstorage, &qidx, count_diff, storage_diff);
+		}
+		sieve_file_storage_quota_index_end(fstorage, &qidx);
 		if ( sctx->mtime != (time_t)-1 )
 			sieve_file_storage_update_mtime(storage, dest_path, sctx->mtime);
 	} T_END;
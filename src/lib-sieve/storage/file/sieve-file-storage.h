@@ -22,6 +22,8 @@
 #define SIEVE_FILE_STORAGE_TMP_SCAN_SECS (8*60*60)
 /* Delete files having ctime older than this from tmp/. 36h is standard. */
 #define SIEVE_FILE_STORAGE_TMP_DELETE_SECS (36*60*60)
+/* Rebuild the quota index from scratch when it is older than this */
+#define SIEVE_FILE_QUOTA_INDEX_REBUILD_SECS (60*60)
 
 /*
  * Storage class
@@ -113,10 +115,38 @@ int sieve_file_storage_save_as_active
 
 /* Quota */
 
+struct sieve_file_quota_index {
+	uint64_t script_count;
+	uint64_t script_storage;
+	time_t scan_time;
+
+	struct dotlock *dotlock;
+
+	unsigned int valid:1;
+	unsigned int invalidate:1;
+};
+
 int sieve_file_storage_quota_havespace
 (struct sieve_storage *storage, const char *scriptname, size_t size,
 	enum sieve_storage_quota *quota_r, uint64_t *limit_r);
 
+/* Locks and reads the quota index before the script directory is modified;
+   after a successful modification, the index is updated with the difference
+   it caused. The lock is released by _end(), which must always be called
+   after _begin(), also when the modification failed. */
+void sieve_file_storage_quota_index_begin
+	(struct sieve_file_storage *fstorage, struct sieve_file_quota_index *qidx);
+void sieve_file_storage_quota_index_update
+	(struct sieve_file_storage *fstorage, struct sieve_file_quota_index *qidx,
+		int count_diff, int64_t storage_diff);
+void sieve_file_storage_quota_index_end
+	(struct sieve_file_storage *fstorage, struct sieve_file_quota_index *qidx);
+
+/* Returns TRUE when the next quota check can use the quota index rather than
+   rescanning the script directory */
+bool sieve_file_storage_quota_index_is_fresh
+	(struct sieve_file_storage *fstorage);
+
 /*
  * Sieve script filenames
  */
@@ -35,7 +35,7 @@ struct program_client {
 
 	int fd_in, fd_out;
 	struct io *io;
-	struct ioloop *ioloop;
+	struct ioloop *ioloop, *async_ioloop;
 	struct timeout *to;
 	time_t start_time;
 
@@ -53,10 +53,16 @@ struct program_client {
 	int (*disconnect)(struct program_client *pclient, bool force);
 	void (*failure)
 		(struct program_client *pclient, enum program_client_error error);
+	/* Optional filter applied to the raw program output before it is made
+	   seekable */
+	struct istream *(*filter_program_input)
+		(struct program_client *pclient, struct istream *input);
 	
 	unsigned int debug:1;
 	unsigned int disconnected:1;
 	unsigned int output_seekable:1;
+	unsigned int async:1;
+	unsigned int async_io_finished:1;
 };
 
 void program_client_init
@@ -3,8 +3,11 @@
 
 #include "lib.h"
 #include "ioloop.h"
+#include "array.h"
 #include "str.h"
 #include "net.h"
+#include "fd-close-on-exec.h"
+#include "strnum.h"
 #include "write-full.h"
 #include "eacces-error.h"
 #include "istream-private.h"
@@ -13,9 +16,13 @@
 #include "program-client-private.h"
 
 #include <unistd.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 #include <sysexits.h>
 
+#define PROGRAM_CLIENT_REMOTE_MAX_IDLE_CONNS 16
+#define PROGRAM_CLIENT_REMOTE_MAX_IDLE_SECS 60
+
 /*
  * Script client input stream
  */
@@ -164,6 +171,329 @@ static struct istream *program_client_istream_create
 	return i_stream_create(&scstream->istream, input, -1);
 }
 
+/*
+ * Framed protocol
+ */
+
+/* A persistent connection carries many runs, so the end of the input and
+   output of a single run cannot be signaled by closing the socket. Instead,
+   once per connection the client sends
+
+     VERSION<TAB>script-framed<TAB>1<TAB>0<LF>
+
+   and for each run it sends the normal "-" line and argument lines ending in
+   an empty line, followed by the input split into frames. Each frame is its
+   size in decimal followed by LF and that many bytes of data; an empty frame
+   ends the input. The service replies with the program output framed the
+   same way, followed by a line containing "+" for success or "-" for
+   failure. After that, the connection is ready for the next run.
+ */
+
+/* Input for the program */
+
+struct program_client_frame_istream {
+	struct istream_private istream;
+
+	unsigned int finished:1;
+};
+
+static ssize_t program_client_frame_istream_read
+(struct istream_private *stream)
+{
+	struct program_client_frame_istream *fstream =
+		(struct program_client_frame_istream *)stream;
+	const unsigned char *data;
+	char header[MAX_INT_STRLEN + 2];
+	size_t size, avail, hdr_size;
+	ssize_t ret;
+
+	if ( fstream->finished ) {
+		stream->istream.eof = TRUE;
+		return -1;
+	}
+
+	data = i_stream_get_data(stream->parent, &size);
+	if ( size == 0 ) {
+		if ( (ret=i_stream_read(stream->parent)) == 0 )
+			return 0;
+		if ( ret < 0 && stream->parent->stream_errno != 0 ) {
+			stream->istream.stream_errno = stream->parent->stream_errno;
+			return -1;
+		}
+		data = i_stream_get_data(stream->parent, &size);
+	}
+
+	if ( !i_stream_try_alloc(stream, sizeof(header) + 1, &avail) )
+		return -2;
+	if ( size > avail - sizeof(header) )
+		size = avail - sizeof(header);
+
+	/* An empty frame marks the end of the input */
+	i_snprintf(header, sizeof(header), "%"PRIuSIZE_T"\n", size);
+	hdr_size = strlen(header);
+
+	memcpy(stream->w_buffer + stream->pos, header, hdr_size);
+	memcpy(stream->w_buffer + stream->pos + hdr_size, data, size);
+	i_stream_skip(stream->parent, size);
+	stream->pos += hdr_size + size;
+
+	if ( size == 0 )
+		fstream->finished = TRUE;
+	return hdr_size + size;
+}
+
+static struct istream *program_client_frame_istream_create
+(struct istream *input)
+{
+	struct program_client_frame_istream *fstream;
+
+	fstream = i_new(struct program_client_frame_istream, 1);
+
+	fstream->istream.max_buffer_size = input->real_stream->max_buffer_size;
+	fstream->istream.read = program_client_frame_istream_read;
+
+	fstream->istream.istream.readable_fd = FALSE;
+	fstream->istream.istream.blocking = input->blocking;
+	fstream->istream.istream.seekable = FALSE;
+
+	return i_stream_create(&fstream->istream, input, -1);
+}
+
+/* Output from the program */
+
+enum program_client_unframe_state {
+	PROGRAM_CLIENT_UNFRAME_SIZE,
+	PROGRAM_CLIENT_UNFRAME_DATA,
+	PROGRAM_CLIENT_UNFRAME_STATUS,
+	PROGRAM_CLIENT_UNFRAME_DONE
+};
+
+struct program_client_unframe_istream {
+	struct istream_private istream;
+
+	struct program_client *client;
+
+	enum program_client_unframe_state state;
+	uoff_t frame_left;
+};
+
+static ssize_t program_client_unframe_istream_error
+(struct istream_private *stream, const char *error)
+{
+	struct program_client_unframe_istream *ustream =
+		(struct program_client_unframe_istream *)stream;
+
+	i_error("program `%s' service sent invalid reply: %s",
+		ustream->client->path, error);
+	ustream->client->exit_code = -1;
+	stream->istream.stream_errno = EINVAL;
+	return -1;
+}
+
+static ssize_t program_client_unframe_istream_read
+(struct istream_private *stream)
+{
+	struct program_client_unframe_istream *ustream =
+		(struct program_client_unframe_istream *)stream;
+	const unsigned char *data;
+	const char *line;
+	size_t size, avail;
+	ssize_t ret;
+
+	for (;;) {
+		switch ( ustream->state ) {
+		case PROGRAM_CLIENT_UNFRAME_SIZE:
+			if ( (line=i_stream_next_line(stream->parent)) == NULL )
+				break;
+			if ( str_to_uoff(line, &ustream->frame_left) < 0 ) {
+				return program_client_unframe_istream_error
+					(stream, "bad frame size");
+			}
+			ustream->state = ( ustream->frame_left == 0 ?
+				PROGRAM_CLIENT_UNFRAME_STATUS : PROGRAM_CLIENT_UNFRAME_DATA );
+			continue;
+		case PROGRAM_CLIENT_UNFRAME_DATA:
+			data = i_stream_get_data(stream->parent, &size);
+			if ( size == 0 )
+				break;
+			if ( !i_stream_try_alloc(stream, 1, &avail) )
+				return -2;
+			if ( size > avail )
+				size = avail;
+			if ( size > ustream->frame_left )
+				size = ustream->frame_left;
+
+			memcpy(stream->w_buffer + stream->pos, data, size);
+			i_stream_skip(stream->parent, size);
+			stream->pos += size;
+
+			ustream->frame_left -= size;
+			if ( ustream->frame_left == 0 )
+				ustream->state = PROGRAM_CLIENT_UNFRAME_SIZE;
+			return size;
+		case PROGRAM_CLIENT_UNFRAME_STATUS:
+			if ( (line=i_stream_next_line(stream->parent)) == NULL )
+				break;
+			if ( strcmp(line, "+") == 0 )
+				ustream->client->exit_code = 1;
+			else if ( strcmp(line, "-") == 0 )
+				ustream->client->exit_code = 0;
+			else {
+				return program_client_unframe_istream_error
+					(stream, "bad status line");
+			}
+			ustream->state = PROGRAM_CLIENT_UNFRAME_DONE;
+			/* fall through */
+		case PROGRAM_CLIENT_UNFRAME_DONE:
+			stream->istream.eof = TRUE;
+			return -1;
+		}
+
+		/* Need more data from the service */
+		if ( (ret=i_stream_read(stream->parent)) == 0 )
+			return 0;
+		if ( ret == -2 ) {
+			return program_client_unframe_istream_error
+				(stream, "line too long");
+		}
+		if ( ret < 0 ) {
+			/* Connection closed in the middle of a reply */
+			ustream->client->exit_code = -1;
+			stream->istream.stream_errno =
+				( stream->parent->stream_errno != 0 ?
+					stream->parent->stream_errno : EPIPE );
+			return -1;
+		}
+	}
+}
+
+static struct istream *program_client_unframe_istream_create
+(struct program_client *program_client, struct istream *input)
+{
+	struct program_client_unframe_istream *ustream;
+
+	ustream = i_new(struct program_client_unframe_istream, 1);
+	ustream->client = program_client;
+
+	ustream->istream.max_buffer_size = input->real_stream->max_buffer_size;
+	ustream->istream.read = program_client_unframe_istream_read;
+
+	ustream->istream.istream.readable_fd = FALSE;
+	ustream->istream.istream.blocking = input->blocking;
+	ustream->istream.istream.seekable = FALSE;
+
+	return i_stream_create(&ustream->istream, input, -1);
+}
+
+/* Returns TRUE when the reply was read completely and nothing follows it */
+static bool program_client_unframe_istream_is_finished
+(struct istream *input)
+{
+	struct program_client_unframe_istream *ustream =
+		(struct program_client_unframe_istream *)input->real_stream;
+	size_t size;
+
+	if ( ustream->state != PROGRAM_CLIENT_UNFRAME_DONE )
+		return FALSE;
+	(void)i_stream_get_data(ustream->istream.parent, &size);
+	return ( size == 0 );
+}
+
+/*
+ * Connection pool
+ */
+
+/* Idle persistent connections are kept per process, so that later runs of
+   the same program (e.g. for the next delivery) need not connect again. A
+   process may serve several users (e.g. LMTP), and the service identifies
+   its peer when the connection is made, so a connection is only reused for
+   the same path, uid, gid and user. */
+
+struct program_client_remote_conn {
+	char *path;
+	char *username;
+	uid_t uid;
+	gid_t gid;
+	int fd;
+	time_t idle_since;
+};
+
+static ARRAY(struct program_client_remote_conn) program_client_remote_idle =
+	ARRAY_INIT;
+
+static void program_client_remote_conn_close
+(struct program_client_remote_conn *conn)
+{
+	if ( close(conn->fd) < 0 )
+		i_error("close(%s) failed: %m", conn->path);
+	i_free(conn->path);
+	i_free(conn->username);
+}
+
+static bool program_client_remote_conn_matches
+(const struct program_client_remote_conn *conn,
+	struct program_client *pclient)
+{
+	return ( strcmp(conn->path, pclient->path) == 0 &&
+		conn->uid == pclient->set.uid && conn->gid == pclient->set.gid &&
+		null_strcmp(conn->username, pclient->set.username) == 0 );
+}
+
+static int program_client_remote_pool_get(struct program_client *pclient)
+{
+	struct program_client_remote_conn conn;
+	unsigned int i;
+	char c;
+
+	if ( !array_is_created(&program_client_remote_idle) )
+		return -1;
+
+	for ( i = array_count(&program_client_remote_idle); i > 0; i-- ) {
+		conn = *array_idx(&program_client_remote_idle, i-1);
+		if ( !program_client_remote_conn_matches(&conn, pclient) )
+			continue;
+		array_delete(&program_client_remote_idle, i-1, 1);
+
+		/* The service may have closed the connection in the mean time, in
+		   which case it is readable now */
+		if ( ioloop_time - conn.idle_since <=
+				PROGRAM_CLIENT_REMOTE_MAX_IDLE_SECS &&
+			recv(conn.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+			(errno == EAGAIN || errno == EWOULDBLOCK) ) {
+			i_free(conn.path);
+			i_free(conn.username);
+			return conn.fd;
+		}
+		program_client_remote_conn_close(&conn);
+	}
+	return -1;
+}
+
+static void program_client_remote_pool_put
+(struct program_client *pclient, int fd)
+{
+	struct program_client_remote_conn *conn;
+
+	if ( !array_is_created(&program_client_remote_idle) ) {
+		i_array_init(&program_client_remote_idle,
+			PROGRAM_CLIENT_REMOTE_MAX_IDLE_CONNS);
+	} else if ( array_count(&program_client_remote_idle) >=
+		PROGRAM_CLIENT_REMOTE_MAX_IDLE_CONNS ) {
+		/* Drop the connection that was idle longest */
+		conn = array_idx_modifiable(&program_client_remote_idle, 0);
+		program_client_remote_conn_close(conn);
+		array_delete(&program_client_remote_idle, 0, 1);
+	}
+
+	conn = array_append_space(&program_client_remote_idle);
+	conn->path = i_strdup(pclient->path);
+	conn->username = i_strdup(pclient->set.username);
+	conn->uid = pclient->set.uid;
+	conn->gid = pclient->set.gid;
+	conn->fd = fd;
+	conn->idle_since = ioloop_time;
+}
+
 /*
  * Program client
  */
@@ -171,7 +501,13 @@ static struct istream *program_client_istream_create
 struct program_client_remote {
 	struct program_client client;
 
+	/* Persistent connection */
+	int conn_fd;
+	struct istream *framed_input;
+
 	unsigned int noreply:1;
+	unsigned int persistent:1;
+	unsigned int conn_reused:1;
 };
 
 static void program_client_remote_connected(struct program_client *pclient)
@@ -184,13 +520,23 @@ static void program_client_remote_connected(struct program_client *pclient)
 	io_remove(&pclient->io);
 	program_client_init_streams(pclient);
 
-	if ( !slclient->noreply ) {
+	if ( slclient->persistent ) {
+		if ( pclient->input != NULL ) {
+			struct istream *input = pclient->input;
+
+			pclient->input = program_client_frame_istream_create(input);
+			i_stream_unref(&input);
+		}
+	} else if ( !slclient->noreply ) {
 		pclient->program_input = program_client_istream_create
 			(pclient, pclient->program_input);
 	}
 
 	str = t_str_new(1024);
-	str_append(str, "VERSION\tscript\t3\t0\n");
+	if ( !slclient->persistent )
+		str_append(str, "VERSION\tscript\t3\t0\n");
+	else if ( !slclient->conn_reused )
+		str_append(str, "VERSION\tscript-framed\t1\t0\n");
 	if ( slclient->noreply )
 		str_append(str, "noreply\n");
 	else
@@ -202,6 +548,10 @@ static void program_client_remote_connected(struct program_client *pclient)
 		}
 	}
 	str_append_c(str, '\n');
+	if ( slclient->persistent && pclient->input == NULL ) {
+		/* No input: send the terminating empty frame right away */
+		str_append(str, "0\n");
+	}
 
 	if ( o_stream_send
 		(pclient->program_output, str_data(str), str_len(str)) < 0 ) {
@@ -218,7 +568,14 @@ static int program_client_remote_connect(struct program_client *pclient)
 		(struct program_client_remote *)pclient;
 	int fd;
 
-	if ((fd = net_connect_unix(pclient->path)) < 0) {
+	if ( slclient->persistent &&
+		(fd=program_client_remote_pool_get(pclient)) >= 0 ) {
+		if ( pclient->debug ) {
+			i_debug("program `%s': reusing persistent connection",
+				pclient->path);
+		}
+		slclient->conn_reused = TRUE;
+	} else if ((fd = net_connect_unix(pclient->path)) < 0) {
 		switch (errno) {
 		case EAGAIN:
 		case ECONNREFUSED:
@@ -234,9 +591,16 @@ static int program_client_remote_connect(struct program_client *pclient)
 	}
 
 	net_set_nonblock(fd, TRUE);
-	
-	pclient->fd_in = ( slclient->noreply && pclient->output == NULL &&
-		!pclient->output_seekable ? -1 : fd );
+
+	if ( slclient->persistent ) {
+		/* Don't leak the connection into forked programs */
+		fd_close_on_exec(fd, TRUE);
+		slclient->conn_fd = fd;
+		pclient->fd_in = fd;
+	} else {
+		pclient->fd_in = ( slclient->noreply && pclient->output == NULL &&
+			!pclient->output_seekable ? -1 : fd );
+	}
 	pclient->fd_out = fd;
 	pclient->io = io_add(fd, IO_WRITE, program_client_remote_connected, pclient);
 	return 0;
@@ -244,10 +608,16 @@ static int program_client_remote_connect(struct program_client *pclient)
 
 static int program_client_remote_close_output(struct program_client *pclient)
 {
+	struct program_client_remote *slclient =
+		(struct program_client_remote *)pclient;
 	int fd_out = pclient->fd_out, fd_in = pclient->fd_in;
 
 	pclient->fd_out = -1;
 
+	/* Persistent: the empty frame already marked the end of the input */
+	if ( slclient->persistent )
+		return 1;
+
 	/* Shutdown output; program stdin will get EOF */
 	if ( fd_out >= 0 ) {
 		if ( fd_in >= 0 ) {
@@ -264,13 +634,54 @@ static int program_client_remote_close_output(struct program_client *pclient)
 	return 1;
 }
 
+static int program_client_remote_disconnect_persistent
+(struct program_client *pclient, bool force)
+{
+	struct program_client_remote *slclient =
+		(struct program_client_remote *)pclient;
+	int ret = 1;
+
+	if ( pclient->error == PROGRAM_CLIENT_ERROR_NONE && !force &&
+		pclient->program_input != NULL ) {
+		const unsigned char *data;
+		size_t size;
+
+		/* Skip any remaining program output and parse the exit code */
+		while ((ret = i_stream_read_data
+			(pclient->program_input, &data, &size, 0)) > 0) {
+			i_stream_skip(pclient->program_input, size);
+		}
+
+		if ( !pclient->program_input->eof )
+			ret = -1;
+		else
+			ret = pclient->exit_code;
+	}
+
+	/* Only a connection that is exactly at the end of a complete reply can
+	   be used again; the generic code closes any other */
+	if ( ret >= 0 && !force && slclient->framed_input != NULL &&
+		program_client_unframe_istream_is_finished(slclient->framed_input) ) {
+		program_client_remote_pool_put(pclient, slclient->conn_fd);
+		pclient->fd_in = -1;
+	}
+	if ( slclient->framed_input != NULL )
+		i_stream_unref(&slclient->framed_input);
+	slclient->conn_fd = -1;
+	slclient->conn_reused = FALSE;
+	return ret;
+}
+
 static int program_client_remote_disconnect
 (struct program_client *pclient, bool force)
 {
 	struct program_client_remote *slclient =
 		(struct program_client_remote *)pclient;
 	int ret = 0;
-	
+
+	if ( slclient->persistent )
+		return program_client_remote_disconnect_persistent(pclient, force);
+
 	if ( pclient->error == PROGRAM_CLIENT_ERROR_NONE && !slclient->noreply &&
 		pclient->program_input != NULL && !force) {
 		const unsigned char *data;
@@ -311,6 +722,20 @@ static void program_client_remote_failure
 	}
 }
 
+static struct istream *program_client_remote_filter_program_input
+(struct program_client *pclient, struct istream *input)
+{
+	struct program_client_remote *slclient =
+		(struct program_client_remote *)pclient;
+
+	input = program_client_unframe_istream_create(pclient, input);
+	if ( slclient->framed_input != NULL )
+		i_stream_unref(&slclient->framed_input);
+	slclient->framed_input = input;
+	i_stream_ref(input);
+	return input;
+}
+
 struct program_client *program_client_remote_create
 (const char *socket_path, const char *const *args, 
 	const struct program_client_settings *set, bool noreply)
@@ -326,6 +751,14 @@ struct program_client *program_client_remote_create
 	pclient->client.disconnect = program_client_remote_disconnect;
 	pclient->client.failure = program_client_remote_failure;
 	pclient->noreply = noreply;
+	pclient->conn_fd = -1;
+
+	/* Persistent connections always carry a reply */
+	if ( set->remote_persistent && !noreply ) {
+		pclient->persistent = TRUE;
+		pclient->client.filter_program_input =
+			program_client_remote_filter_program_input;
+	}
 
 	return &pclient->client;
 }
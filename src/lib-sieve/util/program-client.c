@@ -88,6 +88,18 @@ static void program_client_disconnect
 	if ( pclient->disconnected )
 		return;
 
+	if ( pclient->async && !force ) {
+		/* Leave reaping the program to program_client_wait() */
+		if ( !pclient->async_io_finished ) {
+			pclient->async_io_finished = TRUE;
+			if ( program_client_close_output(pclient) < 0 &&
+				pclient->error == PROGRAM_CLIENT_ERROR_NONE )
+				pclient->error = PROGRAM_CLIENT_ERROR_IO;
+			io_loop_stop(pclient->async_ioloop);
+		}
+		return;
+	}
+
 	if ( (ret=program_client_close_output(pclient)) < 0 )
 		error = TRUE;
 
@@ -301,6 +313,7 @@ void program_client_init
 	if ( args != NULL )
 		pclient->args = p_strarray_dup(pool, args);
 	pclient->set = *set;
+	pclient->set.username = p_strdup(pool, set->username);
 	pclient->debug = set->debug;
 	pclient->fd_in = -1;
 	pclient->fd_out = -1;
@@ -429,6 +442,12 @@ void program_client_init_streams(struct program_client *pclient)
 		struct istream *input;
 		
 		input = i_stream_create_fd(pclient->fd_in, (size_t)-1, FALSE);
+		if ( pclient->filter_program_input != NULL ) {
+			struct istream *input2 = input;
+
+			input = pclient->filter_program_input(pclient, input2);
+			i_stream_unref(&input2);
+		}
 
 		if (pclient->output_seekable) {
 			struct istream *input2 = input, *input_list[2];
@@ -522,3 +541,58 @@ int program_client_run(struct program_client *pclient)
 	return pclient->exit_code;
 }
 
+void program_client_run_async(struct program_client *pclient)
+{
+	int ret;
+
+	/* reset */
+	pclient->disconnected = FALSE;
+	pclient->exit_code = 1;
+	pclient->error = PROGRAM_CLIENT_ERROR_NONE;
+
+	pclient->async = TRUE;
+	pclient->async_io_finished = FALSE;
+	pclient->async_ioloop = current_ioloop;
+
+	if ( (ret=program_client_connect(pclient)) < 0 )
+		return;
+
+	/* run output */
+	if ( ret > 0 && pclient->program_output != NULL &&
+		(ret=o_stream_flush(pclient->program_output)) == 0 ) {
+		o_stream_set_flush_callback
+			(pclient->program_output, program_client_program_output, pclient);
+	}
+
+	if ( ret < 0 ) {
+		program_client_fail(pclient, PROGRAM_CLIENT_ERROR_IO);
+	} else if ( !pclient->disconnected && ret > 0 &&
+		!program_client_input_pending(pclient) ) {
+		/* Everything is sent already */
+		program_client_disconnect(pclient, FALSE);
+	}
+}
+
+int program_client_wait(struct program_client *pclient)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+
+	i_assert( pclient->async );
+
+	if ( !pclient->disconnected && !pclient->async_io_finished ) {
+		/* Other programs sharing the ioloop may stop it as well */
+		io_loop_set_current(pclient->async_ioloop);
+		while ( !pclient->disconnected && !pclient->async_io_finished )
+			io_loop_run(pclient->async_ioloop);
+		io_loop_set_current(prev_ioloop);
+	}
+
+	/* finished */
+	pclient->async = FALSE;
+	program_client_disconnect(pclient, FALSE);
+
+	if ( pclient->error != PROGRAM_CLIENT_ERROR_NONE )
+		return -1;
+
+	return pclient->exit_code;
+}
@@ -12,9 +12,15 @@ struct program_client_settings {
 
 	uid_t uid;
 	gid_t gid;
+	/* User the program runs for; remote persistent connections are not
+	   shared between users */
+	const char *username;
 
 	unsigned int debug:1;
 	unsigned int drop_stderr:1;
+	/* Remote: keep the socket connection open for later runs; the service
+	   must speak the framed protocol (see program-client-remote.c) */
+	unsigned int remote_persistent:1;
 };
 
 typedef void program_client_fd_callback_t
@@ -54,5 +60,12 @@ void program_client_set_env
 
 int program_client_run(struct program_client *pclient);
 
+/* Starts the program in the current ioloop without waiting for it. The I/O
+   with the program only progresses while that ioloop runs. */
+void program_client_run_async(struct program_client *pclient);
+/* Runs the ioloop the program was started in until its I/O is finished,
+   reaps the program and returns the same result as program_client_run() */
+int program_client_wait(struct program_client *pclient);
+
 #endif
 
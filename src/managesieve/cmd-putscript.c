@@ -12,6 +12,7 @@
 #include "str.h"
 
 #include "sieve.h"
+#include "sieve-binary.h"
 #include "sieve-script.h"
 #include "sieve-storage.h"
 
@@ -141,6 +142,25 @@ static bool cmd_putscript_cancel(struct cmd_putscript_context *ctx, bool skip)
 	return cmd_putscript_continue_cancel(ctx->cmd);
 }
 
+static void cmd_putscript_save_binary
+(struct cmd_putscript_context *ctx, struct sieve_binary *sbin)
+{
+	struct sieve_script *script;
+	enum sieve_error error;
+
+	/* Store the binary alongside the committed script, so that the first
+	   delivery does not need to compile it again. This is not possible for
+	   all storage types and failure is not fatal for the upload. */
+	script = sieve_storage_open_script(ctx->storage, ctx->scriptname, &error);
+	if ( script == NULL )
+		return;
+
+	sieve_binary_set_script(sbin, script);
+	(void)sieve_script_binary_save(script, sbin, TRUE, &error);
+
+	sieve_script_unref(&script);
+}
+
 static bool cmd_putscript_finish_parsing(struct client_command_context *cmd)
 {
 	struct client *client = cmd->client;
@@ -201,9 +221,10 @@ static bool cmd_putscript_finish_parsing(struct client_command_context *cmd)
 			struct sieve_error_handler *ehandler;
 			enum sieve_compile_flags cpflags =
 				SIEVE_COMPILE_FLAG_NOGLOBAL | SIEVE_COMPILE_FLAG_UPLOADED;
-			struct sieve_binary *sbin;
+			struct sieve_binary *sbin = NULL;
 			enum sieve_error error;
 			string_t *errors;
+			bool valid;
 
 			/* Mark this as an activation when we are replacing the active script */
 			if ( sieve_storage_save_will_activate(ctx->save_ctx) ) {
@@ -215,9 +236,15 @@ static bool cmd_putscript_finish_parsing(struct client_command_context *cmd)
 			ehandler = sieve_strbuf_ehandler_create(client->svinst, errors, TRUE,
 				client->set->managesieve_max_compile_errors);
 
-			/* Compile */
-			if ( (sbin=sieve_compile_script
-				(script, ehandler, cpflags, &error)) == NULL ) {
+			/* Compile; the checkscript command only needs validation */
+			if ( ctx->scriptname != NULL ) {
+				sbin = sieve_compile_script(script, ehandler, cpflags, &error);
+				valid = ( sbin != NULL );
+			} else {
+				valid = sieve_validate_script(script, ehandler, cpflags, &error);
+			}
+
+			if ( !valid ) {
 				if ( error != SIEVE_ERROR_NOT_VALID ) {
 					const char *errormsg =
 						sieve_script_get_last_error(script, &error);
@@ -229,21 +256,25 @@ static bool cmd_putscript_finish_parsing(struct client_command_context *cmd)
 					client_send_no(client, str_c(errors));
 				}
 				success = FALSE;
-			} else {
-				sieve_close(&sbin);
-
+			} else if ( ctx->scriptname != NULL ) {
 				/* Commit to save only when this is a putscript command */
-				if ( ctx->scriptname != NULL ) {
-					ret = sieve_storage_save_commit(&ctx->save_ctx);
-
-					/* Check commit */
-					if (ret < 0) {
-						client_send_storage_error(client, ctx->storage);
-						success = FALSE;
-					}
+				ret = sieve_storage_save_commit(&ctx->save_ctx);
+
+				/* Check commit */
+				if (ret < 0) {
+					client_send_storage_error(client, ctx->storage);
+					success = FALSE;
+				} else if ( sieve_get_warnings(ehandler) == 0 ) {
+					/* Warnings may indicate leniency that only applies
+					   to uploads (e.g. missing includes), so the binary
+					   is not reused in that case */
+					cmd_putscript_save_binary(ctx, sbin);
 				}
 			}
 
+			if ( sbin != NULL )
+				sieve_close(&sbin);
+
 			/* Finish up */
 			cmd_putscript_finish(ctx);
 
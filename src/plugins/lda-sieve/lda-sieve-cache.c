@@ -0,0 +1,187 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "buffer.h"
+#include "hash.h"
+
+#include "sieve.h"
+#include "sieve-script.h"
+#include "sieve-binary.h"
+
+#include "lda-sieve-cache.h"
+
+/*
+ * Configuration
+ */
+
+#define LDA_SIEVE_CACHE_MAX_ENTRIES 64
+
+/*
+ * Cache
+ */
+
+/* Binaries belong to the Sieve instance they were loaded in, which only lives
+   for a single delivery. The cache therefore holds the serialized binary
+   image, which is opened again in the instance of each new delivery without
+   touching the file system. The image is validated against the script for
+   each delivery in the same way a binary on disk is.
+ */
+
+struct lda_sieve_cache_entry {
+	char *location;
+	char *path;
+
+	buffer_t *image;
+	time_t mtime;
+
+	time_t last_used;
+};
+
+static HASH_TABLE(char *, struct lda_sieve_cache_entry *) lda_sieve_cache;
+static struct lda_sieve_cache_stats lda_sieve_cache_stats;
+
+static void lda_sieve_cache_entry_free
+(struct lda_sieve_cache_entry **_entry)
+{
+	struct lda_sieve_cache_entry *entry = *_entry;
+
+	*_entry = NULL;
+
+	buffer_free(&entry->image);
+	i_free(entry->location);
+	i_free(entry->path);
+	i_free(entry);
+}
+
+static void lda_sieve_cache_remove
+(struct lda_sieve_cache_entry *entry)
+{
+	hash_table_remove(lda_sieve_cache, entry->location);
+	lda_sieve_cache_entry_free(&entry);
+}
+
+static void lda_sieve_cache_evict(void)
+{
+	struct hash_iterate_context *hctx;
+	struct lda_sieve_cache_entry *entry, *oldest = NULL;
+	char *location;
+
+	hctx = hash_table_iterate_init(lda_sieve_cache);
+	while ( hash_table_iterate(hctx, lda_sieve_cache, &location, &entry) ) {
+		if ( oldest == NULL || entry->last_used < oldest->last_used )
+			oldest = entry;
+	}
+	hash_table_iterate_deinit(&hctx);
+
+	if ( oldest != NULL )
+		lda_sieve_cache_remove(oldest);
+}
+
+struct sieve_binary *lda_sieve_cache_open
+(struct sieve_script *script, enum sieve_compile_flags cpflags)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	struct lda_sieve_cache_entry *entry;
+	struct sieve_binary *sbin;
+	const void *data;
+	size_t size;
+
+	if ( !hash_table_is_created(lda_sieve_cache) ||
+		(entry=hash_table_lookup
+			(lda_sieve_cache, sieve_script_location(script))) == NULL ) {
+		lda_sieve_cache_stats.misses++;
+		return NULL;
+	}
+
+	data = buffer_get_data(entry->image, &size);
+	sbin = sieve_binary_open_image
+		(svinst, entry->path, data, size, entry->mtime, script, NULL);
+	if ( sbin != NULL && !sieve_binary_up_to_date(sbin, cpflags) )
+		sieve_binary_unref(&sbin);
+
+	if ( sbin == NULL ) {
+		/* Script changed or the image cannot be used in this instance */
+		lda_sieve_cache_stats.invalidations++;
+		lda_sieve_cache_stats.misses++;
+		lda_sieve_cache_remove(entry);
+		return NULL;
+	}
+
+	entry->last_used = time(NULL);
+	lda_sieve_cache_stats.hits++;
+	return sbin;
+}
+
+void lda_sieve_cache_add
+(struct sieve_script *script, struct sieve_binary *sbin, time_t mtime)
+{
+	const char *location = sieve_script_location(script);
+	struct lda_sieve_cache_entry *entry;
+	const char *path;
+	buffer_t *image;
+
+	image = buffer_create_dynamic(default_pool, 4096);
+	if ( sieve_binary_save_image(sbin, image) < 0 ) {
+		buffer_free(&image);
+		return;
+	}
+
+	if ( !hash_table_is_created(lda_sieve_cache) ) {
+		hash_table_create
+			(&lda_sieve_cache, default_pool, 0, str_hash, strcmp);
+	}
+
+	if ( (entry=hash_table_lookup(lda_sieve_cache, location)) != NULL )
+		lda_sieve_cache_remove(entry);
+	else if ( hash_table_count(lda_sieve_cache) >= LDA_SIEVE_CACHE_MAX_ENTRIES )
+		lda_sieve_cache_evict();
+
+	if ( (path=sieve_binary_path(sbin)) == NULL )
+		path = location;
+
+	entry = i_new(struct lda_sieve_cache_entry, 1);
+	entry->location = i_strdup(location);
+	entry->path = i_strdup(path);
+	entry->image = image;
+	entry->mtime = mtime;
+	entry->last_used = time(NULL);
+
+	hash_table_insert(lda_sieve_cache, entry->location, entry);
+}
+
+void lda_sieve_cache_invalidate(struct sieve_script *script)
+{
+	struct lda_sieve_cache_entry *entry;
+
+	if ( !hash_table_is_created(lda_sieve_cache) )
+		return;
+
+	entry = hash_table_lookup(lda_sieve_cache, sieve_script_location(script));
+	if ( entry != NULL ) {
+		lda_sieve_cache_stats.invalidations++;
+		lda_sieve_cache_remove(entry);
+	}
+}
+
+void lda_sieve_cache_get_stats(struct lda_sieve_cache_stats *stats_r)
+{
+	*stats_r = lda_sieve_cache_stats;
+}
+
+void lda_sieve_cache_deinit(void)
+{
+	struct hash_iterate_context *hctx;
+	struct lda_sieve_cache_entry *entry;
+	char *location;
+
+	if ( !hash_table_is_created(lda_sieve_cache) )
+		return;
+
+	hctx = hash_table_iterate_init(lda_sieve_cache);
+	while ( hash_table_iterate(hctx, lda_sieve_cache, &location, &entry) )
+		lda_sieve_cache_entry_free(&entry);
+	hash_table_iterate_deinit(&hctx);
+
+	hash_table_destroy(&lda_sieve_cache);
+}
@@ -0,0 +1,31 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __LDA_SIEVE_CACHE_H
+#define __LDA_SIEVE_CACHE_H
+
+#include "sieve-common.h"
+
+/*
+ * Process-wide cache of compiled binaries
+ */
+
+struct lda_sieve_cache_stats {
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int invalidations;
+};
+
+/* Binaries returned by lda_sieve_cache_open() refer to the cached image; they
+   must be closed before the cache is modified again. */
+struct sieve_binary *lda_sieve_cache_open
+	(struct sieve_script *script, enum sieve_compile_flags cpflags);
+void lda_sieve_cache_add
+	(struct sieve_script *script, struct sieve_binary *sbin, time_t mtime);
+void lda_sieve_cache_invalidate(struct sieve_script *script);
+
+void lda_sieve_cache_get_stats(struct lda_sieve_cache_stats *stats_r);
+
+void lda_sieve_cache_deinit(void);
+
+#endif /* __LDA_SIEVE_CACHE_H */
@@ -12,12 +12,17 @@
 #include "smtp-client.h"
 #include "mail-send.h"
 #include "lda-settings.h"
+#include "time-util.h"
 
 #include "sieve.h"
 #include "sieve-script.h"
+#include "sieve-binary.h"
 #include "sieve-storage.h"
+#include "sieve-settings.h"
 
 #include "lda-sieve-log.h"
+#include "lda-sieve-cache.h"
+#include "lda-sieve-stats.h"
 #include "lda-sieve-plugin.h"
 
 #include <sys/stat.h>
@@ -170,6 +175,13 @@ struct lda_sieve_run_context {
 	struct sieve_error_handler *master_ehandler;
 	struct sieve_error_handler *action_ehandler;
 	const char *userlog;
+
+	/* Delivery statistics; only collected when enabled */
+	struct lda_sieve_stats stats;
+	const char *stats_file;
+
+	bool binary_cache;
+	bool collect_stats;
 };
 
 static int lda_sieve_get_personal_storage
@@ -255,15 +267,18 @@ static void lda_sieve_binary_save
 	}
 }
 
-static struct sieve_binary *lda_sieve_open
+static struct sieve_binary *lda_sieve_do_open
 (struct lda_sieve_run_context *srctx, struct sieve_script *script,
-	enum sieve_compile_flags cpflags, bool recompile, enum sieve_error *error_r)
+	enum sieve_compile_flags cpflags, bool recompile, bool *cached_r,
+	enum sieve_error *error_r)
 {
 	struct sieve_instance *svinst = srctx->svinst;
 	struct sieve_error_handler *ehandler;
 	struct sieve_binary *sbin;
 	bool debug = srctx->mdctx->dest_user->mail_debug;
 	const char *compile_name = "compile";
+	bool use_cache;
+	time_t open_time;
 
 	if ( recompile ) {
 		/* Warn */
@@ -283,6 +298,29 @@ static struct sieve_binary *lda_sieve_open
 
 	sieve_error_handler_reset(ehandler);
 
+	/* Scripts other than the user's personal script are shared by many users,
+	   so their binaries are kept in a process-wide cache */
+	use_cache = ( srctx->binary_cache && script != srctx->user_script );
+	if ( use_cache ) {
+		if ( recompile ) {
+			lda_sieve_cache_invalidate(script);
+		} else if ( (sbin=lda_sieve_cache_open(script, cpflags)) != NULL ) {
+			if ( debug ) {
+				struct lda_sieve_cache_stats stats;
+
+				lda_sieve_cache_get_stats(&stats);
+				sieve_sys_debug(svinst, "Script binary for %s found in cache "
+					"(hits=%u, misses=%u, invalidations=%u)",
+					sieve_script_location(script),
+					stats.hits, stats.misses, stats.invalidations);
+			}
+			*error_r = SIEVE_ERROR_NONE;
+			*cached_r = TRUE;
+			return sbin;
+		}
+	}
+
+	open_time = time(NULL);
 	if ( recompile )
 		sbin = sieve_compile_script(script, ehandler,	cpflags, error_r);
 	else 
@@ -328,6 +366,43 @@ static struct sieve_binary *lda_sieve_open
 
 	if (!recompile)
 		lda_sieve_binary_save(srctx, sbin, script);
+	if ( use_cache ) {
+		lda_sieve_cache_add(script, sbin, ( sieve_is_loaded(sbin) ?
+			sieve_binary_mtime(sbin) : open_time ));
+	}
+	return sbin;
+}
+
+static struct sieve_binary *lda_sieve_open
+(struct lda_sieve_run_context *srctx, struct sieve_script *script,
+	enum sieve_compile_flags cpflags, bool recompile, enum sieve_error *error_r)
+{
+	struct lda_sieve_stats *stats = &srctx->stats;
+	struct sieve_binary *sbin;
+	struct timeval start = { 0, 0 }, end;
+	long long usecs;
+	bool cached = FALSE;
+
+	if ( !srctx->collect_stats ) {
+		return lda_sieve_do_open
+			(srctx, script, cpflags, recompile, &cached, error_r);
+	}
+
+	(void)gettimeofday(&start, NULL);
+	sbin = lda_sieve_do_open
+		(srctx, script, cpflags, recompile, &cached, error_r);
+	if ( gettimeofday(&end, NULL) == 0 &&
+		(usecs=timeval_diff_usecs(&end, &start)) > 0 )
+		stats->open_usecs += usecs;
+
+	if ( sbin != NULL ) {
+		if ( cached )
+			stats->binaries_cached++;
+		else if ( !recompile && sieve_is_loaded(sbin) )
+			stats->binaries_loaded++;
+		else
+			stats->binaries_compiled++;
+	}
 	return sbin;
 }
 
@@ -449,6 +524,7 @@ static int lda_sieve_singlescript_execute
 	ret = sieve_execute(sbin, srctx->msgdata, srctx->scriptenv,
 		exec_ehandler, action_ehandler, rtflags, NULL);
 	sieve_error_handler_unref(&action_ehandler);
+	srctx->stats.scripts_executed++;
 
 	/* Recompile if corrupt binary */
 
@@ -484,6 +560,7 @@ static int lda_sieve_singlescript_execute
 		ret = sieve_execute(sbin, srctx->msgdata, srctx->scriptenv,
 			exec_ehandler, action_ehandler, rtflags, NULL);
 		sieve_error_handler_unref(&action_ehandler);
+		srctx->stats.scripts_executed++;
 
 		/* Save new version */
 
@@ -563,6 +640,7 @@ static int lda_sieve_multiscript_execute
 		more = sieve_multiscript_run(mscript, sbin,
 			exec_ehandler, action_ehandler, rtflags);
 		sieve_error_handler_unref(&action_ehandler);
+		srctx->stats.scripts_executed++;
 
 		if ( !more ) {
 			if ( sieve_multiscript_status(mscript) == SIEVE_EXEC_BIN_CORRUPT &&
@@ -586,6 +664,7 @@ static int lda_sieve_multiscript_execute
 				more = sieve_multiscript_run(mscript, sbin,
 					exec_ehandler, action_ehandler, rtflags);
 				sieve_error_handler_unref(&action_ehandler);
+				srctx->stats.scripts_executed++;
 
 				/* Save new version */
 
@@ -856,6 +935,8 @@ static int lda_sieve_execute
 		scriptenv.reject_mail = lda_sieve_reject_mail;
 		scriptenv.script_context = (void *) mdctx;
 		scriptenv.exec_status = &estatus;
+		if ( srctx->collect_stats )
+			scriptenv.exec_stats = &srctx->stats.exec;
 
 		srctx->scriptenv = &scriptenv;
 
@@ -881,9 +962,14 @@ static int lda_sieve_deliver_mail
 	struct lda_sieve_run_context srctx;
 	bool debug = mdctx->dest_user->mail_debug;
 	struct sieve_environment svenv;
+	struct timeval start, end;
+	long long usecs;
 	unsigned int i;
 	int ret = 0;
 
+	if ( gettimeofday(&start, NULL) < 0 )
+		memset(&start, 0, sizeof(start));
+
 	/* Initialize run context */
 
 	memset(&srctx, 0, sizeof(srctx));
@@ -904,6 +990,15 @@ static int lda_sieve_deliver_mail
 
 	srctx.svinst = sieve_init(&svenv, &lda_sieve_callbacks, mdctx, debug);
 
+	srctx.binary_cache = TRUE;
+	(void)sieve_setting_get_bool_value
+		(srctx.svinst, "sieve_binary_cache", &srctx.binary_cache);
+
+	srctx.stats_file = sieve_setting_get(srctx.svinst, "sieve_stats_file");
+	if ( srctx.stats_file != NULL && *srctx.stats_file == '\0' )
+		srctx.stats_file = NULL;
+	srctx.collect_stats = ( srctx.stats_file != NULL || debug );
+
 	/* Initialize master error handler */
 
 	srctx.master_ehandler =
@@ -930,6 +1025,23 @@ static int lda_sieve_deliver_mail
 		}
 	} T_END;
 
+	/* Report statistics */
+
+	if ( srctx.collect_stats && srctx.script_count > 0 ) T_BEGIN {
+		if ( gettimeofday(&end, NULL) == 0 &&
+			(usecs=timeval_diff_usecs(&end, &start)) > 0 )
+			srctx.stats.total_usecs = usecs;
+
+		if ( debug ) {
+			sieve_sys_debug(srctx.svinst, "Delivery statistics: %s",
+				lda_sieve_stats_format(&srctx.stats, NULL, NULL));
+		}
+		if ( srctx.stats_file != NULL ) {
+			(void)lda_sieve_stats_write(srctx.svinst, srctx.stats_file,
+				&srctx.stats, mdctx->dest_user->username, mdctx->session_id);
+		}
+	} T_END;
+
 	/* Clean up */
 
 	if ( srctx.user_ehandler != NULL )
@@ -957,4 +1069,6 @@ void sieve_plugin_deinit(void)
 {
 	/* Remove hook */
 	mail_deliver_hook_set(next_deliver_mail);
+
+	lda_sieve_cache_deinit();
 }
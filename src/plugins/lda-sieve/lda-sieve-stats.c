@@ -0,0 +1,102 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "str.h"
+#include "strescape.h"
+#include "ioloop.h"
+#include "write-full.h"
+
+#include "sieve.h"
+#include "sieve-error.h"
+
+#include "lda-sieve-stats.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+
+/*
+ * Stats record
+ */
+
+/* Each delivery appends one line to the stats file. Lines are written with a
+   single write() on a file opened with O_APPEND, so many delivery processes
+   can share the same file without locking. A collector that scrapes the file
+   can sum the counters and sort the timings into histograms.
+ */
+
+const char *lda_sieve_stats_format
+(const struct lda_sieve_stats *stats, const char *username,
+	const char *session_id)
+{
+	const struct sieve_exec_stats *exec = &stats->exec;
+	string_t *line;
+	unsigned int i;
+
+	line = t_str_new(256);
+	str_printfa(line, "time=%ld", (long)ioloop_time);
+	if ( session_id != NULL ) {
+		str_append(line, "\tsession=");
+		str_append_tabescaped(line, session_id);
+	}
+	if ( username != NULL ) {
+		str_append(line, "\tuser=");
+		str_append_tabescaped(line, username);
+	}
+
+	str_printfa(line, "\tbinaries_loaded=%u\tbinaries_compiled=%u"
+		"\tbinaries_cached=%u\topen_usecs=%llu",
+		stats->binaries_loaded, stats->binaries_compiled,
+		stats->binaries_cached, stats->open_usecs);
+	str_printfa(line, "\tscripts_executed=%u\tinterpreter_usecs=%llu"
+		"\tresult_usecs=%llu\tmessage_parse_usecs=%llu",
+		stats->scripts_executed, exec->interpreter_usecs,
+		exec->result_usecs, exec->message_parse_usecs);
+
+	str_append(line, "\tactions=");
+	for ( i = 0; i < exec->action_types; i++ ) {
+		if ( i > 0 )
+			str_append_c(line, ',');
+		str_printfa(line, "%s:%u",
+			exec->actions[i].name, exec->actions[i].count);
+	}
+	if ( exec->other_actions > 0 ) {
+		if ( i > 0 )
+			str_append_c(line, ',');
+		str_printfa(line, "other:%u", exec->other_actions);
+	}
+
+	str_printfa(line, "\ttotal_usecs=%llu", stats->total_usecs);
+	return str_c(line);
+}
+
+int lda_sieve_stats_write
+(struct sieve_instance *svinst, const char *path,
+	const struct lda_sieve_stats *stats, const char *username,
+	const char *session_id)
+{
+	const char *line;
+	int fd, ret = 0;
+
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0660);
+	if ( fd == -1 ) {
+		sieve_sys_error(svinst,
+			"failed to open stats file: open(%s) failed: %m", path);
+		return -1;
+	}
+
+	line = t_strconcat
+		(lda_sieve_stats_format(stats, username, session_id), "\n", NULL);
+	if ( write_full(fd, line, strlen(line)) < 0 ) {
+		sieve_sys_error(svinst,
+			"failed to write stats file: write(%s) failed: %m", path);
+		ret = -1;
+	}
+
+	if ( close(fd) < 0 ) {
+		sieve_sys_error(svinst,
+			"failed to close stats file: close(%s) failed: %m", path);
+		ret = -1;
+	}
+	return ret;
+}
@@ -0,0 +1,39 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __LDA_SIEVE_STATS_H
+#define __LDA_SIEVE_STATS_H
+
+#include "sieve-common.h"
+
+/*
+ * Per-delivery statistics
+ */
+
+struct lda_sieve_stats {
+	/* Opening script binaries */
+	unsigned int binaries_loaded;
+	unsigned int binaries_compiled;
+	unsigned int binaries_cached;
+	unsigned long long open_usecs;
+
+	/* Executing scripts */
+	unsigned int scripts_executed;
+	struct sieve_exec_stats exec;
+
+	/* Whole Sieve delivery */
+	unsigned long long total_usecs;
+};
+
+/* Composes a single line of tab-separated key=value pairs */
+const char *lda_sieve_stats_format
+	(const struct lda_sieve_stats *stats, const char *username,
+		const char *session_id);
+
+/* Appends the statistics to the stats file as a single line */
+int lda_sieve_stats_write
+	(struct sieve_instance *svinst, const char *path,
+		const struct lda_sieve_stats *stats, const char *username,
+		const char *session_id);
+
+#endif /* __LDA_SIEVE_STATS_H */
@@ -91,9 +91,19 @@ static int act_pipe_check_duplicate
 static void act_pipe_print
 	(const struct sieve_action *action,
 		const struct sieve_result_print_env *rpenv, bool *keep);	
+static int act_pipe_start
+	(const struct sieve_action *action,
+		const struct sieve_action_exec_env *aenv, void **tr_context);
+static int act_pipe_execute
+	(const struct sieve_action *action,
+		const struct sieve_action_exec_env *aenv, void *tr_context);
 static int act_pipe_commit
 	(const struct sieve_action *action,	
 		const struct sieve_action_exec_env *aenv, void *tr_context, bool *keep);
+static void act_pipe_rollback
+	(const struct sieve_action *action,
+		const struct sieve_action_exec_env *aenv, void *tr_context,
+		bool success);
 
 /* Action object */
 
@@ -102,7 +112,10 @@ const struct sieve_action_def act_pipe = {
 	.flags = SIEVE_ACTFLAG_TRIES_DELIVER,
 	.check_duplicate = act_pipe_check_duplicate, 
 	.print = act_pipe_print,
-	.commit = act_pipe_commit
+	.start = act_pipe_start,
+	.execute = act_pipe_execute,
+	.commit = act_pipe_commit,
+	.rollback = act_pipe_rollback
 };
 
 /* Action context information */
@@ -317,34 +330,73 @@ static void act_pipe_print
 
 /* Result execution */
 
+/* The program is started when the action is executed and only awaited when
+   it is committed. Since all actions are executed before any is committed,
+   several pipe actions in one result run concurrently.
+ */
+
+struct act_pipe_transaction {
+	struct sieve_extprogram *sprog;
+	enum sieve_error error;
+};
+
+static int act_pipe_start
+(const struct sieve_action *action ATTR_UNUSED,
+	const struct sieve_action_exec_env *aenv, void **tr_context)
+{
+	pool_t pool = sieve_result_pool(aenv->result);
+
+	*tr_context = (void *)p_new(pool, struct act_pipe_transaction, 1);
+	return SIEVE_EXEC_OK;
+}
+
+static int act_pipe_execute
+(const struct sieve_action *action,
+	const struct sieve_action_exec_env *aenv, void *tr_context)
+{
+	const struct ext_pipe_action *act =
+		(const struct ext_pipe_action *) action->context;
+	struct act_pipe_transaction *trans =
+		(struct act_pipe_transaction *) tr_context;
+	struct mail *mail =	( action->mail != NULL ?
+		action->mail : sieve_message_get_mail(aenv->msgctx) );
+
+	/* Failure to find the program is reported upon commit */
+	trans->error = SIEVE_ERROR_NONE;
+	trans->sprog = sieve_extprogram_create
+		(action->ext, aenv->scriptenv, aenv->msgdata, "pipe",
+			act->program_name, act->args, &trans->error);
+	if ( trans->sprog == NULL )
+		return SIEVE_EXEC_OK;
+
+	if ( sieve_extprogram_set_input_mail(trans->sprog, mail) < 0 ) {
+		sieve_extprogram_destroy(&trans->sprog);
+		return sieve_result_mail_error(aenv, mail,
+			"pipe action: failed to read input message");
+	}
+
+	sieve_extprogram_run_async(trans->sprog);
+	return SIEVE_EXEC_OK;
+}
+
 static int act_pipe_commit
 (const struct sieve_action *action,
 	const struct sieve_action_exec_env *aenv, 
-	void *tr_context ATTR_UNUSED, bool *keep)
+	void *tr_context, bool *keep)
 {
 	const struct ext_pipe_action *act = 
 		(const struct ext_pipe_action *) action->context;
-	enum sieve_error error = SIEVE_ERROR_NONE;
-	struct mail *mail =	( action->mail != NULL ?
-		action->mail : sieve_message_get_mail(aenv->msgctx) );
-	struct sieve_extprogram *sprog;
+	struct act_pipe_transaction *trans =
+		(struct act_pipe_transaction *) tr_context;
+	enum sieve_error error = trans->error;
 	int ret;
 
-	sprog = sieve_extprogram_create
-		(action->ext, aenv->scriptenv, aenv->msgdata, "pipe",
-			act->program_name, act->args, &error);
-	if ( sprog != NULL ) {
-		if ( sieve_extprogram_set_input_mail(sprog, mail) < 0 ) {
-			sieve_extprogram_destroy(&sprog);
-			return sieve_result_mail_error(aenv, mail,
-				"pipe action: failed to read input message");
-		}
-		ret = sieve_extprogram_run(sprog);
+	if ( trans->sprog != NULL ) {
+		ret = sieve_extprogram_run_wait(trans->sprog);
+		sieve_extprogram_destroy(&trans->sprog);
 	} else {
 		ret = -1;
 	}
-	if ( sprog != NULL )
-		sieve_extprogram_destroy(&sprog);
 
 	if ( ret > 0 ) {
 		sieve_result_global_log(aenv, "pipe action: "
@@ -378,9 +430,15 @@ static int act_pipe_commit
 	return SIEVE_EXEC_OK;
 }
 
+static void act_pipe_rollback
+(const struct sieve_action *action ATTR_UNUSED,
+	const struct sieve_action_exec_env *aenv ATTR_UNUSED, void *tr_context,
+	bool success ATTR_UNUSED)
+{
+	struct act_pipe_transaction *trans =
+		(struct act_pipe_transaction *) tr_context;
 
-
-
-
-
-
+	/* Terminate the program if it is still running */
+	if ( trans != NULL && trans->sprog != NULL )
+		sieve_extprogram_destroy(&trans->sprog);
+}
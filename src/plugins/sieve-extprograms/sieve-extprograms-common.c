@@ -3,6 +3,7 @@
 
 #include "lib.h"
 #include "lib-signals.h"
+#include "ioloop.h"
 #include "str.h"
 #include "strfuncs.h"
 #include "str-sanitize.h"
@@ -63,6 +64,7 @@ struct sieve_extprograms_config *sieve_extprograms_config_init
 	const char *extname = sieve_extension_name(ext);
 	const char *bin_dir, *socket_dir, *input_eol;
 	sieve_number_t execute_timeout;
+	bool socket_persistent;
 
 	extname = strrchr(extname, '.');
 	i_assert(extname != NULL);
@@ -96,6 +98,12 @@ struct sieve_extprograms_config *sieve_extprograms_config_init
 			ext_config->execute_timeout = execute_timeout;
 		}
 
+		if (sieve_setting_get_bool_value
+			(svinst, t_strdup_printf("sieve_%s_socket_persistent", extname),
+				&socket_persistent)) {
+			ext_config->socket_persistent = socket_persistent;
+		}
+
 		ext_config->default_input_eol = SIEVE_EXTPROGRAMS_EOL_CRLF;
 		if (input_eol != NULL && strcasecmp(input_eol, "lf") == 0)
 			ext_config->default_input_eol = SIEVE_EXTPROGRAMS_EOL_LF;
@@ -376,8 +384,15 @@ struct sieve_extprogram {
 	const struct sieve_script_env *scriptenv;
 	struct program_client_settings set;
 	struct program_client *program_client;
+
+	unsigned int async:1;
 };
 
+/* Programs running in the background share a private ioloop, which only runs
+   while the result of one of them is awaited. */
+static struct ioloop *sieve_extprograms_ioloop = NULL;
+static unsigned int sieve_extprograms_async_count = 0;
+
 void sieve_extprogram_exec_error
 (struct sieve_error_handler *ehandler, const char *location,
 	const char *fmt, ...)
@@ -530,7 +545,9 @@ struct sieve_extprogram *sieve_extprogram_create
 	sprog->set.input_idle_timeout_secs = ext_config->execute_timeout;
 	sprog->set.uid = senv->user->uid;
 	sprog->set.gid = senv->user->gid;
+	sprog->set.username = senv->user->username;
 	sprog->set.debug = svinst->debug;
+	sprog->set.remote_persistent = ext_config->socket_persistent;
 
 	if ( fork ) {
 		sprog->program_client =
@@ -562,11 +579,31 @@ struct sieve_extprogram *sieve_extprogram_create
 	return sprog;
 }
 
+static void sieve_extprogram_async_finish(struct sieve_extprogram *sprog)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+
+	if ( !sprog->async )
+		return;
+	sprog->async = FALSE;
+
+	i_assert( sieve_extprograms_async_count > 0 );
+	if ( --sieve_extprograms_async_count > 0 )
+		return;
+
+	/* Last one; ioloops must be destroyed while they are current */
+	io_loop_set_current(sieve_extprograms_ioloop);
+	io_loop_destroy(&sieve_extprograms_ioloop);
+	if ( prev_ioloop != current_ioloop )
+		io_loop_set_current(prev_ioloop);
+}
+
 void sieve_extprogram_destroy(struct sieve_extprogram **_sprog)
 {
 	struct sieve_extprogram *sprog = *_sprog;
 
 	program_client_destroy(&sprog->program_client);
+	sieve_extprogram_async_finish(sprog);
 	i_free(sprog);
 	*_sprog = NULL;
 }
@@ -631,3 +668,31 @@ int sieve_extprogram_run(struct sieve_extprogram *sprog)
 	return program_client_run(sprog->program_client);
 }
 
+void sieve_extprogram_run_async(struct sieve_extprogram *sprog)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+
+	i_assert( !sprog->async );
+
+	if ( sieve_extprograms_ioloop == NULL )
+		sieve_extprograms_ioloop = io_loop_create();
+	else
+		io_loop_set_current(sieve_extprograms_ioloop);
+
+	sprog->async = TRUE;
+	sieve_extprograms_async_count++;
+	program_client_run_async(sprog->program_client);
+
+	io_loop_set_current(prev_ioloop);
+}
+
+int sieve_extprogram_run_wait(struct sieve_extprogram *sprog)
+{
+	int ret;
+
+	i_assert( sprog->async );
+
+	ret = program_client_wait(sprog->program_client);
+	sieve_extprogram_async_finish(sprog);
+	return ret;
+}
@@ -25,6 +25,8 @@ struct sieve_extprograms_config {
 	enum sieve_extprograms_eol default_input_eol;
 
 	unsigned int execute_timeout;
+
+	unsigned int socket_persistent:1;
 };
 
 struct sieve_extprograms_config *sieve_extprograms_config_init
@@ -107,4 +109,11 @@ int sieve_extprogram_set_input_mail
 
 int sieve_extprogram_run(struct sieve_extprogram *sprog);
 
+/* Starts the program in the background, so that it runs concurrently with
+   whatever follows (e.g. the execution of other actions). The result must be
+   collected using sieve_extprogram_run_wait(); destroying the program before
+   that terminates it. */
+void sieve_extprogram_run_async(struct sieve_extprogram *sprog);
+int sieve_extprogram_run_wait(struct sieve_extprogram *sprog);
+
 #endif /* __SIEVE_EXTPROGRAMS_COMMON_H */
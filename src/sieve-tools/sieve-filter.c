@@ -5,10 +5,15 @@
 #include "lib-signals.h"
 #include "ioloop.h"
 #include "env-util.h"
+#include "fd-set-nonblock.h"
 #include "str.h"
 #include "str-sanitize.h"
+#include "strescape.h"
+#include "write-full.h"
+#include "istream.h"
 #include "ostream.h"
 #include "array.h"
+#include "seq-range-array.h"
 #include "mail-namespace.h"
 #include "mail-storage.h"
 #include "mail-search-build.h"
@@ -17,14 +22,27 @@
 #include "sieve.h"
 #include "sieve-extensions.h"
 #include "sieve-binary.h"
+#include "sieve-actions.h"
 
 #include "sieve-tool.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pwd.h>
 #include <sysexits.h>
+#include <sys/wait.h>
+
+/*
+ * Configuration
+ */
+
+/* Interval between progress reports in verbose mode */
+#define SIEVE_FILTER_PROGRESS_INTERVAL_SECS 10
+
+/* Maximum number of parallel worker processes */
+#define SIEVE_FILTER_MAX_WORKERS 64
 
 /*
  * Print help
@@ -33,9 +51,11 @@
 static void print_help(void)
 {
 	printf(
-"Usage: sieve-filter [-c <config-file>] [-C] [-D] [-e] [-m <default-mailbox>]\n"
-"                    [-P <plugin>] [-q <output-mailbox>] [-Q <mail-command>]\n"
-"                    [-s <script-file>] [-u <user>] [-v] [-W] [-x <extensions>]\n"
+"Usage: sieve-filter [-c <config-file>] [-C] [-D] [-e] [-j <workers>]\n"
+"                    [-m <default-mailbox>] [-P <plugin>]\n"
+"                    [-q <output-mailbox>] [-Q <mail-command>]\n"
+"                    [-s <script-file>] [-S <state-file>] [-u <user>] [-v]\n"
+"                    [-W] [-x <extensions>]\n"
 "                    <script-file> <source-mailbox> [<discard-action>]\n"
 	);
 }
@@ -47,6 +67,9 @@ enum sieve_filter_discard_action {
 	SIEVE_FILTER_DACT_EXPUNGE      /* Expunge discarded messages */
 };
 
+/* Codes used by parallel workers to report actions on source messages */
+static const char sieve_filter_dact_codes[] = "KMDE";
+
 struct sieve_filter_data {
 	enum sieve_filter_discard_action discard_action;
 	struct mailbox *move_mailbox;
@@ -55,9 +78,17 @@ struct sieve_filter_data {
 	struct sieve_binary *main_sbin;
 	struct sieve_error_handler *ehandler;
 
+	unsigned int workers;
+
 	unsigned int execute:1;
 	unsigned int source_write:1;
 	unsigned int default_move:1;
+	unsigned int verbose:1;
+};
+
+struct sieve_filter_progress {
+	time_t start_time, last_report;
+	unsigned int processed, total;
 };
 
 struct sieve_filter_context {
@@ -66,8 +97,108 @@ struct sieve_filter_context {
 	struct mailbox_transaction_context *move_trans;
 
 	struct ostream *teststream;
+
+	/* Parallel worker: actions on source messages are reported to the
+	   parent process through this stream rather than applied directly */
+	struct ostream *worker_output;
+
+	struct sieve_filter_progress progress;
 };
 
+/*
+ * Progress reporting
+ */
+
+static void filter_progress_init
+(struct sieve_filter_progress *progress, unsigned int total)
+{
+	memset(progress, 0, sizeof(*progress));
+	progress->start_time = progress->last_report = time(NULL);
+	progress->total = total;
+}
+
+static void filter_progress_report
+(const struct sieve_filter_data *sfdata,
+	struct sieve_filter_progress *progress, bool finished)
+{
+	time_t now;
+	unsigned int secs, rate;
+
+	if ( !sfdata->verbose )
+		return;
+
+	now = time(NULL);
+	if ( !finished &&
+		now - progress->last_report < SIEVE_FILTER_PROGRESS_INTERVAL_SECS )
+		return;
+	progress->last_report = now;
+
+	secs = ( now > progress->start_time ? now - progress->start_time : 0 );
+	rate = ( secs > 0 ? progress->processed / secs : progress->processed );
+
+	if ( finished ) {
+		i_info("filtered %u messages in %u seconds (%u messages/sec)",
+			progress->processed, secs, rate);
+	} else if ( progress->total > 0 ) {
+		i_info("filtered %u of %u messages (%u messages/sec)",
+			progress->processed, progress->total, rate);
+	} else {
+		i_info("filtered %u messages (%u messages/sec)",
+			progress->processed, rate);
+	}
+}
+
+/*
+ * Filtering
+ */
+
+static int filter_message_apply
+(struct sieve_filter_context *sfctx, struct mail *mail,
+	enum sieve_filter_discard_action action)
+{
+	struct sieve_error_handler *ehandler = sfctx->data->ehandler;
+	struct mailbox *move_box = sfctx->data->move_mailbox;
+	struct mail_save_context *save_ctx;
+	enum mail_error error;
+	const char *errstr;
+
+	/* Parallel worker; the parent applies this once all workers are done */
+	if ( sfctx->worker_output != NULL ) {
+		o_stream_send_str(sfctx->worker_output, t_strdup_printf("%u\t%c\n",
+			mail->uid, sieve_filter_dact_codes[action]));
+		return 0;
+	}
+
+	switch ( action ) {
+	case SIEVE_FILTER_DACT_KEEP:
+		break;
+	case SIEVE_FILTER_DACT_MOVE:
+		save_ctx = mailbox_save_alloc(sfctx->move_trans);
+
+		if ( mailbox_copy(&save_ctx, mail) < 0 ) {
+			errstr = mail_storage_get_last_error
+				(mailbox_get_storage(move_box), &error);
+
+			sieve_error(ehandler, NULL,
+				"failed to move message to mailbox %s: %s",
+				mailbox_get_name(move_box), errstr);
+			return -1;
+		}
+
+		mail_expunge(mail);
+		break;
+	case SIEVE_FILTER_DACT_DELETE:
+		mail_update_flags(mail, MODIFY_ADD, MAIL_DELETED);
+		break;
+	case SIEVE_FILTER_DACT_EXPUNGE:
+		mail_expunge(mail);
+		break;
+	default:
+		i_unreached();
+	}
+	return 0;
+}
+
 static int filter_message
 (struct sieve_filter_context *sfctx, struct mail *mail)
 {
@@ -161,8 +292,10 @@ static int filter_message
 			sieve_info(ehandler, NULL,
 				"message expunged from source mailbox upon successful move");
 
-			if ( execute )
-				mail_expunge(mail);
+			if ( execute ) {
+				(void)filter_message_apply
+					(sfctx, mail, SIEVE_FILTER_DACT_EXPUNGE);
+			}
 
 		} else {
 
@@ -177,39 +310,26 @@ static int filter_message
 					"message in source mailbox moved to mailbox '%s'",
 					mailbox_get_name(move_box));
 
-				if ( execute && move_box != NULL ) {
-					struct mailbox_transaction_context *t = sfctx->move_trans;
-					struct mail_save_context *save_ctx;
-
-					save_ctx = mailbox_save_alloc(t);
-
-					if ( mailbox_copy(&save_ctx, mail) < 0 ) {
-						enum mail_error error;
-						const char *errstr;
-
-						errstr = mail_storage_get_last_error
-							(mailbox_get_storage(move_box), &error);
-
-						sieve_error(ehandler, NULL,
-							"failed to move message to mailbox %s: %s",
-							mailbox_get_name(move_box), errstr);
-						return -1;
-				    }
-
-					mail_expunge(mail);
-				}
+				if ( execute && move_box != NULL &&
+					filter_message_apply
+						(sfctx, mail, SIEVE_FILTER_DACT_MOVE) < 0 )
+					return -1;
 				break;
 			/* Flag message as \DELETED */
 			case SIEVE_FILTER_DACT_DELETE:
 				sieve_info(ehandler, NULL, "message flagged as deleted in source mailbox");
-				if ( execute )
-					mail_update_flags(mail, MODIFY_ADD, MAIL_DELETED);
+				if ( execute ) {
+					(void)filter_message_apply
+						(sfctx, mail, SIEVE_FILTER_DACT_DELETE);
+				}
 				break;
 			/* Expunge the message immediately */
 			case SIEVE_FILTER_DACT_EXPUNGE:
 				sieve_info(ehandler, NULL, "message expunged from source mailbox");
-				if ( execute )
-					mail_expunge(mail);
+				if ( execute ) {
+					(void)filter_message_apply
+						(sfctx, mail, SIEVE_FILTER_DACT_EXPUNGE);
+				}
 				break;
 			/* Unknown */
 			default:
@@ -234,7 +354,7 @@ static int filter_message
 			sieve_error(ehandler, NULL,
 				"sieve script execution failed for this message; "
 				"message moved to default mailbox");
-			mail_expunge(mail);
+			(void)filter_message_apply(sfctx, mail, SIEVE_FILTER_DACT_EXPUNGE);
 			return 0;
 		}
 		/* Fall through */
@@ -263,8 +383,38 @@ static void mail_search_build_add_flags
 	args->args = arg;
 }
 
+/* FIXME: introduce this into Dovecot */
+static void mail_search_build_add_uid_range
+(struct mail_search_args *args, uint32_t uid1, uint32_t uid2)
+{
+	struct mail_search_arg *arg;
+
+	arg = p_new(args->pool, struct mail_search_arg, 1);
+	arg->type = SEARCH_UIDSET;
+	p_array_init(&arg->value.seqset, args->pool, 1);
+	seq_range_array_add_range(&arg->value.seqset, uid1, uid2);
+
+	arg->next = args->args;
+	args->args = arg;
+}
+
+static struct mail_search_args *filter_mailbox_search_args
+(uint32_t uid1, uint32_t uid2)
+{
+	struct mail_search_args *search_args;
+
+	/* Search non-deleted messages, optionally within a UID range */
+	search_args = mail_search_build_init();
+	mail_search_build_add_flags(search_args, MAIL_DELETED, TRUE);
+	if ( uid1 > 0 )
+		mail_search_build_add_uid_range(search_args, uid1, uid2);
+
+	return search_args;
+}
+
 static int filter_mailbox
-(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
+(const struct sieve_filter_data *sfdata, struct mailbox *src_box,
+	uint32_t uid1, uint32_t uid2, struct ostream *worker_output)
 {
 	struct sieve_filter_context sfctx;
 	struct mailbox *move_box = sfdata->move_mailbox;
@@ -286,6 +436,8 @@ static int filter_mailbox
 
 	memset(&sfctx, 0, sizeof(sfctx));
 	sfctx.data = sfdata;
+	sfctx.worker_output = worker_output;
+	filter_progress_init(&sfctx.progress, 0);
 
 	/* Create test stream */
 	if ( !sfdata->execute )
@@ -293,15 +445,14 @@ static int filter_mailbox
 
 	/* Start move mailbox transaction */
 
-	if ( move_box != NULL ) {
+	if ( move_box != NULL && worker_output == NULL ) {
 		sfctx.move_trans = mailbox_transaction_begin
 			(move_box, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
 	}
 
 	/* Search non-deleted messages in the source folder */
 
-	search_args = mail_search_build_init();
-	mail_search_build_add_flags(search_args, MAIL_DELETED, TRUE);
+	search_args = filter_mailbox_search_args(uid1, uid2);
 
 	t = mailbox_transaction_begin(src_box, 0);
 	search_ctx = mailbox_search_init(t, search_args, NULL, 0, NULL);
@@ -311,6 +462,12 @@ static int filter_mailbox
 
 	while ( ret >= 0 && mailbox_search_next(search_ctx, &mail) > 0 ) {
 		ret = filter_message(&sfctx, mail);
+
+		sfctx.progress.processed++;
+		if ( worker_output != NULL )
+			o_stream_send_str(worker_output, ".\n");
+		else
+			filter_progress_report(sfdata, &sfctx.progress, FALSE);
 	}
 
 	/* Cleanup */
@@ -332,11 +489,14 @@ static int filter_mailbox
 	if ( sfctx.teststream != NULL )
 		o_stream_destroy(&sfctx.teststream);
 
+	if ( worker_output == NULL )
+		filter_progress_report(sfdata, &sfctx.progress, TRUE);
+
 	if ( ret < 0 ) return ret;
 
 	/* Sync mailbox */
 
-	if ( sfdata->execute ) {
+	if ( sfdata->execute && worker_output == NULL ) {
 		if ( mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_WRITE) < 0 ) {
 			sieve_error(ehandler, NULL, "failed to sync source mailbox");
 			return -1;
@@ -346,6 +506,475 @@ static int filter_mailbox
 	return ret;
 }
 
+/*
+ * Parallel filtering
+ */
+
+/* In parallel mode, the UIDs of the messages in the source mailbox are
+   divided into contiguous ranges, one for each worker process. Each worker
+   opens the source mailbox (read-only) and any target mailboxes by itself and
+   executes the script for the messages in its range. Messages stored by the
+   script are committed by the worker as usual. The actions on the source
+   messages themselves (expunge, flag, move) are reported to the parent
+   process instead. Once all workers have finished, the parent applies these
+   in UID order within a single transaction, so the outcome does not depend on
+   how the workers were scheduled.
+ */
+
+struct sieve_filter_worker {
+	pid_t pid;
+	struct istream *input;
+
+	uint32_t uid1, uid2;
+
+	unsigned int failed:1;
+};
+
+struct sieve_filter_source_action {
+	uint32_t uid;
+	enum sieve_filter_discard_action action;
+};
+ARRAY_DEFINE_TYPE(sieve_filter_source_action,
+	struct sieve_filter_source_action);
+
+static int filter_worker_run
+(const struct sieve_filter_data *sfdata, struct mailbox *parent_box,
+	uint32_t uid1, uint32_t uid2, int fd)
+{
+	struct mailbox *src_box;
+	struct ostream *output;
+	enum mail_error error;
+	int ret;
+
+	/* Open the source mailbox anew; it is modified only by the parent */
+	src_box = mailbox_alloc(mailbox_get_namespace(parent_box)->list,
+		mailbox_get_vname(parent_box),
+		MAILBOX_FLAG_IGNORE_ACLS | MAILBOX_FLAG_READONLY);
+	if ( mailbox_open(src_box) < 0 ) {
+		i_error("Couldn't open source mailbox '%s': %s",
+			mailbox_get_vname(parent_box),
+			mailbox_get_last_error(src_box, &error));
+		mailbox_free(&src_box);
+		return -1;
+	}
+
+	output = o_stream_create_fd(fd, 0, FALSE);
+	ret = filter_mailbox(sfdata, src_box, uid1, uid2, output);
+	if ( o_stream_flush(output) < 0 ) {
+		i_error("write(worker pipe) failed: %m");
+		ret = -1;
+	}
+	o_stream_destroy(&output);
+
+	/* Close the mailboxes used by store actions in this worker */
+	if ( sfdata->senv->mailbox_cache != NULL )
+		sieve_mailbox_cache_destroy(&sfdata->senv->mailbox_cache);
+
+	mailbox_free(&src_box);
+	return ret;
+}
+
+static int filter_worker_read
+(struct sieve_filter_worker *worker,
+	struct sieve_filter_progress *progress,
+	ARRAY_TYPE(sieve_filter_source_action) *actions)
+{
+	const char *line, *code;
+	struct sieve_filter_source_action *sact;
+	unsigned int uid;
+
+	while ( (line=i_stream_read_next_line(worker->input)) != NULL ) {
+		if ( strcmp(line, ".") == 0 ) {
+			progress->processed++;
+			continue;
+		}
+
+		code = strchr(line, '\t');
+		if ( code == NULL || str_to_uint(t_strdup_until(line, code), &uid) < 0 ||
+			uid < worker->uid1 || uid > worker->uid2 ||
+			(code=strchr(sieve_filter_dact_codes, code[1])) == NULL ||
+			*code == '\0' ) {
+			i_error("worker %s sent invalid line: %s",
+				dec2str(worker->pid), line);
+			return -1;
+		}
+
+		sact = array_append_space(actions);
+		sact->uid = uid;
+		sact->action = code - sieve_filter_dact_codes;
+	}
+
+	if ( worker->input->stream_errno != 0 ) {
+		i_error("read(worker pipe) failed: %s",
+			i_stream_get_error(worker->input));
+		return -1;
+	}
+	return ( worker->input->eof ? 0 : 1 );
+}
+
+static int filter_source_action_cmp
+(const struct sieve_filter_source_action *sact1,
+	const struct sieve_filter_source_action *sact2)
+{
+	if ( sact1->uid < sact2->uid )
+		return -1;
+	return ( sact1->uid > sact2->uid ? 1 : 0 );
+}
+
+static void filter_source_actions_drop
+(ARRAY_TYPE(sieve_filter_source_action) *actions,
+	uint32_t uid1, uint32_t uid2)
+{
+	struct sieve_filter_source_action *sacts;
+	unsigned int count, i, j = 0;
+
+	sacts = array_get_modifiable(actions, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( sacts[i].uid < uid1 || sacts[i].uid > uid2 )
+			sacts[j++] = sacts[i];
+	}
+	array_delete(actions, j, count - j);
+}
+
+static int filter_mailbox_apply_actions
+(const struct sieve_filter_data *sfdata, struct mailbox *src_box,
+	ARRAY_TYPE(sieve_filter_source_action) *actions)
+{
+	struct sieve_filter_context sfctx;
+	struct sieve_error_handler *ehandler = sfdata->ehandler;
+	const struct sieve_filter_source_action *sacts;
+	struct mailbox_transaction_context *t;
+	struct mail *mail;
+	unsigned int count, i;
+	int ret = 1;
+
+	if ( mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_READ) < 0 ) {
+		sieve_error(ehandler, NULL, "failed to sync source mailbox");
+		return -1;
+	}
+
+	memset(&sfctx, 0, sizeof(sfctx));
+	sfctx.data = sfdata;
+
+	if ( sfdata->move_mailbox != NULL ) {
+		sfctx.move_trans = mailbox_transaction_begin
+			(sfdata->move_mailbox, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+	}
+
+	t = mailbox_transaction_begin(src_box, 0);
+	mail = mail_alloc(t, 0, NULL);
+
+	/* Apply the actions in UID order */
+	array_sort(actions, filter_source_action_cmp);
+	sacts = array_get(actions, &count);
+	for ( i = 0; i < count && ret >= 0; i++ ) {
+		if ( !mail_set_uid(mail, sacts[i].uid) ) {
+			/* Expunged meanwhile */
+			continue;
+		}
+		if ( filter_message_apply(&sfctx, mail, sacts[i].action) < 0 )
+			ret = -1;
+	}
+
+	mail_free(&mail);
+
+	if ( sfctx.move_trans != NULL ) {
+		if ( mailbox_transaction_commit(&sfctx.move_trans) < 0 ) {
+			ret = -1;
+		}
+	}
+
+	if ( mailbox_transaction_commit(&t) < 0 ) {
+		ret = -1;
+	}
+
+	if ( ret < 0 ) return ret;
+
+	if ( mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_WRITE) < 0 ) {
+		sieve_error(ehandler, NULL, "failed to sync source mailbox");
+		return -1;
+	}
+	return ret;
+}
+
+static int filter_mailbox_get_uids
+(const struct sieve_filter_data *sfdata, struct mailbox *src_box,
+	uint32_t uid1, uint32_t uid2, ARRAY_TYPE(uint32_t) *uids)
+{
+	struct mail_search_args *search_args;
+	struct mailbox_transaction_context *t;
+	struct mail_search_context *search_ctx;
+	struct mail *mail;
+	int ret = 0;
+
+	if ( mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_READ) < 0 ) {
+		sieve_error(sfdata->ehandler, NULL, "failed to sync source mailbox");
+		return -1;
+	}
+
+	search_args = filter_mailbox_search_args(uid1, uid2);
+
+	t = mailbox_transaction_begin(src_box, 0);
+	search_ctx = mailbox_search_init(t, search_args, NULL, 0, NULL);
+	mail_search_args_unref(&search_args);
+
+	while ( mailbox_search_next(search_ctx, &mail) > 0 )
+		array_append(uids, &mail->uid, 1);
+
+	if ( mailbox_search_deinit(&search_ctx) < 0 )
+		ret = -1;
+	(void)mailbox_transaction_commit(&t);
+	return ret;
+}
+
+static int filter_mailbox_parallel
+(const struct sieve_filter_data *sfdata, struct mailbox *src_box,
+	uint32_t uid1, uint32_t uid2)
+{
+	struct sieve_filter_worker *workers;
+	struct sieve_filter_progress progress;
+	ARRAY_TYPE(sieve_filter_source_action) actions;
+	ARRAY_TYPE(uint32_t) uids;
+	const uint32_t *uidv;
+	struct pollfd *pfds;
+	unsigned int count, worker_count, active, i, j;
+	int ret = 1, ret2, status;
+
+	/* Divide the messages among the workers */
+
+	i_array_init(&uids, 1024);
+	if ( filter_mailbox_get_uids(sfdata, src_box, uid1, uid2, &uids) < 0 ) {
+		array_free(&uids);
+		return -1;
+	}
+
+	uidv = array_get(&uids, &count);
+	if ( count == 0 ) {
+		array_free(&uids);
+		return 1;
+	}
+
+	worker_count = I_MIN(sfdata->workers, count);
+	workers = t_new(struct sieve_filter_worker, worker_count);
+	for ( i = 0; i < worker_count; i++ ) {
+		workers[i].uid1 = uidv[(uint64_t)i * count / worker_count];
+		workers[i].uid2 = uidv[(uint64_t)(i + 1) * count / worker_count - 1];
+	}
+	array_free(&uids);
+
+	/* Start the workers */
+
+	for ( i = 0; i < worker_count; i++ ) {
+		int fds[2];
+
+		if ( pipe(fds) < 0 )
+			i_fatal("pipe() failed: %m");
+
+		workers[i].pid = fork();
+		if ( workers[i].pid < 0 )
+			i_fatal("fork() failed: %m");
+
+		if ( workers[i].pid == 0 ) {
+			/* Worker process */
+			for ( j = 0; j < i; j++ )
+				i_stream_destroy(&workers[j].input);
+			i_close_fd(&fds[0]);
+
+			ret = filter_worker_run(sfdata, src_box,
+				workers[i].uid1, workers[i].uid2, fds[1]);
+			_exit( ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS );
+		}
+
+		i_close_fd(&fds[1]);
+		fd_set_nonblock(fds[0], TRUE);
+		workers[i].input = i_stream_create_fd_autoclose(&fds[0], (size_t)-1);
+	}
+
+	/* Collect the reported actions until all workers are finished */
+
+	filter_progress_init(&progress, count);
+	i_array_init(&actions, 1024);
+	pfds = t_new(struct pollfd, worker_count);
+
+	active = worker_count;
+	while ( active > 0 ) {
+		for ( i = 0; i < worker_count; i++ ) {
+			pfds[i].fd = ( workers[i].input == NULL ?
+				-1 : i_stream_get_fd(workers[i].input) );
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+		}
+
+		if ( poll(pfds, worker_count,
+			SIEVE_FILTER_PROGRESS_INTERVAL_SECS * 1000) < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			i_fatal("poll() failed: %m");
+		}
+
+		for ( i = 0; i < worker_count; i++ ) {
+			if ( workers[i].input == NULL || pfds[i].revents == 0 )
+				continue;
+
+			ret2 = filter_worker_read(&workers[i], &progress, &actions);
+			if ( ret2 <= 0 ) {
+				if ( ret2 < 0 ) {
+					workers[i].failed = TRUE;
+					ret = -1;
+				}
+				i_stream_destroy(&workers[i].input);
+				active--;
+			}
+		}
+
+		filter_progress_report(sfdata, &progress, FALSE);
+	}
+
+	/* Wait for the workers to exit */
+
+	for ( i = 0; i < worker_count; i++ ) {
+		if ( waitpid(workers[i].pid, &status, 0) < 0 ) {
+			i_error("waitpid() failed: %m");
+			ret = -1;
+		} else if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+			i_error("worker process %s (UIDs %u:%u) failed",
+				dec2str(workers[i].pid), workers[i].uid1, workers[i].uid2);
+			ret = -1;
+		}
+	}
+
+	filter_progress_report(sfdata, &progress, TRUE);
+
+	/* Apply the reported actions to the source mailbox, even when a worker
+	   failed: these belong to messages that were already stored elsewhere.
+	   The exception is a worker whose report could not be read completely;
+	   its actions are not trusted. */
+
+	for ( i = 0; i < worker_count; i++ ) {
+		if ( workers[i].failed ) {
+			filter_source_actions_drop
+				(&actions, workers[i].uid1, workers[i].uid2);
+		}
+	}
+
+	if ( array_count(&actions) > 0 &&
+		filter_mailbox_apply_actions(sfdata, src_box, &actions) < 0 )
+		ret = -1;
+
+	array_free(&actions);
+	return ret;
+}
+
+/*
+ * Checkpoint state
+ */
+
+/* The state file records for each source mailbox up to which UID the messages
+   were filtered and which compiled script was used for that. A later run only
+   filters the messages that arrived since, unless the UIDVALIDITY of the
+   mailbox or the compiled script changed.
+ */
+
+struct sieve_filter_state {
+	const char *mailbox;
+	uint32_t uid_validity;
+	uint32_t last_uid;
+	const char *digest;
+};
+ARRAY_DEFINE_TYPE(sieve_filter_state, struct sieve_filter_state);
+
+static void filter_state_read
+(const char *path, ARRAY_TYPE(sieve_filter_state) *states)
+{
+	struct sieve_filter_state *state;
+	struct istream *input;
+	const char *line;
+	int fd;
+
+	if ( (fd=open(path, O_RDONLY)) < 0 ) {
+		if ( errno != ENOENT )
+			i_fatal("open(%s) failed: %m", path);
+		return;
+	}
+
+	input = i_stream_create_fd_autoclose(&fd, (size_t)-1);
+	while ( (line=i_stream_read_next_line(input)) != NULL ) {
+		const char *const *args = t_strsplit_tabescaped(line);
+		uint32_t uid_validity, last_uid;
+
+		if ( str_array_length(args) != 4 ||
+			str_to_uint32(args[1], &uid_validity) < 0 ||
+			str_to_uint32(args[2], &last_uid) < 0 ) {
+			i_warning("%s: ignored invalid line: %s", path, line);
+			continue;
+		}
+
+		state = array_append_space(states);
+		state->mailbox = args[0];
+		state->uid_validity = uid_validity;
+		state->last_uid = last_uid;
+		state->digest = args[3];
+	}
+
+	if ( input->stream_errno != 0 ) {
+		i_fatal("read(%s) failed: %s", path, i_stream_get_error(input));
+	}
+	i_stream_destroy(&input);
+}
+
+static int filter_state_write
+(const char *path, const ARRAY_TYPE(sieve_filter_state) *states)
+{
+	const struct sieve_filter_state *state;
+	const char *temp_path;
+	string_t *data;
+	int fd, ret = 0;
+
+	data = t_str_new(256);
+	array_foreach(states, state) {
+		str_append_tabescaped(data, state->mailbox);
+		str_printfa(data, "\t%u\t%u\t", state->uid_validity, state->last_uid);
+		str_append_tabescaped(data, state->digest);
+		str_append_c(data, '\n');
+	}
+
+	/* Replace the state file atomically */
+	temp_path = t_strconcat(path, ".tmp", NULL);
+	if ( (fd=open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 ) {
+		i_error("open(%s) failed: %m", temp_path);
+		return -1;
+	}
+
+	if ( write_full(fd, str_data(data), str_len(data)) < 0 ) {
+		i_error("write(%s) failed: %m", temp_path);
+		ret = -1;
+	}
+	if ( close(fd) < 0 ) {
+		i_error("close(%s) failed: %m", temp_path);
+		ret = -1;
+	}
+
+	if ( ret == 0 && rename(temp_path, path) < 0 ) {
+		i_error("rename(%s, %s) failed: %m", temp_path, path);
+		ret = -1;
+	}
+	if ( ret < 0 )
+		(void)unlink(temp_path);
+	return ret;
+}
+
+static struct sieve_filter_state *filter_state_find
+(ARRAY_TYPE(sieve_filter_state) *states, const char *mailbox)
+{
+	struct sieve_filter_state *state;
+
+	array_foreach_modifiable(states, state) {
+		if ( strcmp(state->mailbox, mailbox) == 0 )
+			return state;
+	}
+	return NULL;
+}
+
 static const char *mailbox_name_to_mutf7(const char *mailbox_utf8)
 {
 	string_t *str = t_str_new(128);
@@ -365,6 +994,11 @@ int main(int argc, char **argv)
 	struct sieve_instance *svinst;
 	ARRAY_TYPE (const_string) scriptfiles;
 	const char *scriptfile,	*src_mailbox, *dst_mailbox, *move_mailbox;
+	const char *state_file = NULL, *digest = NULL;
+	ARRAY_TYPE(sieve_filter_state) states;
+	struct sieve_filter_state *state = NULL;
+	struct mailbox_status status;
+	uint32_t uid1 = 0, uid2 = 0;
 	struct sieve_filter_data sfdata;
 	enum sieve_filter_discard_action discard_action = SIEVE_FILTER_DACT_KEEP;
 	struct mail_user *mail_user;
@@ -376,10 +1010,11 @@ int main(int argc, char **argv)
 	struct mailbox *src_box = NULL, *move_box = NULL;
 	enum mailbox_flags open_flags = MAILBOX_FLAG_IGNORE_ACLS;
 	enum mail_error error;
-	int c;
+	unsigned int workers = 1;
+	int c, ret;
 
 	sieve_tool = sieve_tool_init("sieve-filter", &argc, &argv,
-		"m:s:x:P:u:q:Q:DCevW", FALSE);
+		"m:s:x:P:u:q:Q:j:S:DCevW", FALSE);
 
 	t_array_init(&scriptfiles, 16);
 
@@ -406,6 +1041,10 @@ int main(int argc, char **argv)
 					"The -s argument is currently NOT IMPLEMENTED");
 			}
 			break;
+		case 'S':
+			/* checkpoint state file */
+			state_file = t_strdup(optarg);
+			break;
 		case 'q':
 			i_fatal_status(EX_USAGE,
 				"The -q argument is currently NOT IMPLEMENTED");
@@ -414,6 +1053,15 @@ int main(int argc, char **argv)
 			i_fatal_status(EX_USAGE,
 				"The -Q argument is currently NOT IMPLEMENTED");
 			break;
+		case 'j':
+			/* number of parallel worker processes */
+			if ( str_to_uint(optarg, &workers) < 0 || workers == 0 ||
+				workers > SIEVE_FILTER_MAX_WORKERS ) {
+				i_fatal_status(EX_USAGE,
+					"Invalid number of workers: %s (must be 1-%u)",
+					optarg, SIEVE_FILTER_MAX_WORKERS);
+			}
+			break;
 		case 'e':
 			/* execution mode */
 			execute = TRUE;
@@ -485,6 +1133,11 @@ int main(int argc, char **argv)
 		i_fatal_status(EX_USAGE, "Unknown argument: %s", argv[optind]);
 	}
 
+	if ( workers > 1 && !execute ) {
+		i_fatal_status(EX_USAGE,
+			"The -j argument requires execution mode (-e)");
+	}
+
 	if ( dst_mailbox == NULL ) {
 		dst_mailbox = src_mailbox;
 	} else {
@@ -558,6 +1211,9 @@ int main(int argc, char **argv)
 	scriptenv.user = mail_user;
 	scriptenv.postmaster_address = "postmaster@example.com";
 
+	/* Keep target mailboxes open while filtering all messages */
+	scriptenv.mailbox_cache = sieve_mailbox_cache_create();
+
 	/* Compose filter context */
 	memset(&sfdata, 0, sizeof(sfdata));
 	sfdata.senv = &scriptenv;
@@ -568,9 +1224,68 @@ int main(int argc, char **argv)
 	sfdata.execute = execute;
 	sfdata.source_write = source_write;
 	sfdata.default_move = default_move;
+	sfdata.workers = workers;
+	sfdata.verbose = verbose;
+
+	memset(&status, 0, sizeof(status));
+
+	/* Determine where the previous run left off */
+	if ( state_file != NULL ) {
+		if ( mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_READ) < 0 ) {
+			i_fatal("Couldn't sync source mailbox '%s': %s",
+				src_mailbox, mailbox_get_last_error(src_box, &error));
+		}
+		mailbox_get_open_status
+			(src_box, STATUS_UIDVALIDITY | STATUS_UIDNEXT, &status);
+
+		/* Messages arriving from now on are left for the next run */
+		uid1 = 1;
+		uid2 = status.uidnext - 1;
+
+		digest = sieve_binary_digest(main_sbin);
+		if ( digest == NULL )
+			i_fatal("Failed to read binary for script '%s'", scriptfile);
+
+		t_array_init(&states, 16);
+		filter_state_read(state_file, &states);
+
+		state = filter_state_find(&states, src_mailbox);
+		if ( state != NULL && state->uid_validity == status.uidvalidity &&
+			strcmp(state->digest, digest) == 0 ) {
+			uid1 = state->last_uid + 1;
+			if ( verbose ) {
+				i_info("filtering messages after UID %u of source mailbox",
+					state->last_uid);
+			}
+		} else if ( state != NULL && verbose ) {
+			i_info("source mailbox or script changed since last run; "
+				"filtering all messages");
+		}
+	}
+
+	/* Apply Sieve filter to all (new) messages found */
+	if ( uid1 > 0 && uid1 >= status.uidnext )
+		ret = 0;
+	else if ( workers > 1 )
+		ret = filter_mailbox_parallel(&sfdata, src_box, uid1, uid2);
+	else
+		ret = filter_mailbox(&sfdata, src_box, uid1, uid2, NULL);
+
+	/* Record checkpoint; messages that arrived during filtering have UIDs
+	   beyond the UIDNEXT obtained above and were not filtered */
+	if ( state_file != NULL && execute && ret >= 0 ) {
+		if ( state == NULL ) {
+			state = array_append_space(&states);
+			state->mailbox = src_mailbox;
+		}
+		state->uid_validity = status.uidvalidity;
+		state->last_uid = status.uidnext - 1;
+		state->digest = digest;
+		(void)filter_state_write(state_file, &states);
+	}
 
-	/* Apply Sieve filter to all messages found */
-	(void) filter_mailbox(&sfdata, src_box);
+	/* Close the mailboxes used by store actions */
+	sieve_mailbox_cache_destroy(&scriptenv.mailbox_cache);
 
 	/* Close the source mailbox */
 	if ( src_box != NULL )
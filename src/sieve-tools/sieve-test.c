@@ -17,6 +17,7 @@
 #include "sieve.h"
 #include "sieve-binary.h"
 #include "sieve-extensions.h"
+#include "sieve-profile.h"
 
 #include "sieve-tool.h"
 
@@ -44,7 +45,7 @@ static void print_help(void)
 "Usage: sieve-test [-a <orig-recipient-address] [-c <config-file>]\n"
 "                  [-C] [-D] [-d <dump-filename>] [-e]\n"
 "                  [-f <envelope-sender>] [-l <mail-location>]\n"
-"                  [-m <default-mailbox>] [-P <plugin>]\n"
+"                  [-m <default-mailbox>] [-p <profile-file>] [-P <plugin>]\n"
 "                  [-r <recipient-address>] [-s <script-file>]\n"
 "                  [-t <trace-file>] [-T <trace-option>] [-x <extensions>]\n"
 "                  <script-file> <mail-file>\n"
@@ -123,7 +124,7 @@ int main(int argc, char **argv)
 	struct sieve_instance *svinst;
 	ARRAY_TYPE (const_string) scriptfiles;
 	const char *scriptfile, *recipient, *final_recipient, *sender, *mailbox,
-		*dumpfile, *tracefile, *mailfile, *mailloc;
+		*dumpfile, *tracefile, *profilefile, *mailfile, *mailloc;
 	struct sieve_trace_config tr_config;
 	struct mail *mail;
 	struct sieve_binary *main_sbin, *sbin = NULL;
@@ -133,19 +134,20 @@ int main(int argc, char **argv)
 	struct sieve_error_handler *ehandler, *action_ehandler;
 	struct ostream *teststream = NULL;
 	struct ostream *tracestream = NULL;
+	struct sieve_profile *profile = NULL;
 	bool force_compile = FALSE, execute = FALSE;
 	int exit_status = EXIT_SUCCESS;
 	int ret, c;
 
 	sieve_tool = sieve_tool_init
-		("sieve-test", &argc, &argv, "r:a:f:m:d:l:s:eCt:T:DP:x:u:", FALSE);
+		("sieve-test", &argc, &argv, "r:a:f:m:d:l:s:eCt:T:p:DP:x:u:", FALSE);
 
 	ehandler = action_ehandler = NULL;
 	t_array_init(&scriptfiles, 16);
 
 	/* Parse arguments */
 	recipient = final_recipient = sender = mailbox = dumpfile =
-		tracefile = mailloc = NULL;
+		tracefile = profilefile = mailloc = NULL;
 	memset(&tr_config, 0, sizeof(tr_config));
 	tr_config.level = SIEVE_TRLVL_ACTIONS;
 	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
@@ -178,6 +180,10 @@ int main(int argc, char **argv)
 		case 'T':
 			sieve_tool_parse_trace_option(&tr_config, optarg);
 			break;
+		case 'p':
+			/* profile file */
+			profilefile = optarg;
+			break;
 		case 'd':
 			/* dump file */
 			dumpfile = optarg;
@@ -290,6 +296,9 @@ int main(int argc, char **argv)
 		if ( tracefile != NULL )
 			tracestream = sieve_tool_open_output_stream(tracefile);
 
+		if ( profilefile != NULL )
+			profile = sieve_profile_create();
+
 		/* Compose script environment */
 		memset(&scriptenv, 0, sizeof(scriptenv));
 		scriptenv.default_mailbox = mailbox;
@@ -304,6 +313,7 @@ int main(int argc, char **argv)
 		scriptenv.trace_stream = tracestream;
 		scriptenv.trace_config = tr_config;
 		scriptenv.exec_status = &estatus;
+		scriptenv.profile = profile;
 
 		/* Run the test */
 		ret = 1;
@@ -413,6 +423,16 @@ int main(int argc, char **argv)
 		if ( teststream != NULL )
 			o_stream_destroy(&teststream);
 
+		/* Write execution profile */
+		if ( profile != NULL ) {
+			struct ostream *profilestream =
+				sieve_tool_open_output_stream(profilefile);
+
+			sieve_profile_write(profile, profilestream);
+			o_stream_destroy(&profilestream);
+			sieve_profile_free(&profile);
+		}
+
 		/* Cleanup remaining binaries */
 		if ( sbin != NULL )
 			sieve_close(&sbin);
@@ -30,6 +30,7 @@
 #include "testsuite-log.h"
 #include "testsuite-script.h"
 #include "testsuite-binary.h"
+#include "testsuite-storage.h"
 #include "testsuite-result.h"
 #include "testsuite-smtp.h"
 
@@ -288,6 +289,7 @@ void testsuite_init
 
 	testsuite_script_init();
 	testsuite_binary_init();
+	testsuite_storage_init();
 	testsuite_smtp_init();
 
 	testsuite_ext = sieve_extension_register
@@ -302,6 +304,7 @@ void testsuite_deinit(void)
 	i_free(testsuite_test_path);
 
 	testsuite_smtp_deinit();
+	testsuite_storage_deinit();
 	testsuite_binary_deinit();
 	testsuite_script_deinit();
 
@@ -90,6 +90,9 @@ extern const struct sieve_command_def tst_test_multiscript;
 extern const struct sieve_command_def tst_test_error;
 extern const struct sieve_command_def tst_test_result_action;
 extern const struct sieve_command_def tst_test_result_execute;
+extern const struct sieve_command_def tst_test_storage_putscript;
+extern const struct sieve_command_def tst_test_storage_havespace;
+extern const struct sieve_command_def tst_test_storage_quota_indexed;
 
 /*
  * Operations
@@ -118,7 +121,10 @@ enum testsuite_operation_code {
 	TESTSUITE_OPERATION_TEST_MAILBOX_DELETE,
 	TESTSUITE_OPERATION_TEST_BINARY_LOAD,
 	TESTSUITE_OPERATION_TEST_BINARY_SAVE,
-	TESTSUITE_OPERATION_TEST_IMAP_METADATA_SET
+	TESTSUITE_OPERATION_TEST_IMAP_METADATA_SET,
+	TESTSUITE_OPERATION_TEST_STORAGE_PUTSCRIPT,
+	TESTSUITE_OPERATION_TEST_STORAGE_HAVESPACE,
+	TESTSUITE_OPERATION_TEST_STORAGE_QUOTA_INDEXED
 };
 
 extern const struct sieve_operation_def test_operation;
@@ -144,6 +150,9 @@ extern const struct sieve_operation_def test_mailbox_delete_operation;
 extern const struct sieve_operation_def test_binary_load_operation;
 extern const struct sieve_operation_def test_binary_save_operation;
 extern const struct sieve_operation_def test_imap_metadata_set_operation;
+extern const struct sieve_operation_def test_storage_putscript_operation;
+extern const struct sieve_operation_def test_storage_havespace_operation;
+extern const struct sieve_operation_def test_storage_quota_indexed_operation;
 
 /*
  * Operands
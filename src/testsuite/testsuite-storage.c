@@ -0,0 +1,161 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "istream.h"
+#include "unlink-directory.h"
+
+#include "sieve.h"
+#include "sieve-common.h"
+#include "sieve-script.h"
+#include "sieve-binary.h"
+#include "sieve-storage.h"
+#include "sieve-error.h"
+
+#include "sieve-file-storage.h"
+
+#include "testsuite-common.h"
+#include "testsuite-log.h"
+#include "testsuite-storage.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * State
+ */
+
+static char *testsuite_storage_tmp = NULL;
+
+/*
+ * Initialization
+ */
+
+void testsuite_storage_init(void)
+{
+	testsuite_storage_tmp = i_strconcat
+		(testsuite_tmp_dir_get(), "/sieve", NULL);
+
+	if ( mkdir(testsuite_storage_tmp, 0700) < 0 ) {
+		i_fatal("failed to create temporary directory '%s': %m.",
+			testsuite_storage_tmp);
+	}
+}
+
+void testsuite_storage_deinit(void)
+{
+	if ( unlink_directory(testsuite_storage_tmp, TRUE) < 0 ) {
+		i_warning("failed to remove temporary directory '%s': %m.",
+			testsuite_storage_tmp);
+	}
+
+	i_free(testsuite_storage_tmp);
+}
+
+/*
+ * Script storage access
+ */
+
+static struct sieve_storage *testsuite_storage_create(void)
+{
+	struct sieve_instance *svinst = testsuite_sieve_instance;
+	struct sieve_storage *storage;
+	enum sieve_error error;
+
+	/* Created anew every time, so that changed quota settings apply */
+	storage = sieve_storage_create(svinst,
+		t_strconcat("file:", testsuite_storage_tmp, ";active=",
+			testsuite_tmp_dir_get(), "/dovecot.sieve", NULL),
+		SIEVE_STORAGE_FLAG_READWRITE, &error);
+	if ( storage == NULL ) {
+		sieve_sys_error(svinst, "failed to open script storage %s",
+			testsuite_storage_tmp);
+	}
+	return storage;
+}
+
+static bool testsuite_storage_havespace_check
+(struct sieve_storage *storage, const char *name, size_t size)
+{
+	enum sieve_storage_quota quota;
+	uint64_t limit;
+
+	return ( sieve_storage_quota_havespace
+		(storage, name, size, &quota, &limit) > 0 );
+}
+
+bool testsuite_storage_putscript(const char *name, const char *source)
+{
+	struct sieve_storage *storage;
+	struct sieve_storage_save_context *sctx;
+	struct sieve_script *script;
+	struct sieve_binary *sbin;
+	struct istream *input;
+	enum sieve_error error;
+	size_t size = strlen(source);
+	bool result = FALSE;
+
+	if ( (storage=testsuite_storage_create()) == NULL )
+		return FALSE;
+
+	testsuite_log_clear_messages();
+
+	input = i_stream_create_from_data(source, size);
+	sctx = sieve_storage_save_init(storage, name, input);
+	if ( sctx != NULL ) {
+		if ( sieve_storage_save_continue(sctx) < 0 ||
+			sieve_storage_save_finish(sctx) < 0 ||
+			(script=sieve_storage_save_get_tempscript(sctx)) == NULL ||
+			!testsuite_storage_havespace_check(storage, name, size) ||
+			(sbin=sieve_compile_script(script, testsuite_log_ehandler,
+				SIEVE_COMPILE_FLAG_NOGLOBAL | SIEVE_COMPILE_FLAG_UPLOADED,
+				&error)) == NULL ) {
+			sieve_storage_save_cancel(&sctx);
+		} else {
+			if ( sieve_storage_save_commit(&sctx) >= 0 ) {
+				/* Store the binary alongside the script, as PUTSCRIPT does */
+				script = sieve_storage_open_script(storage, name, &error);
+				if ( script != NULL ) {
+					sieve_binary_set_script(sbin, script);
+					result = ( sieve_script_binary_save
+						(script, sbin, TRUE, &error) >= 0 );
+					sieve_script_unref(&script);
+				}
+			}
+			sieve_close(&sbin);
+		}
+	}
+	i_stream_unref(&input);
+
+	sieve_storage_unref(&storage);
+	return result;
+}
+
+int testsuite_storage_havespace(const char *name, size_t size)
+{
+	struct sieve_storage *storage;
+	bool result;
+
+	if ( (storage=testsuite_storage_create()) == NULL )
+		return -1;
+
+	result = testsuite_storage_havespace_check(storage, name, size);
+
+	sieve_storage_unref(&storage);
+	return ( result ? 1 : 0 );
+}
+
+bool testsuite_storage_quota_indexed(void)
+{
+	struct sieve_storage *storage;
+	bool result;
+
+	if ( (storage=testsuite_storage_create()) == NULL )
+		return FALSE;
+
+	result = sieve_file_storage_quota_index_is_fresh
+		((struct sieve_file_storage *)storage);
+
+	sieve_storage_unref(&storage);
+	return result;
+}
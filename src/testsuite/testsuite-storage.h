@@ -0,0 +1,24 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __TESTSUITE_STORAGE_H
+#define __TESTSUITE_STORAGE_H
+
+#include "sieve-common.h"
+
+void testsuite_storage_init(void);
+void testsuite_storage_deinit(void);
+
+/*
+ * Script storage access
+ */
+
+/* These operate on a file storage in the testsuite's temporary directory,
+   the way the ManageSieve PUTSCRIPT and HAVESPACE commands do. */
+
+bool testsuite_storage_putscript(const char *name, const char *source);
+int testsuite_storage_havespace(const char *name, size_t size);
+
+bool testsuite_storage_quota_indexed(void);
+
+#endif /* __TESTSUITE_STORAGE_H */
@@ -149,9 +149,14 @@ int testsuite_varnamespace_read_variable
 	}
 
 	if ( str_r != NULL ) {
+		const char *tmp_dir;
+
 		if ( strcmp(str_c(var_name), "path") == 0 )
 			*str_r = t_str_new_const(testsuite_test_path, strlen(testsuite_test_path));
-		else
+		else if ( strcmp(str_c(var_name), "tmp") == 0 ) {
+			tmp_dir = testsuite_tmp_dir_get();
+			*str_r = t_str_new_const(tmp_dir, strlen(tmp_dir));
+		} else
 			*str_r = NULL;
 	}
 	return SIEVE_EXEC_OK;
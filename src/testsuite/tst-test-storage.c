@@ -0,0 +1,310 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "sieve-common.h"
+#include "sieve-commands.h"
+#include "sieve-validator.h"
+#include "sieve-generator.h"
+#include "sieve-interpreter.h"
+#include "sieve-code.h"
+#include "sieve-binary.h"
+#include "sieve-dump.h"
+
+#include "testsuite-common.h"
+#include "testsuite-storage.h"
+
+/*
+ * Tests
+ */
+
+static bool tst_test_storage_putscript_validate
+	(struct sieve_validator *valdtr, struct sieve_command *tst);
+static bool tst_test_storage_havespace_validate
+	(struct sieve_validator *valdtr, struct sieve_command *tst);
+static bool tst_test_storage_generate
+	(const struct sieve_codegen_env *cgenv, struct sieve_command *tst);
+
+/* Test_storage_putscript test
+ *
+ * Syntax:
+ *   test_storage_putscript <script-name: string> <source: string>
+ */
+
+const struct sieve_command_def tst_test_storage_putscript = {
+	.identifier = "test_storage_putscript",
+	.type = SCT_TEST,
+	.positional_args = 2,
+	.subtests = 0,
+	.block_allowed = FALSE,
+	.block_required = FALSE,
+	.validate = tst_test_storage_putscript_validate,
+	.generate = tst_test_storage_generate
+};
+
+/* Test_storage_havespace test
+ *
+ * Syntax:
+ *   test_storage_havespace <script-name: string> <size: number>
+ */
+
+const struct sieve_command_def tst_test_storage_havespace = {
+	.identifier = "test_storage_havespace",
+	.type = SCT_TEST,
+	.positional_args = 2,
+	.subtests = 0,
+	.block_allowed = FALSE,
+	.block_required = FALSE,
+	.validate = tst_test_storage_havespace_validate,
+	.generate = tst_test_storage_generate
+};
+
+/* Test_storage_quota_indexed test
+ *
+ * Syntax:
+ *   test_storage_quota_indexed
+ */
+
+const struct sieve_command_def tst_test_storage_quota_indexed = {
+	.identifier = "test_storage_quota_indexed",
+	.type = SCT_TEST,
+	.positional_args = 0,
+	.subtests = 0,
+	.block_allowed = FALSE,
+	.block_required = FALSE,
+	.generate = tst_test_storage_generate
+};
+
+/*
+ * Operations
+ */
+
+static bool tst_test_storage_putscript_operation_dump
+	(const struct sieve_dumptime_env *denv, sieve_size_t *address);
+static int tst_test_storage_putscript_operation_execute
+	(const struct sieve_runtime_env *renv, sieve_size_t *address);
+static bool tst_test_storage_havespace_operation_dump
+	(const struct sieve_dumptime_env *denv, sieve_size_t *address);
+static int tst_test_storage_havespace_operation_execute
+	(const struct sieve_runtime_env *renv, sieve_size_t *address);
+static int tst_test_storage_quota_indexed_operation_execute
+	(const struct sieve_runtime_env *renv, sieve_size_t *address);
+
+/* test_storage_putscript operation */
+
+const struct sieve_operation_def test_storage_putscript_operation = {
+	.mnemonic = "TEST_STORAGE_PUTSCRIPT",
+	.ext_def = &testsuite_extension,
+	.code = TESTSUITE_OPERATION_TEST_STORAGE_PUTSCRIPT,
+	.dump = tst_test_storage_putscript_operation_dump,
+	.execute = tst_test_storage_putscript_operation_execute
+};
+
+/* test_storage_havespace operation */
+
+const struct sieve_operation_def test_storage_havespace_operation = {
+	.mnemonic = "TEST_STORAGE_HAVESPACE",
+	.ext_def = &testsuite_extension,
+	.code = TESTSUITE_OPERATION_TEST_STORAGE_HAVESPACE,
+	.dump = tst_test_storage_havespace_operation_dump,
+	.execute = tst_test_storage_havespace_operation_execute
+};
+
+/* test_storage_quota_indexed operation */
+
+const struct sieve_operation_def test_storage_quota_indexed_operation = {
+	.mnemonic = "TEST_STORAGE_QUOTA_INDEXED",
+	.ext_def = &testsuite_extension,
+	.code = TESTSUITE_OPERATION_TEST_STORAGE_QUOTA_INDEXED,
+	.execute = tst_test_storage_quota_indexed_operation_execute
+};
+
+/*
+ * Validation
+ */
+
+static bool tst_test_storage_putscript_validate
+(struct sieve_validator *valdtr, struct sieve_command *tst)
+{
+	struct sieve_ast_argument *arg = tst->first_positional;
+
+	if ( !sieve_validate_positional_argument
+		(valdtr, tst, arg, "script-name", 1, SAAT_STRING) ) {
+		return FALSE;
+	}
+
+	if ( !sieve_validator_argument_activate(valdtr, tst, arg, FALSE) )
+		return FALSE;
+
+	arg = sieve_ast_argument_next(arg);
+
+	if ( !sieve_validate_positional_argument
+		(valdtr, tst, arg, "source", 2, SAAT_STRING) ) {
+		return FALSE;
+	}
+
+	return sieve_validator_argument_activate(valdtr, tst, arg, FALSE);
+}
+
+static bool tst_test_storage_havespace_validate
+(struct sieve_validator *valdtr, struct sieve_command *tst)
+{
+	struct sieve_ast_argument *arg = tst->first_positional;
+
+	if ( !sieve_validate_positional_argument
+		(valdtr, tst, arg, "script-name", 1, SAAT_STRING) ) {
+		return FALSE;
+	}
+
+	if ( !sieve_validator_argument_activate(valdtr, tst, arg, FALSE) )
+		return FALSE;
+
+	arg = sieve_ast_argument_next(arg);
+
+	if ( !sieve_validate_positional_argument
+		(valdtr, tst, arg, "size", 2, SAAT_NUMBER) ) {
+		return FALSE;
+	}
+
+	return sieve_validator_argument_activate(valdtr, tst, arg, FALSE);
+}
+
+/*
+ * Code generation
+ */
+
+static bool tst_test_storage_generate
+(const struct sieve_codegen_env *cgenv, struct sieve_command *tst)
+{
+	/* Emit operation */
+	if ( sieve_command_is(tst, tst_test_storage_putscript) ) {
+		sieve_operation_emit(cgenv->sblock, tst->ext,
+			&test_storage_putscript_operation);
+	} else if ( sieve_command_is(tst, tst_test_storage_havespace) ) {
+		sieve_operation_emit(cgenv->sblock, tst->ext,
+			&test_storage_havespace_operation);
+	} else if ( sieve_command_is(tst, tst_test_storage_quota_indexed) ) {
+		sieve_operation_emit(cgenv->sblock, tst->ext,
+			&test_storage_quota_indexed_operation);
+	} else {
+		i_unreached();
+	}
+
+	/* Generate arguments */
+	return sieve_generate_arguments(cgenv, tst, NULL);
+}
+
+/*
+ * Code dump
+ */
+
+static bool tst_test_storage_putscript_operation_dump
+(const struct sieve_dumptime_env *denv, sieve_size_t *address)
+{
+	sieve_code_dumpf(denv, "TEST_STORAGE_PUTSCRIPT:");
+	sieve_code_descend(denv);
+
+	return
+		sieve_opr_string_dump(denv, address, "script-name") &&
+		sieve_opr_string_dump(denv, address, "source");
+}
+
+static bool tst_test_storage_havespace_operation_dump
+(const struct sieve_dumptime_env *denv, sieve_size_t *address)
+{
+	sieve_code_dumpf(denv, "TEST_STORAGE_HAVESPACE:");
+	sieve_code_descend(denv);
+
+	return
+		sieve_opr_string_dump(denv, address, "script-name") &&
+		sieve_opr_number_dump(denv, address, "size");
+}
+
+/*
+ * Intepretation
+ */
+
+static int tst_test_storage_putscript_operation_execute
+(const struct sieve_runtime_env *renv, sieve_size_t *address)
+{
+	string_t *script_name, *source;
+	bool result;
+	int ret;
+
+	/*
+	 * Read operands
+	 */
+
+	if ( (ret=sieve_opr_string_read
+		(renv, address, "script-name", &script_name)) <= 0 )
+		return ret;
+	if ( (ret=sieve_opr_string_read(renv, address, "source", &source)) <= 0 )
+		return ret;
+
+	/*
+	 * Perform operation
+	 */
+
+	if ( sieve_runtime_trace_active(renv, SIEVE_TRLVL_TESTS) ) {
+		sieve_runtime_trace(renv, 0, "testsuite: test_storage_putscript test");
+		sieve_runtime_trace_descend(renv);
+		sieve_runtime_trace(renv, 0, "put script `%s'", str_c(script_name));
+	}
+
+	result = testsuite_storage_putscript(str_c(script_name), str_c(source));
+
+	/* Set result */
+	sieve_interpreter_set_test_result(renv->interp, result);
+	return SIEVE_EXEC_OK;
+}
+
+static int tst_test_storage_havespace_operation_execute
+(const struct sieve_runtime_env *renv, sieve_size_t *address)
+{
+	string_t *script_name;
+	sieve_number_t size;
+	int ret;
+
+	/*
+	 * Read operands
+	 */
+
+	if ( (ret=sieve_opr_string_read
+		(renv, address, "script-name", &script_name)) <= 0 )
+		return ret;
+	if ( (ret=sieve_opr_number_read(renv, address, "size", &size)) <= 0 )
+		return ret;
+
+	/*
+	 * Perform operation
+	 */
+
+	if ( sieve_runtime_trace_active(renv, SIEVE_TRLVL_TESTS) ) {
+		sieve_runtime_trace(renv, 0, "testsuite: test_storage_havespace test");
+		sieve_runtime_trace_descend(renv);
+		sieve_runtime_trace(renv, 0, "check space for script `%s' of size %llu",
+			str_c(script_name), (unsigned long long)size);
+	}
+
+	ret = testsuite_storage_havespace(str_c(script_name), (size_t)size);
+	if ( ret < 0 )
+		return SIEVE_EXEC_FAILURE;
+
+	/* Set result */
+	sieve_interpreter_set_test_result(renv->interp, ret > 0);
+	return SIEVE_EXEC_OK;
+}
+
+static int tst_test_storage_quota_indexed_operation_execute
+(const struct sieve_runtime_env *renv, sieve_size_t *address ATTR_UNUSED)
+{
+	bool result;
+
+	if ( sieve_runtime_trace_active(renv, SIEVE_TRLVL_TESTS) )
+		sieve_runtime_trace(renv, 0, "testsuite: test_storage_quota_indexed test");
+
+	result = testsuite_storage_quota_indexed();
+
+	/* Set result */
+	sieve_interpreter_set_test_result(renv->interp, result);
+	return SIEVE_EXEC_OK;
+}